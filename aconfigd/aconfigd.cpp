@@ -14,20 +14,45 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/scopeguard.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <cutils/sockets.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/message_lite.h>
 
 #include <aconfig_storage/aconfig_storage_read_api.hpp>
 #include <aconfig_storage/aconfig_storage_write_api.hpp>
 #include <protos/aconfig_storage_metadata.pb.h>
 
+#include "aconfigd/value_snapshot.h"
+#include "aconfigd_async_io.h"
+#include "aconfigd_boot_index.h"
+#include "aconfigd_config.h"
+#include "aconfigd_mapping_cache.h"
+#include "aconfigd_stats.h"
+#include "aconfigd_storage_file.h"
+#include "aconfigd_subscription.h"
 #include "aconfigd_util.h"
+#include "aconfigd_value_kernels.h"
+#include "aconfigd_value_mirror.h"
+#include "aconfigd_value_snapshot.h"
 #include "aconfigd.h"
 
 using storage_records_pb = android::aconfig_storage_metadata::storage_files;
@@ -37,14 +62,6 @@ using namespace android::base;
 namespace android {
 namespace aconfigd {
 
-/// Persistent storage records pb file full path
-static constexpr char kPersistentStorageRecordsFileName[] =
-    "/metadata/aconfig/persistent_storage_file_records.pb";
-
-/// Persistent storage records pb file full path
-static constexpr char kAvailableStorageRecordsFileName[] =
-    "/metadata/aconfig/boot/available_storage_file_records.pb";
-
 /// In memory data structure for storage file locations for each container
 struct StorageRecord {
   int version;
@@ -54,6 +71,10 @@ struct StorageRecord {
   std::string flag_val;
   std::string flag_info;
   int timestamp;
+  uint64_t package_map_digest = 0;
+  uint64_t flag_map_digest = 0;
+  uint64_t flag_val_digest = 0;
+  std::string default_flag_val;
 
   StorageRecord() = default;
 
@@ -71,14 +92,30 @@ struct StorageRecord {
 /// A map from container name to the respective storage file locations
 using StorageRecords = std::unordered_map<std::string, StorageRecord>;
 
-/// In memory storage file records. Parsed from the pb.
+/// In memory storage file records. Parsed from the pb, when serving from the boot
+/// index only once a request needs them.
 static StorageRecords persist_storage_records;
+static std::atomic<bool> storage_records_loaded = false;
+static std::mutex storage_records_mutex;
 
-/// In memory cache for package to container mapping
+/// In memory cache for package to container mapping, guarded by container_map_mutex
 static std::unordered_map<std::string, std::string> container_map;
+static std::mutex container_map_mutex;
 
 namespace {
 
+/// Load the persistent storage records if serving started from the boot index
+Result<void> EnsureStorageRecordsLoaded() {
+  if (storage_records_loaded.load(std::memory_order_acquire)) {
+    return {};
+  }
+  auto lock = std::lock_guard(storage_records_mutex);
+  if (storage_records_loaded.load(std::memory_order_relaxed)) {
+    return {};
+  }
+  return InitializeInMemoryStorageRecords();
+}
+
 /// Read persistent aconfig storage records pb file
 Result<storage_records_pb> ReadStorageRecordsPb(const std::string& pb_file) {
   auto records = storage_records_pb();
@@ -95,28 +132,45 @@ Result<storage_records_pb> ReadStorageRecordsPb(const std::string& pb_file) {
   return records;
 }
 
-/// Write aconfig storage records protobuf to file
-Result<void> WriteStorageRecordsPbToFile(const storage_records_pb& records_pb,
-                                         const std::string& file_name) {
+/// Write a protobuf to file through a publisher, so readers never observe a partially
+/// written file and a crash never leaves one behind
+Result<void> WritePbToFile(const google::protobuf::MessageLite& pb,
+                           const std::string& file_name,
+                           FilePublisher& publisher) {
   auto content = std::string();
-  if (!records_pb.SerializeToString(&content)) {
-    return ErrnoError() << "Unable to serialize storage records protobuf";
+  if (!pb.SerializeToString(&content)) {
+    return ErrnoError() << "Unable to serialize protobuf";
   }
+  return publisher.WriteFile(content, file_name, 0644);
+}
 
-  if (!WriteStringToFile(content, file_name)) {
-    return ErrnoError() << "WriteStringToFile failed";
-  }
+/// Write aconfig storage records protobuf to file
+Result<void> WriteStorageRecordsPbToFile(const storage_records_pb& records_pb,
+                                         const std::string& file_name,
+                                         FilePublisher& publisher) {
+  return WritePbToFile(records_pb, file_name, publisher);
+}
 
-  if (chmod(file_name.c_str(), 0644) == -1) {
-    return ErrnoError() << "chmod failed";
-  };
+/// Read persistent aconfig storage record extensions pb file
+Result<StorageRecordExtensions> ReadStorageRecordExtensionsPb(const std::string& pb_file) {
+  auto extensions = StorageRecordExtensions();
+  if (FileExists(pb_file)) {
+    auto content = std::string();
+    if (!ReadFileToString(pb_file, &content)) {
+      return ErrnoError() << "ReadFileToString failed";
+    }
 
-  return {};
+    if (!extensions.ParseFromString(content)) {
+      return ErrnoError() << "Unable to parse storage record extensions protobuf";
+    }
+  }
+  return extensions;
 }
 
 /// Write in memory aconfig storage records to the persistent pb file
 Result<void> WritePersistentStorageRecordsToFile() {
   auto records_pb = storage_records_pb();
+  auto extensions_pb = StorageRecordExtensions();
   for (auto const& [container, entry] : persist_storage_records) {
     auto* record_pb = records_pb.add_files();
     record_pb->set_version(entry.version);
@@ -126,69 +180,394 @@ Result<void> WritePersistentStorageRecordsToFile() {
     record_pb->set_flag_val(entry.flag_val);
     record_pb->set_flag_info(entry.flag_info);
     record_pb->set_timestamp(entry.timestamp);
+
+    auto* extension_pb = extensions_pb.add_records();
+    extension_pb->set_container(entry.container);
+    extension_pb->set_package_map_digest(entry.package_map_digest);
+    extension_pb->set_flag_map_digest(entry.flag_map_digest);
+    extension_pb->set_flag_val_digest(entry.flag_val_digest);
+    extension_pb->set_default_flag_val(entry.default_flag_val);
   }
 
-  return WriteStorageRecordsPbToFile(records_pb, kPersistentStorageRecordsFileName);
+  // both files are in the storage root, they share a dir sync
+  auto publisher = FilePublisher();
+  auto write_result = WritePbToFile(
+      extensions_pb, GetPersistentStorageRecordExtensionsFile(), publisher);
+  if (!write_result.ok()) {
+    return Error() << "Failed to write storage record extensions: "
+                   << write_result.error();
+  }
+
+  write_result = WriteStorageRecordsPbToFile(
+      records_pb, GetPersistentStorageRecordsFile(), publisher);
+  if (!write_result.ok()) {
+    return Error() << write_result.error();
+  }
+  return publisher.Commit();
 }
 
-/// Create boot flag value copy for a container
-Result<void> CreateBootSnapshotForContainer(const std::string& container) {
-  // check existence persistent storage copy
-  if (!persist_storage_records.count(container)) {
-    return Error() << "Missing persistent storage records for " << container;
+/// Create boot flag value copies for a batch of containers. The available storage
+/// records pb is read and written back once for the whole batch. Returns the result of
+/// each container, in order. A container that fails does not keep the others from
+/// getting their records, and leaves no boot copy behind, since a later batch would
+/// skip a container that has one.
+std::vector<Result<void>> CreateBootSnapshotForContainers(
+    const std::vector<std::string>& containers) {
+  auto load_result = EnsureStorageRecordsLoaded();
+  if (!load_result.ok()) {
+    return std::vector<Result<void>>(
+        containers.size(), Result<void>(Error() << load_result.error()));
+  }
+
+  auto records_pb = ReadStorageRecordsPb(GetAvailableStorageRecordsFile());
+  if (!records_pb.ok()) {
+    return std::vector<Result<void>>(
+        containers.size(),
+        Result<void>(Error() << "Unable to read available storage records: "
+                             << records_pb.error()));
   }
 
-  // create boot copy
-  auto src_value_file = std::string("/metadata/aconfig/flags/") + container + ".val";
-  auto dst_value_file = std::string("/metadata/aconfig/boot/") + container + ".val";
-  auto src_info_file = std::string("/metadata/aconfig/flags/") + container + ".info";
-  auto dst_info_file = std::string("/metadata/aconfig/boot/") + container + ".info";
+  // boot copies of all containers and the records pointing at them share a dir sync
+  auto results = std::vector<Result<void>>(containers.size(), Result<void>());
+  auto publisher = FilePublisher();
+  auto copied_files = std::vector<std::string>();
+  for (size_t i = 0; i < containers.size(); ++i) {
+    auto const& container = containers[i];
 
-  // If the boot copy already exists, do nothing. Never update the boot copy, the boot
-  // copy should be boot stable. So in the following scenario: a container storage
-  // file boot copy is created, then an updated container is mounted along side existing
-  // container. In this case, we should update the persistent storage file copy. But
-  // never touch the current boot copy.
-  if (FileExists(dst_value_file) || FileExists(dst_info_file)) {
-    return {};
+    // check existence persistent storage copy
+    if (!persist_storage_records.count(container)) {
+      results[i] = Error() << "Missing persistent storage records for " << container;
+      continue;
+    }
+
+    // create boot copy
+    auto src_value_file = GetFlagsDir() + "/" + container + ".val";
+    auto dst_value_file = GetBootDir() + "/" + container + ".val";
+    auto src_info_file = GetFlagsDir() + "/" + container + ".info";
+    auto dst_info_file = GetBootDir() + "/" + container + ".info";
+
+    // If the boot copy already exists, do nothing. Never update the boot copy, the boot
+    // copy should be boot stable. So in the following scenario: a container storage
+    // file boot copy is created, then an updated container is mounted along side existing
+    // container. In this case, we should update the persistent storage file copy. But
+    // never touch the current boot copy.
+    if (FileExists(dst_value_file) || FileExists(dst_info_file)) {
+      continue;
+    }
+
+    auto copy_result = publisher.CopyFile(src_value_file, dst_value_file, 0444);
+    if (!copy_result.ok()) {
+      results[i] = Error() << "CopyFile failed for " << src_value_file << " :"
+                           << copy_result.error();
+      continue;
+    }
+
+    copy_result = publisher.CopyFile(src_info_file, dst_info_file, 0444);
+    if (!copy_result.ok()) {
+      unlink(dst_value_file.c_str());
+      results[i] = Error() << "CopyFile failed for " << src_info_file << " :"
+                           << copy_result.error();
+      continue;
+    }
+    copied_files.push_back(dst_value_file);
+    copied_files.push_back(dst_info_file);
+
+    auto const& entry = persist_storage_records[container];
+    auto* record_pb = records_pb->add_files();
+    record_pb->set_version(entry.version);
+    record_pb->set_container(entry.container);
+    record_pb->set_package_map(entry.package_map);
+    record_pb->set_flag_map(entry.flag_map);
+    record_pb->set_flag_val(dst_value_file);
+    record_pb->set_flag_info(dst_info_file);
+    record_pb->set_timestamp(entry.timestamp);
+  }
+
+  // update available storage records pb
+  auto write_result = Result<void>();
+  if (!copied_files.empty()) {
+    write_result = WriteStorageRecordsPbToFile(
+        *records_pb, GetAvailableStorageRecordsFile(), publisher);
+    if (!write_result.ok()) {
+      for (auto const& file : copied_files) {
+        unlink(file.c_str());
+      }
+      write_result = Error() << "Failed to write available storage records: "
+                             << write_result.error();
+    }
+  }
+  if (write_result.ok()) {
+    write_result = publisher.Commit();
+  }
+
+  if (!write_result.ok()) {
+    for (auto& result : results) {
+      if (result.ok()) {
+        result = Error() << write_result.error();
+      }
+    }
+  }
+  return results;
+}
+
+/// Content digests of a container's storage files
+struct StorageDigests {
+  uint64_t package_map;
+  uint64_t flag_map;
+  uint64_t flag_val;
+};
+
+/// Compute content digests of a container's storage files
+Result<StorageDigests> GetStorageDigests(const std::string& package_file,
+                                         const std::string& flag_file,
+                                         const std::string& value_file) {
+  auto digests = StorageDigests();
+  auto const files = std::vector<std::pair<std::string, uint64_t*>>{
+    {package_file, &digests.package_map},
+    {flag_file, &digests.flag_map},
+    {value_file, &digests.flag_val}};
+
+  for (auto const& [file, digest] : files) {
+    auto digest_result = GetFileDigest(file);
+    if (!digest_result.ok()) {
+      return Error() << "Failed to get digest of " << file << ": "
+                     << digest_result.error();
+    }
+    *digest = *digest_result;
+  }
+
+  return digests;
+}
+
+/// Check if a storage record was created from files with the given content digests.
+/// Records written before digests were tracked fall back to timestamp comparison.
+bool IsSameStorageContent(const StorageRecord& record,
+                          const StorageDigests& digests,
+                          int timestamp) {
+  if (record.package_map_digest == 0 && record.flag_map_digest == 0
+      && record.flag_val_digest == 0) {
+    return record.timestamp == timestamp;
+  }
+  return record.package_map_digest == digests.package_map
+      && record.flag_map_digest == digests.flag_map
+      && record.flag_val_digest == digests.flag_val;
+}
+
+/// Remove cached flag info files of a container, except keep_file
+void RemoveStaleFlagInfoCache(const std::string& container,
+                              const std::string& keep_file) {
+  auto dir = std::unique_ptr<DIR, int (*)(DIR*)>(opendir(GetFlagsDir().c_str()),
+                                                 closedir);
+  if (!dir) {
+    return;
+  }
+  auto prefix = container + ".info.";
+  auto to_delete = std::vector<std::string>();
+  while (auto* entry = readdir(dir.get())) {
+    auto file = GetFlagsDir() + "/" + entry->d_name;
+    if (StartsWith(entry->d_name, prefix) && file != keep_file) {
+      to_delete.push_back(file);
+    }
+  }
+  for (auto const& file : to_delete) {
+    unlink(file.c_str());
+  }
+}
+
+/// Create the flag info file of a container. Flag info only depends on the package
+/// and flag maps, so a pristine copy is kept keyed by their digests, and an update
+/// that only changes flag values copies it rather than generating it again.
+Result<void> CreateFlagInfoFile(const std::string& container,
+                                const std::string& package_file,
+                                const std::string& flag_file,
+                                const StorageDigests& digests,
+                                const std::string& flag_info_file,
+                                FilePublisher& publisher) {
+  auto cache_file = GetFlagInfoCacheFile(container, digests.package_map,
+                                         digests.flag_map);
+  if (FileExists(cache_file)) {
+    auto copy_result = publisher.CopyFile(cache_file, flag_info_file, 0644);
+    if (copy_result.ok()) {
+      return {};
+    }
+    LOG(WARNING) << "Failed to copy cached flag info " << cache_file
+                 << ", creating it again: " << copy_result.error();
+  }
+
+  // created next to the target and published, so a crash never leaves a torn file
+  auto tmp_file = flag_info_file + ".tmp";
+  unlink(tmp_file.c_str());
+  auto create_result = aconfig_storage::create_flag_info(
+      package_file, flag_file, tmp_file);
+  if (!create_result.ok()) {
+    unlink(tmp_file.c_str());
+    return Error() << "Failed to create flag info file for container " << container
+                   << ": " << create_result.error();
   }
 
-  auto copy_result = CopyFile(src_value_file, dst_value_file, 0444);
+  auto tmp_fd = unique_fd(TEMP_FAILURE_RETRY(
+      open(tmp_file.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC)));
+  if (tmp_fd == -1) {
+    unlink(tmp_file.c_str());
+    return ErrnoError() << "open() failed for " << tmp_file;
+  }
+  auto publish_result = publisher.PublishTempFile(tmp_fd.get(), tmp_file,
+                                                  flag_info_file);
+  if (!publish_result.ok()) {
+    return Error() << "Failed to publish flag info file for container " << container
+                   << ": " << publish_result.error();
+  }
+
+  // the cache only holds the flag info of the current maps of each container
+  RemoveStaleFlagInfoCache(container, cache_file);
+  auto copy_result = publisher.CopyFile(flag_info_file, cache_file, 0644);
   if (!copy_result.ok()) {
-    return Error() << "CopyFile failed for " << src_value_file << " :"
-                   << copy_result.error();
+    LOG(WARNING) << "Failed to cache flag info of " << container << ": "
+                 << copy_result.error();
+  }
+  return {};
+}
+
+/// Updates of containers handled together. Their flag value and info copies share a
+/// dir sync, and the persistent storage records are written once for all of them.
+struct ContainerUpdateBatch {
+  /// Flag value and info copies, durable before the records pointing at them are
+  FilePublisher publisher;
+  /// Containers whose record only got new file locations or digests
+  std::vector<std::string> refreshed;
+  /// Containers with a new flag value copy
+  std::vector<std::string> updated;
+};
+
+/// Stage the update of a container whose storage files have the given timestamp and
+/// digests, returns if container has been updated. The in memory record is updated
+/// right away, the records file and mappings by FinishContainerUpdates.
+Result<bool> StageContainerUpdate(const std::string& container,
+                                  const std::string& package_file,
+                                  const std::string& flag_file,
+                                  const std::string& value_file,
+                                  int timestamp,
+                                  const StorageDigests& digests,
+                                  ContainerUpdateBatch& batch) {
+  auto load_result = EnsureStorageRecordsLoaded();
+  if (!load_result.ok()) {
+    return Error() << load_result.error();
+  }
+
+  // the storage record of a container needs to be updated if this is the first time
+  // we encountered this container or the container content has changed. A touched
+  // timestamp alone does not require a new copy.
+  auto it = persist_storage_records.find(container);
+  if (it != persist_storage_records.end()
+      && IsSameStorageContent(it->second, digests, timestamp)) {
+    // refresh the record if only the timestamp or the file locations changed, or
+    // digests were not tracked yet
+    auto& record = it->second;
+    if (record.timestamp != timestamp || record.flag_val_digest != digests.flag_val
+        || record.package_map != package_file || record.flag_map != flag_file
+        || record.default_flag_val != value_file) {
+      record.package_map = package_file;
+      record.flag_map = flag_file;
+      record.default_flag_val = value_file;
+      record.timestamp = timestamp;
+      record.package_map_digest = digests.package_map;
+      record.flag_map_digest = digests.flag_map;
+      record.flag_val_digest = digests.flag_val;
+      batch.refreshed.push_back(container);
+    }
+
+    // a snapshot that is missing, from an older format or from another layout is
+    // replaced, a current one is left as is
+    auto publish_result = PublishValueSnapshot(
+        container, record.flag_val, record.package_map_digest, record.flag_map_digest);
+    if (!publish_result.ok()) {
+      return Error() << "Failed to publish value snapshot: " << publish_result.error();
+    }
+    return false;
   }
 
-  copy_result = CopyFile(src_info_file, dst_info_file, 0444);
+  // copy flag value file
+  auto target_value_file = GetFlagsDir() + "/" + container + ".val";
+  auto copy_result = batch.publisher.CopyFile(value_file, target_value_file, 0644);
   if (!copy_result.ok()) {
-    return Error() << "CopyFile failed for " << src_info_file << " :"
+    return Error() << "CopyFile failed for " << value_file << " :"
                    << copy_result.error();
   }
+  LOG(INFO) << "copied " << value_file << " to " << target_value_file << " using "
+            << CopyMethodName(*copy_result);
 
-  // update available storage records pb
-  auto const& entry = persist_storage_records[container];
-  auto records_pb = ReadStorageRecordsPb(kAvailableStorageRecordsFileName);
-  if (!records_pb.ok()) {
-    return Error() << "Unable to read available storage records: "
-                   << records_pb.error();
+  auto version_result = aconfig_storage::get_storage_file_version(value_file);
+  if (!version_result.ok()) {
+    return Error() << "Failed to get storage version: " << version_result.error();
+  }
+
+  // create flag info file
+  auto flag_info_file = GetFlagsDir() + "/" + container + ".info";
+  auto create_result = CreateFlagInfoFile(container, package_file, flag_file,
+                                          digests, flag_info_file, batch.publisher);
+  if (!create_result.ok()) {
+    return Error() << create_result.error();
+  }
+
+  // add to in memory storage file records
+  auto& record = persist_storage_records[container];
+  record.version = *version_result;
+  record.container = container;
+  record.package_map = package_file;
+  record.flag_map = flag_file;
+  record.flag_val = target_value_file;
+  record.flag_info = flag_info_file;
+  record.timestamp = timestamp;
+  record.package_map_digest = digests.package_map;
+  record.flag_map_digest = digests.flag_map;
+  record.flag_val_digest = digests.flag_val;
+  record.default_flag_val = value_file;
+  batch.updated.push_back(container);
+  return true;
+}
+
+/// Make the container updates of a batch durable and visible
+Result<void> FinishContainerUpdates(ContainerUpdateBatch& batch) {
+  if (batch.refreshed.empty() && batch.updated.empty()) {
+    return {};
   }
 
-  auto* record_pb = records_pb->add_files();
-  record_pb->set_version(entry.version);
-  record_pb->set_container(entry.container);
-  record_pb->set_package_map(entry.package_map);
-  record_pb->set_flag_map(entry.flag_map);
-  record_pb->set_flag_val(dst_value_file);
-  record_pb->set_flag_info(dst_info_file);
-  record_pb->set_timestamp(entry.timestamp);
+  auto commit_result = batch.publisher.Commit();
+  if (!commit_result.ok()) {
+    return Error() << "Failed to sync flag value and info copies: "
+                   << commit_result.error();
+  }
 
-  auto write_result =  WriteStorageRecordsPbToFile(
-      *records_pb, kAvailableStorageRecordsFileName);
+  // write to persistent storage records file
+  auto write_result = WritePersistentStorageRecordsToFile();
   if (!write_result.ok()) {
-    return Error() << "Failed to write available storage records: "
+    return Error() << "Failed to write to persistent storage records file"
                    << write_result.error();
   }
 
+  for (auto const& container : batch.refreshed) {
+    auto const& record = persist_storage_records[container];
+    SetReadOnlyStorageFiles(container, record.package_map, record.flag_map,
+                            record.flag_val);
+  }
+
+  for (auto const& container : batch.updated) {
+    // the flag value copy was replaced, drop read only mappings of the previous one
+    // and stop resolving offsets of the container from the boot index
+    auto const& record = persist_storage_records[container];
+    SetReadOnlyStorageFiles(container, record.package_map, record.flag_map,
+                            record.flag_val);
+    InvalidateBootIndexContainer(container);
+
+    auto publish_result = PublishValueSnapshot(
+        container, record.flag_val, record.package_map_digest,
+        record.flag_map_digest);
+    if (!publish_result.ok()) {
+      return Error() << "Failed to publish value snapshot: " << publish_result.error();
+    }
+
+    RecordContainerChange(container);
+  }
   return {};
 }
 
@@ -203,76 +582,84 @@ Result<bool> HandleContainerUpdate(const std::string& container,
                    << ": "<< timestamp.error();
   }
 
-  // the storage record of a container needs to be updated if this is the first time
-  // we encountered this container or the container has been updated.
-  auto it = persist_storage_records.find(container);
-  if (it == persist_storage_records.end() || it->second.timestamp != *timestamp) {
-    // copy flag value file
-    auto target_value_file = std::string("/metadata/aconfig/flags/") + container + ".val";
-    auto copy_result = CopyFile(value_file, target_value_file, 0644);
-    if (!copy_result.ok()) {
-      return Error() << "CopyFile failed for " << value_file << " :"
-                     << copy_result.error();
-    }
-
-    auto version_result = aconfig_storage::get_storage_file_version(value_file);
-    if (!version_result.ok()) {
-      return Error() << "Failed to get storage version: " << version_result.error();
-    }
+  auto digests = GetStorageDigests(package_file, flag_file, value_file);
+  if (!digests.ok()) {
+    return Error() << digests.error();
+  }
 
-    // create flag info file
-    auto flag_info_file = std::string("/metadata/aconfig/flags/") + container + ".info";
-    auto create_result = aconfig_storage::create_flag_info(
-        package_file, flag_file, flag_info_file);
-    if (!create_result.ok()) {
-      return Error() << "Failed to create flag info file for container " << container
-                     << ": " << create_result.error();
-    }
+  auto batch = ContainerUpdateBatch();
+  auto updated = StageContainerUpdate(container, package_file, flag_file, value_file,
+                                      *timestamp, *digests, batch);
+  if (!updated.ok()) {
+    return Error() << updated.error();
+  }
 
-    // add to in memory storage file records
-    auto& record = persist_storage_records[container];
-    record.version = *version_result;
-    record.container = container;
-    record.package_map = package_file;
-    record.flag_map = flag_file;
-    record.flag_val = target_value_file;
-    record.flag_info = flag_info_file;
-    record.timestamp = *timestamp;
+  auto finish_result = FinishContainerUpdates(batch);
+  if (!finish_result.ok()) {
+    return Error() << finish_result.error();
+  }
+  return *updated;
+}
 
-    // write to persistent storage records file
-    auto write_result = WritePersistentStorageRecordsToFile();
-    if (!write_result.ok()) {
-      return Error() << "Failed to write to persistent storage records file"
-                     << write_result.error();
-    }
+/// Map a container's storage file for reading, flag_val maps the persistent flag value
+/// copy. Read only mappings are cached apart from the writer mappings.
+Result<ReadOnlyMapping> MapStorageFile(
+    const std::string& container,
+    aconfig_storage::StorageFileType file_type) {
+  ScopedStageTimer timer(Stage::kMapping);
+  auto mapped_file = GetReadOnlyMapping(container, file_type);
+  if (mapped_file.ok() || storage_records_loaded.load(std::memory_order_acquire)) {
+    return mapped_file;
+  }
 
-    return true;
+  // containers outside of the boot index are registered with the storage records
+  auto load_result = EnsureStorageRecordsLoaded();
+  if (!load_result.ok()) {
+    return Error() << load_result.error();
   }
+  return GetReadOnlyMapping(container, file_type);
+}
 
-  return false;
+/// Map a container's storage file for writing
+Result<aconfig_storage::MutableMappedStorageFile> MapMutableStorageFile(
+    const std::string& container,
+    aconfig_storage::StorageFileType file_type) {
+  ScopedStageTimer timer(Stage::kMapping);
+  return aconfig_storage::private_internal_api::get_mutable_mapped_file_impl(
+      GetPersistentStorageRecordsFile(), container, file_type);
 }
 
 /// Find the container name given flag package name
 Result<std::string> FindContainer(const std::string& package) {
-  if (container_map.count(package)) {
-    return container_map[package];
+  ScopedStageTimer timer(Stage::kContainerLookup);
+  auto indexed = FindPackageInBootIndex(package);
+  if (indexed) {
+    return indexed->container;
+  }
+
+  {
+    auto lock = std::lock_guard(container_map_mutex);
+    auto it = container_map.find(package);
+    if (it != container_map.end()) {
+      return it->second;
+    }
   }
 
-  auto records_pb = ReadStorageRecordsPb(kAvailableStorageRecordsFileName);
+  auto records_pb = ReadStorageRecordsPb(GetAvailableStorageRecordsFile());
   if (!records_pb.ok()) {
     return Error() << "Unable to read available storage records: "
                    << records_pb.error();
   }
 
   for (auto& entry : records_pb->files()) {
-    auto mapped_file = aconfig_storage::get_mapped_file(
+    auto mapped_file = MapStorageFile(
         entry.container(), aconfig_storage::StorageFileType::package_map);
     if (!mapped_file.ok()) {
       return Error() << "Failed to map file for container " << entry.container()
                      << ": " << mapped_file.error();
     }
 
-    auto offset = aconfig_storage::get_package_read_context(*mapped_file, package);
+    auto offset = aconfig_storage::get_package_read_context(**mapped_file, package);
     if (!offset.ok()) {
       return Error() << "Failed to get offset for package " << package
                      << " from package map of " << entry.container() << " :"
@@ -280,6 +667,7 @@ Result<std::string> FindContainer(const std::string& package) {
     }
 
     if (offset->package_exists) {
+      auto lock = std::lock_guard(container_map_mutex);
       container_map[package] = entry.container();
       return entry.container();
     }
@@ -292,15 +680,22 @@ Result<std::string> FindContainer(const std::string& package) {
 Result<uint32_t> FindBooleanFlagOffset(const std::string& container,
                                        const std::string& package,
                                        const std::string& flag) {
+  ScopedStageTimer timer(Stage::kOffsetLookup);
 
-  auto package_map = aconfig_storage::get_mapped_file(
+  auto indexed = FindFlagInBootIndex(container, package, flag);
+  if (indexed) {
+    return *indexed;
+  }
+
+  auto package_map = MapStorageFile(
       container, aconfig_storage::StorageFileType::package_map);
   if (!package_map.ok()) {
     return Error() << "Failed to map package map file for " << container
                    << ": " << package_map.error();
   }
 
-  auto package_context = aconfig_storage::get_package_read_context(*package_map, package);
+  auto package_context = aconfig_storage::get_package_read_context(
+      **package_map, package);
   if (!package_context.ok()) {
     return Error() << "Failed to get package offset of " << package
                    << " in " << container  << " :" << package_context.error();
@@ -313,14 +708,15 @@ Result<uint32_t> FindBooleanFlagOffset(const std::string& container,
   uint32_t package_id = package_context->package_id;
   uint32_t package_start_index = package_context->boolean_start_index;
 
-  auto flag_map = aconfig_storage::get_mapped_file(
+  auto flag_map = MapStorageFile(
       container, aconfig_storage::StorageFileType::flag_map);
   if (!flag_map.ok()) {
     return Error() << "Failed to map flag map file for " << container
                    << ": " << flag_map.error();
   }
 
-  auto flag_context = aconfig_storage::get_flag_read_context(*flag_map, package_id, flag);
+  auto flag_context = aconfig_storage::get_flag_read_context(
+      **flag_map, package_id, flag);
   if (!flag_context.ok()) {
     return Error() << "Failed to get flag offset of " << flag
                    << " in " << container  << " :" << flag_context.error();
@@ -345,7 +741,7 @@ Result<void> AddNewStorage(const std::string& container,
                    << ":" << updated_result.error();
   }
 
-  auto copy_result = CreateBootSnapshotForContainer(container);
+  auto copy_result = CreateBootSnapshotForContainers({container}).front();
   if (!copy_result.ok()) {
     return Error() << "Failed to make a boot copy: " << copy_result.error();
   }
@@ -362,7 +758,7 @@ Result<void> UpdateBooleanFlagValue(const std::string& package_name,
     return Error() << "Failed for find container for package " << package_name
                    << ": " << container_result.error();
   }
-  auto container = *container_result;
+  auto container = std::move(*container_result);
 
   auto offset_result = FindBooleanFlagOffset(container, package_name, flag_name);
   if (!offset_result.ok()) {
@@ -370,7 +766,7 @@ Result<void> UpdateBooleanFlagValue(const std::string& package_name,
                    << flag_name << " flag value offset: " << offset_result.error();
   }
 
-  auto mapped_file = aconfig_storage::get_mutable_mapped_file(
+  auto mapped_file = MapMutableStorageFile(
       container, aconfig_storage::StorageFileType::flag_val);
   if (!mapped_file.ok()) {
     return Error() << "Failed to map flag value file for " << container
@@ -387,36 +783,58 @@ Result<void> UpdateBooleanFlagValue(const std::string& package_name,
     return Error() << "Failed to update flag value: " << update_result.error();
   }
 
+  // keep the shared value snapshot in sync, fall back to republishing it from the
+  // persistent flag value file
+  UpdateValueMirror(container, *offset_result, flag_value == "true");
+  auto snapshot_result = UpdateValueSnapshot(
+      container, *offset_result, flag_value == "true");
+  if (!snapshot_result.ok()) {
+    auto load_result = EnsureStorageRecordsLoaded();
+    if (!load_result.ok()) {
+      return Error() << load_result.error();
+    }
+    auto it = persist_storage_records.find(container);
+    if (it == persist_storage_records.end()) {
+      return Error() << "Missing persistent storage records for " << container;
+    }
+    auto publish_result = PublishValueSnapshot(
+        container, it->second.flag_val, it->second.package_map_digest,
+        it->second.flag_map_digest);
+    if (!publish_result.ok()) {
+      return Error() << "Failed to update value snapshot: " << publish_result.error();
+    }
+  }
+
+  RecordFlagChange(package_name, flag_name, flag_value == "true");
   return {};
 }
 
-/// Query persistent boolean flag value
+/// Query persistent boolean flag value, container is set to the container it is read
+/// from
 Result<bool> GetBooleanFlagValue(const std::string& package_name,
-                                 const std::string& flag_name) {
+                                 const std::string& flag_name,
+                                 std::string& container) {
   auto container_result = FindContainer(package_name);
   if (!container_result.ok()) {
     return Error() << "Failed for find container for package " << package_name
                    << ": " << container_result.error();
   }
-  auto container = *container_result;
+  container = std::move(*container_result);
   auto offset_result = FindBooleanFlagOffset(container, package_name, flag_name);
   if (!offset_result.ok()) {
     return Error() << "Failed to obtain " << package_name << "."
                    << flag_name << " flag value offset: " << offset_result.error();
   }
 
-  auto mapped_file_result = aconfig_storage::get_mutable_mapped_file(
+  auto mapped_file = MapStorageFile(
       container, aconfig_storage::StorageFileType::flag_val);
-  if (!mapped_file_result.ok()) {
+  if (!mapped_file.ok()) {
     return Error() << "Failed to map flag value file for " << container
-                   << ": " << mapped_file_result.error();
+                   << ": " << mapped_file.error();
   }
 
-  auto ro_mapped_file = aconfig_storage::MappedStorageFile();
-  ro_mapped_file.file_ptr = mapped_file_result->file_ptr;
-  ro_mapped_file.file_size = mapped_file_result->file_size;
   auto value_result = aconfig_storage::get_boolean_flag_value(
-      ro_mapped_file, *offset_result);
+      **mapped_file, *offset_result);
   if (!value_result.ok()) {
     return Error() << "Failed to get flag value: " << value_result.error();
   }
@@ -424,100 +842,1139 @@ Result<bool> GetBooleanFlagValue(const std::string& package_name,
   return *value_result;
 }
 
-} // namespace
+/// Read persistent flag values [begin, end) of a container from its bit packed mirror,
+/// the mirror is built from the persistent flag value file on first use
+Result<ValueBits> ReadContainerValueBits(const std::string& container,
+                                         uint32_t begin,
+                                         uint32_t end) {
+  if (!HasValueMirror(container)) {
+    auto mapped_file = MapStorageFile(
+        container, aconfig_storage::StorageFileType::flag_val);
+    if (!mapped_file.ok()) {
+      return Error() << "Failed to map flag value file for " << container
+                     << ": " << mapped_file.error();
+    }
 
-/// Initialize in memory aconfig storage records
-Result<void> InitializeInMemoryStorageRecords() {
-  auto records_pb = ReadStorageRecordsPb(kPersistentStorageRecordsFileName);
-  if (!records_pb.ok()) {
-    return Error() << "Unable to read persistent storage records: "
-                   << records_pb.error();
+    auto header = ParseFlagValueHeader(**mapped_file);
+    if (!header.ok()) {
+      return Error() << header.error();
+    }
+    SetValueMirror(container,
+                   static_cast<const uint8_t*>((*mapped_file)->file_ptr)
+                       + header->boolean_value_offset,
+                   header->num_flags);
   }
+  return ReadValueMirror(container, begin, end);
+}
 
-  persist_storage_records.clear();
-  for (auto& entry : records_pb->files()) {
-    persist_storage_records.insert({entry.container(), StorageRecord(entry)});
+/// Flag map entries and persistent flag values of a container, or of a package in it
+struct ContainerFlagValues {
+  std::vector<FlagEntry> flags;
+  ValueBits values;
+  /// flag value index held by bit 0 of values
+  uint32_t first_index = 0;
+};
+
+/// Sort flag map entries by package and then by their index within the package
+void SortFlagEntries(std::vector<FlagEntry>& flags) {
+  std::sort(flags.begin(), flags.end(),
+            [](const FlagEntry& lhs, const FlagEntry& rhs) {
+              return lhs.package_id != rhs.package_id ? lhs.package_id < rhs.package_id
+                                                      : lhs.flag_index < rhs.flag_index;
+            });
+}
+
+/// Map the flag map and read the persistent flag values of a container, flags are
+/// sorted by package and then by their index within the package
+Result<ContainerFlagValues> MapContainerFlagValues(const std::string& container) {
+  auto flag_map = MapStorageFile(
+      container, aconfig_storage::StorageFileType::flag_map);
+  if (!flag_map.ok()) {
+    return Error() << "Failed to map flag map file for " << container
+                   << ": " << flag_map.error();
   }
 
-  return {};
+  auto flags = ListFlags(**flag_map);
+  if (!flags.ok()) {
+    return Error() << "Failed to list flags in " << container << ": " << flags.error();
+  }
+
+  auto values = ReadContainerValueBits(
+      container, 0, std::numeric_limits<uint32_t>::max());
+  if (!values.ok()) {
+    return Error() << values.error();
+  }
+
+  auto result = ContainerFlagValues();
+  result.flags = std::move(*flags);
+  result.values = std::move(*values);
+  SortFlagEntries(result.flags);
+  return result;
 }
 
-/// Initialize platform RO partition flag storage
-Result<void> InitializePlatformStorage() {
-  auto value_files = std::vector<std::pair<std::string, std::string>>{
-    {"system", "/system/etc/aconfig"},
-    {"system_ext", "/system_ext/etc/aconfig"},
-    {"vendor", "/vendor/etc/aconfig"},
-    {"product", "/product/etc/aconfig"}};
-
-  for (auto const& [container, storage_dir] : value_files) {
-    auto package_file = std::string(storage_dir) + "/package.map";
-    auto flag_file = std::string(storage_dir) + "/flag.map";
-    auto value_file = std::string(storage_dir) + "/flag.val";
-
-    if (!FileExists(value_file)) {
-      continue;
-    }
+/// Map the flag map entries and read the persistent flag values of a single package,
+/// only the package's own flag value range is read
+Result<ContainerFlagValues> MapPackageFlagValues(const std::string& container,
+                                                 uint32_t package_id,
+                                                 uint32_t boolean_start_index) {
+  auto flag_map = MapStorageFile(
+      container, aconfig_storage::StorageFileType::flag_map);
+  if (!flag_map.ok()) {
+    return Error() << "Failed to map flag map file for " << container
+                   << ": " << flag_map.error();
+  }
 
-    auto updated_result = HandleContainerUpdate(
-        container, package_file, flag_file, value_file);
-    if (!updated_result.ok()) {
-      return Error() << updated_result.error();
-    }
+  auto flags = ListPackageFlags(**flag_map, package_id);
+  if (!flags.ok()) {
+    return Error() << "Failed to list flags in " << container << ": " << flags.error();
+  }
 
-    auto copy_result = CreateBootSnapshotForContainer(container);
-    if (!copy_result.ok()) {
-      return Error() << copy_result.error();
+  uint64_t num_flags = 0;
+  for (auto const& flag : *flags) {
+    num_flags = std::max<uint64_t>(num_flags, flag.flag_index + 1);
+  }
+  auto end = std::min<uint64_t>(boolean_start_index + num_flags,
+                                std::numeric_limits<uint32_t>::max());
+  auto values = ReadContainerValueBits(
+      container, boolean_start_index, static_cast<uint32_t>(end));
+  if (!values.ok()) {
+    return Error() << values.error();
+  }
+
+  auto result = ContainerFlagValues();
+  result.flags = std::move(*flags);
+  result.values = std::move(*values);
+  result.first_index = boolean_start_index;
+  SortFlagEntries(result.flags);
+  return result;
+}
+
+/// Add the flag values of a package to a package dump. A package's boolean flag values
+/// are stored contiguously from its boolean start index, so this is a single scan.
+Result<void> DumpPackageFlagValues(const ContainerFlagValues& container_values,
+                                   uint32_t package_id,
+                                   uint32_t boolean_start_index,
+                                   StorageReturnMessage::PackageDumpReturnMessage& dump) {
+  auto const& flags = container_values.flags;
+  auto first = std::lower_bound(
+      flags.begin(), flags.end(), package_id,
+      [](const FlagEntry& entry, uint32_t id) { return entry.package_id < id; });
+
+  for (auto it = first; it != flags.end() && it->package_id == package_id; ++it) {
+    uint64_t index = uint64_t(boolean_start_index) + it->flag_index;
+    if (index < container_values.first_index ||
+        index - container_values.first_index >= container_values.values.num_flags) {
+      return Error() << "Flag value index " << index << " of " << it->flag_name
+                     << " is out of range";
     }
+    auto* flag = dump.add_flags();
+    flag->set_flag_name(it->flag_name);
+    flag->set_flag_value(container_values.values.Get(
+        static_cast<uint32_t>(index - container_values.first_index)));
   }
 
   return {};
 }
 
-/// Handle incoming messages to aconfigd socket
-void HandleSocketRequest(const StorageRequestMessage& message,
-                         StorageReturnMessage& return_message) {
-  switch (message.msg_case()) {
-    case StorageRequestMessage::kNewStorageMessage: {
-      LOG(INFO) << "received a new storage request";
-      auto msg = message.new_storage_message();
-      auto result = AddNewStorage(msg.container(),
-                                  msg.package_map(),
-                                  msg.flag_map(),
-                                  msg.flag_value());
-      if (!result.ok()) {
-        auto* errmsg = return_message.mutable_error_message();
-        *errmsg = result.error().message();
-      } else {
-        return_message.mutable_new_storage_message();
-      }
-      break;
+/// Query all persistent flag values of a package
+Result<void> DumpPackage(const std::string& package_name,
+                         StorageReturnMessage::PackageDumpReturnMessage& dump) {
+  auto container_result = FindContainer(package_name);
+  if (!container_result.ok()) {
+    return Error() << "Failed for find container for package " << package_name
+                   << ": " << container_result.error();
+  }
+  auto container = *container_result;
+
+  auto package_map = MapStorageFile(
+      container, aconfig_storage::StorageFileType::package_map);
+  if (!package_map.ok()) {
+    return Error() << "Failed to map package map file for " << container
+                   << ": " << package_map.error();
+  }
+
+  auto package_context = aconfig_storage::get_package_read_context(
+      **package_map, package_name);
+  if (!package_context.ok()) {
+    return Error() << "Failed to get package offset of " << package_name
+                   << " in " << container  << " :" << package_context.error();
+  }
+
+  if (!package_context->package_exists) {
+    return Error() << package_name << " is not found in " << container;
+  }
+
+  auto container_values = MapPackageFlagValues(container,
+                                               package_context->package_id,
+                                               package_context->boolean_start_index);
+  if (!container_values.ok()) {
+    return Error() << container_values.error();
+  }
+
+  dump.set_package_name(package_name);
+  dump.set_container(container);
+  return DumpPackageFlagValues(*container_values,
+                               package_context->package_id,
+                               package_context->boolean_start_index,
+                               dump);
+}
+
+/// Query all persistent flag values of a container
+Result<void> DumpContainer(const std::string& container,
+                           StorageReturnMessage::ContainerDumpReturnMessage& dump) {
+  auto package_map = MapStorageFile(
+      container, aconfig_storage::StorageFileType::package_map);
+  if (!package_map.ok()) {
+    return Error() << "Failed to map package map file for " << container
+                   << ": " << package_map.error();
+  }
+
+  auto packages = ListPackages(**package_map);
+  if (!packages.ok()) {
+    return Error() << "Failed to list packages in " << container << ": "
+                   << packages.error();
+  }
+
+  auto container_values = MapContainerFlagValues(container);
+  if (!container_values.ok()) {
+    return Error() << container_values.error();
+  }
+
+  // visit packages in flag value file order
+  std::sort(packages->begin(), packages->end(),
+            [](const PackageEntry& lhs, const PackageEntry& rhs) {
+              return lhs.boolean_start_index < rhs.boolean_start_index;
+            });
+
+  dump.set_container(container);
+  for (auto const& package : *packages) {
+    auto* package_dump = dump.add_packages();
+    package_dump->set_package_name(package.package_name);
+    package_dump->set_container(container);
+    auto dump_result = DumpPackageFlagValues(*container_values,
+                                             package.package_id,
+                                             package.boolean_start_index,
+                                             *package_dump);
+    if (!dump_result.ok()) {
+      return Error() << "Failed to dump " << package.package_name << ": "
+                     << dump_result.error();
     }
-    case StorageRequestMessage::kFlagOverrideMessage: {
-      LOG(INFO) << "received a flag override request";
-      auto msg = message.flag_override_message();
-      auto result = UpdateBooleanFlagValue(msg.package_name(),
-                                           msg.flag_name(),
-                                           msg.flag_value());
-      if (!result.ok()) {
-        auto* errmsg = return_message.mutable_error_message();
-        *errmsg = result.error().message();
-      } else {
-        return_message.mutable_flag_override_message();
+  }
+
+  return {};
+}
+
+/// List flags whose persistent value differs from the boot flag value copy
+Result<void> ListPendingChanges(
+    const std::string& container,
+    StorageReturnMessage::PendingChangesReturnMessage& pending) {
+  auto flag_val = MapStorageFile(container, aconfig_storage::StorageFileType::flag_val);
+  if (!flag_val.ok()) {
+    return Error() << "Failed to map flag value file for " << container
+                   << ": " << flag_val.error();
+  }
+
+  auto boot_file = MapStorageFileAt(GetBootDir() + "/" + container + ".val");
+  if (!boot_file.ok()) {
+    return Error() << "Failed to map boot flag value file for " << container
+                   << ": " << boot_file.error();
+  }
+  auto unmap_boot_file = base::make_scope_guard(
+      [&boot_file]() { UnmapStorageFile(*boot_file); });
+
+  auto header = ParseFlagValueHeader(**flag_val);
+  if (!header.ok()) {
+    return Error() << header.error();
+  }
+  auto boot_header = ParseFlagValueHeader(*boot_file);
+  if (!boot_header.ok()) {
+    return Error() << boot_header.error();
+  }
+  if (header->num_flags != boot_header->num_flags) {
+    return Error() << "Boot flag values of " << container
+                   << " do not match its persistent flag values";
+  }
+
+  auto* values = static_cast<const uint8_t*>((*flag_val)->file_ptr)
+      + header->boolean_value_offset;
+  auto* boot_values = static_cast<const uint8_t*>(boot_file->file_ptr)
+      + boot_header->boolean_value_offset;
+  auto diffs = std::vector<uint32_t>();
+  FindDifferingBytes(values, boot_values, header->num_flags, &diffs);
+
+  pending.set_container(container);
+  if (diffs.empty()) {
+    return {};
+  }
+
+  // only name the flags that differ, the maps are listed once for the whole diff
+  auto package_map = MapStorageFile(
+      container, aconfig_storage::StorageFileType::package_map);
+  if (!package_map.ok()) {
+    return Error() << "Failed to map package map file for " << container
+                   << ": " << package_map.error();
+  }
+  auto packages = ListPackages(**package_map);
+  if (!packages.ok()) {
+    return Error() << "Failed to list packages in " << container << ": "
+                   << packages.error();
+  }
+
+  auto flag_map = MapStorageFile(container, aconfig_storage::StorageFileType::flag_map);
+  if (!flag_map.ok()) {
+    return Error() << "Failed to map flag map file for " << container
+                   << ": " << flag_map.error();
+  }
+  auto flags = ListFlags(**flag_map);
+  if (!flags.ok()) {
+    return Error() << "Failed to list flags in " << container << ": " << flags.error();
+  }
+
+  auto package_by_id = std::unordered_map<uint32_t, const PackageEntry*>();
+  for (auto const& package : *packages) {
+    package_by_id[package.package_id] = &package;
+  }
+
+  auto changes = std::vector<std::pair<uint32_t, const FlagEntry*>>();
+  for (auto const& flag : *flags) {
+    auto it = package_by_id.find(flag.package_id);
+    if (it == package_by_id.end()) {
+      continue;
+    }
+    auto index = it->second->boolean_start_index + flag.flag_index;
+    if (std::binary_search(diffs.begin(), diffs.end(), index)) {
+      changes.push_back({index, &flag});
+    }
+  }
+  std::sort(changes.begin(), changes.end());
+
+  for (auto const& [index, flag] : changes) {
+    auto* change = pending.add_changes();
+    change->set_package_name(package_by_id[flag->package_id]->package_name);
+    change->set_flag_name(flag->flag_name);
+    change->set_boot_flag_value(boot_values[index] != 0);
+    change->set_flag_value(values[index] != 0);
+  }
+
+  return {};
+}
+
+/// Find the boolean flag value index range of a package
+Result<std::pair<uint32_t, uint32_t>> FindPackageValueRange(const std::string& container,
+                                                            const std::string& package,
+                                                            uint32_t num_flags) {
+  auto package_map = MapStorageFile(
+      container, aconfig_storage::StorageFileType::package_map);
+  if (!package_map.ok()) {
+    return Error() << "Failed to map package map file for " << container
+                   << ": " << package_map.error();
+  }
+
+  auto packages = ListPackages(**package_map);
+  if (!packages.ok()) {
+    return Error() << "Failed to list packages in " << container << ": "
+                   << packages.error();
+  }
+
+  auto it = std::find_if(packages->begin(), packages->end(),
+                         [&](const PackageEntry& entry) {
+                           return entry.package_name == package;
+                         });
+  if (it == packages->end()) {
+    return Error() << package << " is not found in " << container;
+  }
+
+  // a package's boolean flag values end where the next package's start
+  uint32_t begin = it->boolean_start_index;
+  uint32_t end = num_flags;
+  for (auto const& entry : *packages) {
+    if (entry.boolean_start_index > begin) {
+      end = std::min(end, entry.boolean_start_index);
+    }
+  }
+  if (begin > end) {
+    return Error() << "Invalid boolean start index of " << package;
+  }
+  return std::make_pair(begin, end);
+}
+
+/// Read the persistent flag values of a container, or of a single package in it, as
+/// bits from the bit packed mirror
+Result<void> BulkFlagQuery(const StorageRequestMessage::BulkFlagQueryMessage& msg,
+                           StorageReturnMessage::BulkFlagQueryReturnMessage& bulk) {
+  auto container = msg.container();
+  if (!msg.package_name().empty()) {
+    auto container_result = FindContainer(msg.package_name());
+    if (!container_result.ok()) {
+      return Error() << "Failed for find container for package " << msg.package_name()
+                     << ": " << container_result.error();
+    }
+    if (!container.empty() && container != *container_result) {
+      return Error() << msg.package_name() << " is not in container " << container;
+    }
+    container = *container_result;
+  }
+
+  if (container.empty()) {
+    return Error() << "Bulk flag query has no container or package";
+  }
+
+  // resolve the package's range first, so only its values are copied out of the
+  // mirror. The last package's range ends at the end of the container, which the
+  // mirror read clamps to.
+  uint32_t begin = 0;
+  uint32_t end = std::numeric_limits<uint32_t>::max();
+  if (!msg.package_name().empty()) {
+    auto range = FindPackageValueRange(container, msg.package_name(), end);
+    if (!range.ok()) {
+      return Error() << range.error();
+    }
+    begin = range->first;
+    end = range->second;
+  }
+
+  auto values = ReadContainerValueBits(container, begin, end);
+  if (!values.ok()) {
+    return Error() << values.error();
+  }
+
+  bulk.set_container(container);
+  bulk.set_package_name(msg.package_name());
+  bulk.set_start_index(begin);
+  bulk.set_num_flags(values->num_flags);
+  bulk.set_num_enabled(CountSetBits(values->words.data(), values->num_flags));
+
+  // words are little endian, so their bytes are already in value order
+  bulk.mutable_flag_values()->assign(
+      reinterpret_cast<const char*>(values->words.data()), (values->num_flags + 7) / 8);
+
+  if (msg.list_enabled()) {
+    auto enabled = std::vector<uint32_t>();
+    FindSetBits(values->words.data(), values->num_flags, &enabled);
+    for (auto index : enabled) {
+      bulk.add_enabled_indices(begin + index);
+    }
+  }
+
+  return {};
+}
+
+/// Record the flags a reset is about to change, so they can be pushed to subscribers
+Result<void> RecordResetFlagChanges(const std::string& container,
+                                    const uint8_t* values,
+                                    const uint8_t* default_values,
+                                    uint32_t begin,
+                                    uint32_t end) {
+  auto package_map = MapStorageFile(
+      container, aconfig_storage::StorageFileType::package_map);
+  if (!package_map.ok()) {
+    return Error() << "Failed to map package map file for " << container
+                   << ": " << package_map.error();
+  }
+
+  auto packages = ListPackages(**package_map);
+  if (!packages.ok()) {
+    return Error() << "Failed to list packages in " << container << ": "
+                   << packages.error();
+  }
+
+  auto flag_map = MapStorageFile(
+      container, aconfig_storage::StorageFileType::flag_map);
+  if (!flag_map.ok()) {
+    return Error() << "Failed to map flag map file for " << container
+                   << ": " << flag_map.error();
+  }
+
+  auto flags = ListFlags(**flag_map);
+  if (!flags.ok()) {
+    return Error() << "Failed to list flags in " << container << ": " << flags.error();
+  }
+
+  auto package_by_id = std::unordered_map<uint32_t, const PackageEntry*>();
+  for (auto const& package : *packages) {
+    package_by_id[package.package_id] = &package;
+  }
+
+  for (auto const& flag : *flags) {
+    auto it = package_by_id.find(flag.package_id);
+    if (it == package_by_id.end()) {
+      continue;
+    }
+    uint32_t index = it->second->boolean_start_index + flag.flag_index;
+    if (index >= begin && index < end && values[index] != default_values[index]) {
+      RecordFlagChange(it->second->package_name, flag.flag_name,
+                       default_values[index] != 0);
+    }
+  }
+
+  return {};
+}
+
+/// Reset persistent flag values of a container, or of a single package in it, back to
+/// the default values. The whole value range is restored with a single file publish.
+Result<uint32_t> ResetOverrides(const std::string& container_name,
+                                const std::string& package) {
+  auto container = container_name;
+  if (!package.empty()) {
+    auto container_result = FindContainer(package);
+    if (!container_result.ok()) {
+      return Error() << "Failed for find container for package " << package
+                     << ": " << container_result.error();
+    }
+    if (!container.empty() && container != *container_result) {
+      return Error() << package << " is not in container " << container;
+    }
+    container = *container_result;
+  }
+
+  if (container.empty()) {
+    return Error() << "Reset request has no container or package";
+  }
+
+  auto load_result = EnsureStorageRecordsLoaded();
+  if (!load_result.ok()) {
+    return Error() << load_result.error();
+  }
+
+  auto record_it = persist_storage_records.find(container);
+  if (record_it == persist_storage_records.end()) {
+    return Error() << "Missing persistent storage records for " << container;
+  }
+  auto const& record = record_it->second;
+  if (record.default_flag_val.empty()) {
+    return Error() << "Default flag values of " << container << " are unknown";
+  }
+
+  auto default_file = MapStorageFileAt(record.default_flag_val);
+  if (!default_file.ok()) {
+    return Error() << "Failed to map default flag value file for " << container
+                   << ": " << default_file.error();
+  }
+  auto unmap_default_file = base::make_scope_guard(
+      [&default_file]() { UnmapStorageFile(*default_file); });
+
+  auto default_header = ParseFlagValueHeader(*default_file);
+  if (!default_header.ok()) {
+    return Error() << default_header.error();
+  }
+
+  auto value_file = MapStorageFileAt(record.flag_val);
+  if (!value_file.ok()) {
+    return Error() << "Failed to map flag value file for " << container
+                   << ": " << value_file.error();
+  }
+  auto unmap_value_file = base::make_scope_guard(
+      [&value_file]() { UnmapStorageFile(*value_file); });
+
+  auto header = ParseFlagValueHeader(*value_file);
+  if (!header.ok()) {
+    return Error() << header.error();
+  }
+
+  if (header->num_flags != default_header->num_flags) {
+    return Error() << "Default flag values of " << container
+                   << " do not match its persistent flag values";
+  }
+
+  uint32_t begin = 0;
+  uint32_t end = header->num_flags;
+  if (!package.empty()) {
+    auto range = FindPackageValueRange(container, package, header->num_flags);
+    if (!range.ok()) {
+      return Error() << range.error();
+    }
+    std::tie(begin, end) = *range;
+  }
+
+  auto* values = static_cast<const uint8_t*>(value_file->file_ptr)
+      + header->boolean_value_offset;
+  auto* default_values = static_cast<const uint8_t*>(default_file->file_ptr)
+      + default_header->boolean_value_offset;
+
+  uint32_t num_reset = 0;
+  for (uint32_t i = begin; i < end; ++i) {
+    num_reset += values[i] != default_values[i];
+  }
+  if (num_reset == 0) {
+    return num_reset;
+  }
+
+  // the reset values are published as a new file rather than written in place, so a
+  // crash leaves either all or none of them reset
+  auto content = std::string(static_cast<const char*>(value_file->file_ptr),
+                             value_file->file_size);
+  memcpy(content.data() + header->boolean_value_offset + begin,
+         default_values + begin, end - begin);
+  auto write_result = WriteFileAtomically(content, record.flag_val, 0644);
+  if (!write_result.ok()) {
+    return Error() << "Failed to write reset flag values of " << container << ": "
+                   << write_result.error();
+  }
+
+  // the changes are only pushed once they landed. values still maps the replaced
+  // file, so it holds the values before the reset.
+  if (HasSubscribers()) {
+    auto record_result = RecordResetFlagChanges(
+        container, values, default_values, begin, end);
+    if (!record_result.ok()) {
+      LOG(WARNING) << "Failed to record reset flag changes: " << record_result.error();
+      RecordContainerChange(container);
+    }
+  }
+
+  // read only mappings of the replaced file would keep serving the old values
+  SetReadOnlyStorageFiles(container, record.package_map, record.flag_map,
+                          record.flag_val);
+
+  auto publish_result = PublishValueSnapshot(
+      container, record.flag_val, record.package_map_digest,
+      record.flag_map_digest);
+  if (!publish_result.ok()) {
+    return Error() << "Failed to update value snapshot: " << publish_result.error();
+  }
+
+  return num_reset;
+}
+
+/// Stage a persistent flag value override for the next boot. The override is appended
+/// to the staging file, the persistent flag values are not touched.
+Result<void> StageFlagOverride(const std::string& package_name,
+                               const std::string& flag_name,
+                               const std::string& flag_value) {
+  if (flag_value != "true" && flag_value != "false") {
+    return Error() << "Invalid boolean flag value, it should be true|false";
+  }
+
+  // reject unknown flags now, the override is resolved again at boot
+  auto container_result = FindContainer(package_name);
+  if (!container_result.ok()) {
+    return Error() << "Failed for find container for package " << package_name
+                   << ": " << container_result.error();
+  }
+
+  auto offset_result = FindBooleanFlagOffset(*container_result, package_name, flag_name);
+  if (!offset_result.ok()) {
+    return Error() << "Failed to obtain " << package_name << "."
+                   << flag_name << " flag value offset: " << offset_result.error();
+  }
+
+  auto staged = StagedFlagOverrides();
+  auto* staged_override = staged.add_overrides();
+  staged_override->set_package_name(package_name);
+  staged_override->set_flag_name(flag_name);
+  staged_override->set_flag_value(flag_value == "true");
+  auto content = std::string();
+  if (!staged.SerializeToString(&content)) {
+    return Error() << "Unable to serialize staged flag override";
+  }
+
+  auto file = GetStagedFlagOverridesFile();
+  auto fd = unique_fd(TEMP_FAILURE_RETRY(
+      open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << file;
+  }
+
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1) {
+    return ErrnoError() << "fstat() failed for " << file;
+  }
+
+  if (!WriteFully(fd.get(), content.data(), content.size())) {
+    return ErrnoError() << "Failed to append to " << file;
+  }
+
+  if (fdatasync(fd.get()) == -1) {
+    return ErrnoError() << "fdatasync() failed for " << file;
+  }
+
+  // the first override also has to make the staging file itself durable
+  if (st.st_size == 0) {
+    return SyncDir(GetConfig().storage_root);
+  }
+  return {};
+}
+
+/// Read staged flag overrides in staging order. An override torn by a crash while it
+/// was being appended ends the list.
+Result<std::vector<StagedFlagOverride>> ReadStagedFlagOverrides(const std::string& file) {
+  auto content = std::string();
+  if (!ReadFileToString(file, &content)) {
+    return ErrnoError() << "ReadFileToString failed for " << file;
+  }
+
+  // tag of StagedFlagOverrides.overrides, field 1 with length delimited wire type
+  constexpr uint32_t kOverridesTag = (1 << 3) | 2;
+
+  auto overrides = std::vector<StagedFlagOverride>();
+  auto input = google::protobuf::io::CodedInputStream(
+      reinterpret_cast<const uint8_t*>(content.data()), content.size());
+  while (true) {
+    auto tag = input.ReadTag();
+    if (tag == 0) {
+      break;
+    }
+
+    uint32_t size = 0;
+    if (tag != kOverridesTag || !input.ReadVarint32(&size)) {
+      LOG(WARNING) << "Ignoring torn staged flag overrides in " << file;
+      break;
+    }
+
+    auto limit = input.PushLimit(size);
+    auto staged_override = StagedFlagOverride();
+    bool parsed = staged_override.ParseFromCodedStream(&input)
+        && input.ConsumedEntireMessage() && input.BytesUntilLimit() == 0;
+    input.PopLimit(limit);
+    if (!parsed) {
+      LOG(WARNING) << "Ignoring torn staged flag overrides in " << file;
+      break;
+    }
+    overrides.push_back(std::move(staged_override));
+  }
+
+  return overrides;
+}
+
+/// Apply staged overrides to the persistent flag values of a container, returns the
+/// number of overrides applied. Applied overrides are marked in applied.
+Result<uint32_t> ApplyStagedFlagOverridesToContainer(
+    const StorageRecord& record,
+    const std::vector<StagedFlagOverride>& overrides,
+    std::vector<bool>& applied) {
+  auto package_map = MapStorageFileAt(record.package_map);
+  if (!package_map.ok()) {
+    return Error() << "Failed to map package map file: " << package_map.error();
+  }
+  auto unmap_package_map = base::make_scope_guard(
+      [&package_map]() { UnmapStorageFile(*package_map); });
+
+  auto flag_map = MapStorageFileAt(record.flag_map);
+  if (!flag_map.ok()) {
+    return Error() << "Failed to map flag map file: " << flag_map.error();
+  }
+  auto unmap_flag_map = base::make_scope_guard(
+      [&flag_map]() { UnmapStorageFile(*flag_map); });
+
+  auto flag_val = MapMutableStorageFile(
+      record.container, aconfig_storage::StorageFileType::flag_val);
+  if (!flag_val.ok()) {
+    return Error() << "Failed to map flag value file: " << flag_val.error();
+  }
+
+  // overrides are applied in staging order, so the last staged value of a flag wins
+  uint32_t num_applied = 0;
+  for (size_t i = 0; i < overrides.size(); ++i) {
+    auto const& staged_override = overrides[i];
+    if (applied[i]) {
+      continue;
+    }
+
+    auto package_context = aconfig_storage::get_package_read_context(
+        *package_map, staged_override.package_name());
+    if (!package_context.ok() || !package_context->package_exists) {
+      continue;
+    }
+
+    // the package lives in this container, so the override is done with either way
+    applied[i] = true;
+    auto flag_context = aconfig_storage::get_flag_read_context(
+        *flag_map, package_context->package_id, staged_override.flag_name());
+    if (!flag_context.ok() || !flag_context->flag_exists) {
+      LOG(WARNING) << "Dropping staged override of unknown flag "
+                   << staged_override.package_name() << "."
+                   << staged_override.flag_name();
+      continue;
+    }
+
+    auto update_result = aconfig_storage::set_boolean_flag_value(
+        *flag_val,
+        package_context->boolean_start_index + flag_context->flag_index,
+        staged_override.flag_value());
+    if (!update_result.ok()) {
+      return Error() << "Failed to update flag value: " << update_result.error();
+    }
+    num_applied++;
+  }
+
+  return num_applied;
+}
+
+/// Apply staged flag overrides in a single pass over the staging file, then remove it
+void ApplyStagedFlagOverrides() {
+  auto file = GetStagedFlagOverridesFile();
+  if (!FileExists(file)) {
+    return;
+  }
+
+  auto overrides = ReadStagedFlagOverrides(file);
+  if (!overrides.ok()) {
+    LOG(ERROR) << "Failed to read staged flag overrides: " << overrides.error();
+    return;
+  }
+
+  auto applied = std::vector<bool>(overrides->size(), false);
+  for (auto const& [container, record] : persist_storage_records) {
+    auto apply_result = ApplyStagedFlagOverridesToContainer(record, *overrides, applied);
+    if (!apply_result.ok()) {
+      LOG(ERROR) << "Failed to apply staged flag overrides to " << container << ": "
+                 << apply_result.error();
+      continue;
+    }
+
+    if (*apply_result == 0) {
+      continue;
+    }
+
+    auto publish_result = PublishValueSnapshot(
+        container, record.flag_val, record.package_map_digest,
+        record.flag_map_digest);
+    if (!publish_result.ok()) {
+      LOG(ERROR) << "Failed to publish value snapshot of " << container << ": "
+                 << publish_result.error();
+    }
+    LOG(INFO) << "applied " << *apply_result << " staged flag overrides to "
+              << container;
+  }
+
+  for (size_t i = 0; i < overrides->size(); ++i) {
+    if (!applied[i]) {
+      LOG(WARNING) << "Dropping staged override of flag in unknown package "
+                   << (*overrides)[i].package_name();
+    }
+  }
+
+  // the staged overrides are applied, or will never apply
+  if (unlink(file.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to remove " << file;
+  }
+}
+
+/// Write the boot index of containers with a boot snapshot, in the order FindContainer
+/// searches them
+Result<void> WriteBootIndexForAvailableContainers() {
+  auto records_pb = ReadStorageRecordsPb(GetAvailableStorageRecordsFile());
+  if (!records_pb.ok()) {
+    return Error() << "Unable to read available storage records: "
+                   << records_pb.error();
+  }
+
+  auto containers = std::vector<BootIndexContainer>();
+  for (auto& entry : records_pb->files()) {
+    auto it = persist_storage_records.find(entry.container());
+    if (it == persist_storage_records.end()) {
+      return Error() << "Missing persistent storage records for " << entry.container();
+    }
+    auto const& record = it->second;
+    containers.push_back({record.container, record.package_map, record.flag_map,
+                          record.flag_val});
+  }
+
+  return WriteBootIndex(GetBootIndexFile(), containers);
+}
+
+/// Report the flag value generation of a container a reply was read from
+template <typename ReturnMessage>
+void SetGeneration(const std::string& container, ReturnMessage* return_msg) {
+  auto generation = GetValueSnapshotGeneration(container);
+  if (generation.ok()) {
+    return_msg->set_generation(*generation);
+  }
+}
+
+/// Check if a message changes persistent flag values
+bool IsWriteMessage(const StorageRequestMessage& message) {
+  switch (message.msg_case()) {
+    case StorageRequestMessage::kNewStorageMessage:
+    case StorageRequestMessage::kFlagOverrideMessage:
+    case StorageRequestMessage::kResetOverridesMessage:
+      return true;
+    default:
+      return false;
+  }
+}
+
+} // namespace
+
+/// Initialize in memory aconfig storage records
+Result<void> InitializeInMemoryStorageRecords() {
+  auto records_pb = ReadStorageRecordsPb(GetPersistentStorageRecordsFile());
+  if (!records_pb.ok()) {
+    return Error() << "Unable to read persistent storage records: "
+                   << records_pb.error();
+  }
+
+  auto extensions_pb = ReadStorageRecordExtensionsPb(
+      GetPersistentStorageRecordExtensionsFile());
+  if (!extensions_pb.ok()) {
+    return Error() << "Unable to read persistent storage record extensions: "
+                   << extensions_pb.error();
+  }
+
+  persist_storage_records.clear();
+  for (auto& entry : records_pb->files()) {
+    persist_storage_records.insert({entry.container(), StorageRecord(entry)});
+  }
+
+  for (auto& extension : extensions_pb->records()) {
+    auto it = persist_storage_records.find(extension.container());
+    if (it == persist_storage_records.end()) {
+      continue;
+    }
+    it->second.package_map_digest = extension.package_map_digest();
+    it->second.flag_map_digest = extension.flag_map_digest();
+    it->second.flag_val_digest = extension.flag_val_digest();
+    it->second.default_flag_val = extension.default_flag_val();
+  }
+
+  for (auto const& [container, record] : persist_storage_records) {
+    SetReadOnlyStorageFiles(container, record.package_map, record.flag_map,
+                            record.flag_val);
+  }
+
+  storage_records_loaded.store(true, std::memory_order_release);
+  return {};
+}
+
+/// Initialize storage for serving requests
+Result<void> InitializeStorageForServing() {
+  auto containers = LoadBootIndex(GetBootIndexFile());
+  if (!containers.ok()) {
+    LOG(INFO) << "Loading storage records, boot index is unavailable: "
+              << containers.error();
+    return InitializeInMemoryStorageRecords();
+  }
+
+  for (auto const& container : *containers) {
+    SetReadOnlyStorageFiles(container.container, container.package_map,
+                            container.flag_map, container.flag_val);
+  }
+  return {};
+}
+
+/// Initialize platform RO partition flag storage
+Result<void> InitializePlatformStorage() {
+  // the storage files of all platform containers are stat'ed and digested as one
+  // batch
+  auto const& platform_containers = GetConfig().platform_containers;
+  auto files = std::vector<std::string>();
+  files.reserve(platform_containers.size() * 3);
+  for (auto const& [container, storage_dir] : platform_containers) {
+    files.push_back(std::string(storage_dir) + "/package.map");
+    files.push_back(std::string(storage_dir) + "/flag.map");
+    files.push_back(std::string(storage_dir) + "/flag.val");
+  }
+  auto start_ns = NowNs();
+  auto file_batch = DigestFiles(files);
+  LOG(INFO) << "digested " << files.size() << " platform storage files using "
+            << AsyncIoBackendName(file_batch.backend) << " in "
+            << (NowNs() - start_ns) / 1000 << "us";
+
+  // the copies of all updated containers are committed, and the storage records
+  // written, once for the whole batch
+  auto containers = std::vector<std::string>();
+  auto update_batch = ContainerUpdateBatch();
+  auto update_result = Result<void>();
+  for (size_t i = 0; i < platform_containers.size(); ++i) {
+    auto const& container = platform_containers[i].first;
+    auto const& package_file = files[3 * i];
+    auto const& flag_file = files[3 * i + 1];
+    auto const& value_file = files[3 * i + 2];
+    auto const& package = file_batch.files[3 * i];
+    auto const& flag = file_batch.files[3 * i + 1];
+    auto const& value = file_batch.files[3 * i + 2];
+
+    if (!value.ok() && value.error().code() == ENOENT) {
+      continue;
+    }
+
+    bool read_ok = true;
+    for (auto const* file : {&package, &flag, &value}) {
+      if (!file->ok()) {
+        update_result = Error() << "Failed to digest storage files of " << container
+                                << ": " << file->error();
+        read_ok = false;
+        break;
+      }
+    }
+    if (!read_ok) {
+      break;
+    }
+
+    auto digests = StorageDigests{package->digest, flag->digest, value->digest};
+    auto updated_result = StageContainerUpdate(
+        container, package_file, flag_file, value_file, value->timestamp, digests,
+        update_batch);
+    if (!updated_result.ok()) {
+      update_result = Error() << updated_result.error();
+      break;
+    }
+    containers.push_back(container);
+  }
+
+  // containers staged before a failure still get their records written
+  auto finish_result = FinishContainerUpdates(update_batch);
+  if (!update_result.ok()) {
+    if (!finish_result.ok()) {
+      LOG(ERROR) << finish_result.error();
+    }
+    return update_result;
+  }
+  if (!finish_result.ok()) {
+    return Error() << finish_result.error();
+  }
+
+  // staged overrides must land before the boot copies are made
+  ApplyStagedFlagOverrides();
+
+  for (auto const& copy_result : CreateBootSnapshotForContainers(containers)) {
+    if (!copy_result.ok()) {
+      return Error() << copy_result.error();
+    }
+  }
+
+  // the daemon can serve without the index, so failing to write it is not fatal
+  auto index_result = WriteBootIndexForAvailableContainers();
+  if (!index_result.ok()) {
+    LOG(WARNING) << "Failed to write boot index: " << index_result.error();
+  }
+
+  return {};
+}
+
+/// Handle incoming messages to aconfigd socket
+void HandleSocketRequest(const StorageRequestMessage& message,
+                         StorageReturnMessage& return_message) {
+  auto start_ns = NowNs();
+  switch (message.msg_case()) {
+    case StorageRequestMessage::kNewStorageMessage: {
+      auto const& msg = message.new_storage_message();
+      auto result = AddNewStorage(msg.container(),
+                                  msg.package_map(),
+                                  msg.flag_map(),
+                                  msg.flag_value());
+      if (!result.ok()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = result.error().message();
+      } else {
+        return_message.mutable_new_storage_message();
+      }
+      break;
+    }
+    case StorageRequestMessage::kFlagOverrideMessage: {
+      auto const& msg = message.flag_override_message();
+      auto result = UpdateBooleanFlagValue(msg.package_name(),
+                                           msg.flag_name(),
+                                           msg.flag_value());
+      if (!result.ok()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = result.error().message();
+      } else {
+        return_message.mutable_flag_override_message();
       }
       break;
     }
     case StorageRequestMessage::kFlagQueryMessage: {
-      LOG(INFO) << "received a flag query request";
-      auto msg = message.flag_query_message();
-      auto result = GetBooleanFlagValue(msg.package_name(),
-                                        msg.flag_name());
+      auto const& msg = message.flag_query_message();
+      auto container = std::string();
+      auto result = GetBooleanFlagValue(msg.package_name(), msg.flag_name(),
+                                        container);
       if (!result.ok()) {
         auto* errmsg = return_message.mutable_error_message();
         *errmsg = result.error().message();
       } else {
         auto return_msg = return_message.mutable_flag_query_message();
         return_msg->set_flag_value(*result ? "true" : "false");
+        SetGeneration(container, return_msg);
+      }
+      break;
+    }
+    case StorageRequestMessage::kPackageDumpMessage: {
+      auto const& msg = message.package_dump_message();
+      auto* dump = return_message.mutable_package_dump_message();
+      auto result = DumpPackage(msg.package_name(), *dump);
+      if (!result.ok()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = result.error().message();
+      } else {
+        SetGeneration(dump->container(), dump);
+      }
+      break;
+    }
+    case StorageRequestMessage::kContainerDumpMessage: {
+      auto const& msg = message.container_dump_message();
+      auto* dump = return_message.mutable_container_dump_message();
+      auto result = DumpContainer(msg.container(), *dump);
+      if (!result.ok()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = result.error().message();
+      } else {
+        SetGeneration(msg.container(), dump);
+      }
+      break;
+    }
+    case StorageRequestMessage::kSubscribeMessage: {
+      auto const& msg = message.subscribe_message();
+      if (msg.package_names_size() == 0 && msg.flags_size() == 0) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = "Subscribe request has no packages or flags";
+      } else if (!CanAddSubscriber()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = "Too many subscribers";
+      } else {
+        return_message.mutable_subscribe_message();
+      }
+      break;
+    }
+    case StorageRequestMessage::kStatsMessage: {
+      GetStats(message.stats_message(), *return_message.mutable_stats_message());
+      break;
+    }
+    case StorageRequestMessage::kStagedFlagOverrideMessage: {
+      auto const& msg = message.staged_flag_override_message();
+      auto result = StageFlagOverride(msg.package_name(),
+                                      msg.flag_name(),
+                                      msg.flag_value());
+      if (!result.ok()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = result.error().message();
+      } else {
+        return_message.mutable_staged_flag_override_message();
+      }
+      break;
+    }
+    case StorageRequestMessage::kBulkFlagQueryMessage: {
+      auto const& msg = message.bulk_flag_query_message();
+      auto* bulk = return_message.mutable_bulk_flag_query_message();
+      auto result = BulkFlagQuery(msg, *bulk);
+      if (!result.ok()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = result.error().message();
+      } else {
+        SetGeneration(bulk->container(), bulk);
+      }
+      break;
+    }
+    case StorageRequestMessage::kPendingChangesMessage: {
+      auto const& msg = message.pending_changes_message();
+      auto* pending = return_message.mutable_pending_changes_message();
+      auto result = ListPendingChanges(msg.container(), *pending);
+      if (!result.ok()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = result.error().message();
+      } else {
+        SetGeneration(msg.container(), pending);
+      }
+      break;
+    }
+    case StorageRequestMessage::kResetOverridesMessage: {
+      auto const& msg = message.reset_overrides_message();
+      auto result = ResetOverrides(msg.container(), msg.package_name());
+      if (!result.ok()) {
+        auto* errmsg = return_message.mutable_error_message();
+        *errmsg = result.error().message();
+      } else {
+        return_message.mutable_reset_overrides_message()->set_num_flags_reset(*result);
       }
       break;
     }
@@ -526,6 +1983,83 @@ void HandleSocketRequest(const StorageRequestMessage& message,
       *errmsg = "Unknown message type from aconfigd socket";
       break;
   }
+  RecordMessage(message.msg_case(), NowNs() - start_ns,
+                return_message.has_error_message());
+}
+
+/// Handle a batch of incoming messages to aconfigd socket
+void HandleSocketRequests(const StorageRequestMessages& messages,
+                          StorageReturnMessages& return_messages) {
+  // requests are handled one at a time and a snapshot read batch holds no writes, so
+  // every read in it sees the same generation of each container
+  if (messages.snapshot_read()) {
+    for (auto const& message : messages.msgs()) {
+      auto* return_msg = return_messages.add_msgs();
+      if (IsWriteMessage(message)) {
+        *return_msg->mutable_error_message() =
+            "Writes are not allowed in a snapshot read";
+        RecordMessage(message.msg_case(), 0, true);
+        continue;
+      }
+      HandleSocketRequest(message, *return_msg);
+    }
+    return;
+  }
+
+  int num_msgs = messages.msgs_size();
+  for (int i = 0; i < num_msgs;) {
+    auto const& message = messages.msgs(i);
+    if (message.msg_case() != StorageRequestMessage::kNewStorageMessage) {
+      HandleSocketRequest(message, *return_messages.add_msgs());
+      i++;
+      continue;
+    }
+
+    // consecutive new storage messages share a single boot snapshot update
+    auto containers = std::vector<std::string>();
+    auto updated_msgs = std::vector<StorageReturnMessage*>();
+    auto batch_msgs = std::vector<std::pair<StorageReturnMessage*, uint64_t>>();
+    for (; i < num_msgs; i++) {
+      auto const& request = messages.msgs(i);
+      if (request.msg_case() != StorageRequestMessage::kNewStorageMessage) {
+        break;
+      }
+
+      auto const& msg = request.new_storage_message();
+      auto* return_msg = return_messages.add_msgs();
+      auto start_ns = NowNs();
+      auto updated_result = HandleContainerUpdate(
+          msg.container(), msg.package_map(), msg.flag_map(), msg.flag_value());
+      batch_msgs.push_back({return_msg, NowNs() - start_ns});
+      if (!updated_result.ok()) {
+        auto* errmsg = return_msg->mutable_error_message();
+        *errmsg = "Failed to update container " + msg.container() + ":"
+            + updated_result.error().message();
+        continue;
+      }
+      containers.push_back(msg.container());
+      updated_msgs.push_back(return_msg);
+    }
+
+    auto start_ns = NowNs();
+    auto copy_results = CreateBootSnapshotForContainers(containers);
+    auto snapshot_ns = NowNs() - start_ns;
+    for (size_t j = 0; j < updated_msgs.size(); ++j) {
+      auto* return_msg = updated_msgs[j];
+      if (!copy_results[j].ok()) {
+        auto* errmsg = return_msg->mutable_error_message();
+        *errmsg = "Failed to make a boot copy: " + copy_results[j].error().message();
+      } else {
+        return_msg->mutable_new_storage_message();
+      }
+    }
+
+    // every message in the batch waited for the shared boot snapshot update
+    for (auto const& [return_msg, update_ns] : batch_msgs) {
+      RecordMessage(StorageRequestMessage::kNewStorageMessage, update_ns + snapshot_ns,
+                    return_msg->has_error_message());
+    }
+  }
 }
 
 } // namespace aconfigd
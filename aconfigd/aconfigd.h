@@ -36,8 +36,19 @@ namespace android {
     void HandleSocketRequest(const StorageRequestMessage& message,
                              StorageReturnMessage& return_message);
 
+    /// Handle a batch of incoming messages to aconfigd socket, consecutive new
+    /// storage messages are committed to the boot snapshot together
+    void HandleSocketRequests(const StorageRequestMessages& messages,
+                              StorageReturnMessages& return_messages);
+
     /// Initialize in memory aconfig storage records
     base::Result<void> InitializeInMemoryStorageRecords();
 
+    /// Initialize storage for serving requests. Container files and flag offsets are
+    /// served from the boot index written by --initialize, storage records are only
+    /// loaded once a request needs them. Falls back to loading the storage records
+    /// right away if there is no usable boot index.
+    base::Result<void> InitializeStorageForServing();
+
   } // namespace aconfigd
 } // namespace android
@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+#include "aconfigd_async_io.h"
+#include "aconfigd_util.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Most operations in flight on an io_uring at once
+constexpr uint32_t kMaxRingEntries = 64;
+
+/// Most threads digesting files when io_uring is unavailable
+constexpr unsigned kMaxDigestThreads = 8;
+
+/// Open flags of batched files, the same as GetFileDigest uses
+constexpr int kReadOpenFlags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+
+/// Path of a statx on an open file, with AT_EMPTY_PATH
+constexpr char kEmptyPath[] = "";
+
+/// A submission and completion queue pair, driven with plain syscalls. Operations are
+/// submitted in rounds, and each round is waited on as a whole.
+class IoUring {
+ public:
+  static Result<std::unique_ptr<IoUring>> Create(uint32_t entries);
+
+  ~IoUring();
+
+  /// Check if the kernel supports an operation
+  bool Supports(uint8_t opcode) const;
+
+  /// Submit sqes and wait for all of them to complete. complete is called with the
+  /// user data and result of each. If submitting fails, the operations the kernel
+  /// already took are still waited for before the error is returned, so buffers they
+  /// write to can be freed once this returns. The ring is not usable after an error.
+  Result<void> Run(const std::vector<io_uring_sqe>& sqes,
+                   const std::function<void(uint64_t, int32_t)>& complete);
+
+ private:
+  IoUring() = default;
+
+  /// Submit count queued sqes, submitted is set to how many the kernel took
+  Result<void> Submit(uint32_t count, uint32_t* submitted);
+
+  /// Wait for count submitted operations to complete
+  void Reap(uint32_t count, const std::function<void(uint64_t, int32_t)>& complete);
+
+  base::unique_fd fd_;
+  void* sq_ring_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = MAP_FAILED;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  uint32_t sq_entries_ = 0;
+  uint32_t* sq_tail_ = nullptr;
+  uint32_t* sq_mask_ = nullptr;
+  uint32_t* sq_array_ = nullptr;
+  uint32_t* cq_head_ = nullptr;
+  uint32_t* cq_tail_ = nullptr;
+  uint32_t* cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+
+  std::vector<uint8_t> supported_ops_;
+};
+
+template <typename T>
+T* RingField(void* ring, uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<uint8_t*>(ring) + offset);
+}
+
+Result<std::unique_ptr<IoUring>> IoUring::Create(uint32_t entries) {
+  auto ring = std::unique_ptr<IoUring>(new IoUring());
+  auto params = io_uring_params();
+  int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (fd == -1) {
+    return ErrnoError() << "io_uring_setup() failed";
+  }
+  ring->fd_.reset(fd);
+
+  ring->sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    ring->sq_ring_size_ = std::max(ring->sq_ring_size_, ring->cq_ring_size_);
+  }
+
+  ring->sq_ring_ = mmap(nullptr, ring->sq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring_ == MAP_FAILED) {
+    return ErrnoError() << "mmap() failed for io_uring submission queue";
+  }
+  if (single_mmap) {
+    ring->cq_ring_ = ring->sq_ring_;
+  } else {
+    ring->cq_ring_ = mmap(nullptr, ring->cq_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring_ == MAP_FAILED) {
+      return ErrnoError() << "mmap() failed for io_uring completion queue";
+    }
+  }
+
+  ring->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, ring->sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return ErrnoError() << "mmap() failed for io_uring sqes";
+  }
+  ring->sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  ring->sq_entries_ = params.sq_entries;
+  ring->sq_tail_ = RingField<uint32_t>(ring->sq_ring_, params.sq_off.tail);
+  ring->sq_mask_ = RingField<uint32_t>(ring->sq_ring_, params.sq_off.ring_mask);
+  ring->sq_array_ = RingField<uint32_t>(ring->sq_ring_, params.sq_off.array);
+  ring->cq_head_ = RingField<uint32_t>(ring->cq_ring_, params.cq_off.head);
+  ring->cq_tail_ = RingField<uint32_t>(ring->cq_ring_, params.cq_off.tail);
+  ring->cq_mask_ = RingField<uint32_t>(ring->cq_ring_, params.cq_off.ring_mask);
+  ring->cqes_ = RingField<io_uring_cqe>(ring->cq_ring_, params.cq_off.cqes);
+
+  // operations a kernel does not know complete with -EINVAL, which reads the same as
+  // a bad argument, so the supported ones are looked up ahead
+  constexpr uint32_t kMaxProbeOps = 256;
+  auto probe_buffer = std::vector<uint8_t>(
+      sizeof(io_uring_probe) + kMaxProbeOps * sizeof(io_uring_probe_op));
+  auto* probe = reinterpret_cast<io_uring_probe*>(probe_buffer.data());
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+              kMaxProbeOps) == -1) {
+    return ErrnoError() << "io_uring_register() failed to probe operations";
+  }
+  ring->supported_ops_.resize(probe->ops_len);
+  for (uint32_t i = 0; i < probe->ops_len; ++i) {
+    ring->supported_ops_[i] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+  }
+
+  return ring;
+}
+
+IoUring::~IoUring() {
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+}
+
+bool IoUring::Supports(uint8_t opcode) const {
+  return opcode < supported_ops_.size() && supported_ops_[opcode];
+}
+
+Result<void> IoUring::Submit(uint32_t count, uint32_t* submitted) {
+  *submitted = 0;
+  while (*submitted < count) {
+    auto taken = syscall(__NR_io_uring_enter, fd_.get(), count - *submitted, 0, 0,
+                         nullptr, 0);
+    if (taken == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError() << "io_uring_enter() failed to submit";
+    }
+    *submitted += static_cast<uint32_t>(taken);
+  }
+  return {};
+}
+
+void IoUring::Reap(uint32_t count,
+                   const std::function<void(uint64_t, int32_t)>& complete) {
+  uint32_t completed = 0;
+  while (completed < count) {
+    uint32_t head = *cq_head_;
+    uint32_t cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    if (head == cq_tail) {
+      auto waited = syscall(__NR_io_uring_enter, fd_.get(), 0, 1,
+                            IORING_ENTER_GETEVENTS, nullptr, 0);
+      // operations in flight may still write to their buffers, returning before they
+      // complete is not safe
+      if (waited == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        PLOG(FATAL) << "io_uring_enter() failed to wait";
+      }
+      continue;
+    }
+    for (; head != cq_tail; ++head) {
+      auto const& cqe = cqes_[head & *cq_mask_];
+      complete(cqe.user_data, cqe.res);
+      completed++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+}
+
+Result<void> IoUring::Run(const std::vector<io_uring_sqe>& sqes,
+                          const std::function<void(uint64_t, int32_t)>& complete) {
+  for (size_t start = 0; start < sqes.size(); start += sq_entries_) {
+    auto count = static_cast<uint32_t>(
+        std::min<size_t>(sq_entries_, sqes.size() - start));
+
+    // the kernel only reads the tail, the ring is never fuller than one round
+    uint32_t tail = *sq_tail_;
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t index = tail & *sq_mask_;
+      sqes_[index] = sqes[start + i];
+      sq_array_[index] = index;
+      tail++;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+    uint32_t submitted = 0;
+    auto submit_result = Submit(count, &submitted);
+    Reap(submitted, complete);
+    if (!submit_result.ok()) {
+      return submit_result;
+    }
+  }
+  return {};
+}
+
+/// A file being digested through io_uring
+struct RingFile {
+  base::unique_fd fd;
+  struct statx stx;
+  /// errno and call of the step that failed, 0 while all steps succeed
+  int error = 0;
+  const char* failed_call = nullptr;
+
+  void Fail(int32_t res, const char* call) {
+    error = -res;
+    failed_call = call;
+  }
+};
+
+io_uring_sqe MakeSqe(uint8_t opcode, size_t index) {
+  auto sqe = io_uring_sqe();
+  sqe.opcode = opcode;
+  sqe.user_data = index;
+  return sqe;
+}
+
+/// Digest an open file of a batch
+Result<FileDigest> DigestOpenFile(const std::string& path,
+                                  int fd,
+                                  int64_t mtime_sec,
+                                  uint64_t size) {
+  auto digest = GetFdDigest(fd, static_cast<size_t>(size));
+  if (!digest.ok()) {
+    return Error() << "Failed to digest " << path << ": " << digest.error();
+  }
+  return FileDigest{static_cast<int>(mtime_sec), *digest};
+}
+
+/// Digest files with io_uring, one round for the opens and one for the stats of the
+/// opened files
+Result<std::vector<Result<FileDigest>>> DigestFilesWithIoUring(
+    IoUring& ring, const std::vector<std::string>& files) {
+  for (auto opcode : {IORING_OP_OPENAT, IORING_OP_STATX}) {
+    if (!ring.Supports(opcode)) {
+      return Error() << "io_uring operation " << opcode << " is not supported";
+    }
+  }
+
+  auto ring_files = std::vector<RingFile>(files.size());
+  auto sqes = std::vector<io_uring_sqe>();
+  sqes.reserve(files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    auto sqe = MakeSqe(IORING_OP_OPENAT, i);
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<uint64_t>(files[i].c_str());
+    sqe.open_flags = kReadOpenFlags;
+    sqes.push_back(sqe);
+  }
+  auto run_result = ring.Run(sqes, [&](uint64_t i, int32_t res) {
+    if (res < 0) {
+      ring_files[i].Fail(res, "open");
+    } else {
+      ring_files[i].fd.reset(res);
+    }
+  });
+  if (!run_result.ok()) {
+    return Error() << run_result.error();
+  }
+
+  // the opened files are stat'ed, like fstat() does, so the size and timestamp are
+  // those of the file that is digested
+  sqes.clear();
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (ring_files[i].error) {
+      continue;
+    }
+    auto sqe = MakeSqe(IORING_OP_STATX, i);
+    sqe.fd = ring_files[i].fd.get();
+    sqe.addr = reinterpret_cast<uint64_t>(kEmptyPath);
+    sqe.statx_flags = AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW;
+    sqe.len = STATX_SIZE | STATX_MTIME;
+    sqe.off = reinterpret_cast<uint64_t>(&ring_files[i].stx);
+    sqes.push_back(sqe);
+  }
+  run_result = ring.Run(sqes, [&](uint64_t i, int32_t res) {
+    if (res < 0) {
+      ring_files[i].Fail(res, "statx");
+    }
+  });
+  if (!run_result.ok()) {
+    return Error() << run_result.error();
+  }
+
+  auto results = std::vector<Result<FileDigest>>();
+  results.reserve(files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    auto& ring_file = ring_files[i];
+    if (ring_file.error) {
+      errno = ring_file.error;
+      results.push_back(ErrnoError() << ring_file.failed_call << "() failed for "
+                                     << files[i]);
+    } else {
+      results.push_back(DigestOpenFile(files[i], ring_file.fd.get(),
+                                       ring_file.stx.stx_mtime.tv_sec,
+                                       ring_file.stx.stx_size));
+    }
+  }
+  return results;
+}
+
+/// Digest a file with plain syscalls
+Result<FileDigest> DigestFileSync(const std::string& path) {
+  auto fd = base::unique_fd(TEMP_FAILURE_RETRY(open(path.c_str(), kReadOpenFlags)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << path;
+  }
+
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1) {
+    return ErrnoError() << "fstat() failed for " << path;
+  }
+
+  return DigestOpenFile(path, fd.get(), st.st_mtim.tv_sec, st.st_size);
+}
+
+/// Digest files spread over a pool of threads
+std::vector<Result<FileDigest>> DigestFilesWithThreads(
+    const std::vector<std::string>& files) {
+  auto results = std::vector<Result<FileDigest>>(files.size(), FileDigest());
+  auto next = std::atomic<size_t>(0);
+  auto worker = [&]() {
+    for (auto i = next++; i < files.size(); i = next++) {
+      results[i] = DigestFileSync(files[i]);
+    }
+  };
+
+  auto num_threads = std::min<size_t>(
+      {files.size(), std::max(1u, std::thread::hardware_concurrency()),
+       kMaxDigestThreads});
+  auto threads = std::vector<std::thread>();
+  for (size_t i = 1; i < num_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return results;
+}
+
+} // namespace
+
+/// Get the name of an async io backend
+const char* AsyncIoBackendName(AsyncIoBackend backend) {
+  switch (backend) {
+    case AsyncIoBackend::kIoUring:
+      return "io_uring";
+    case AsyncIoBackend::kThreadPool:
+      return "thread pool";
+  }
+  return "unknown";
+}
+
+/// Get the timestamps and content digests of a batch of files together
+FileDigestBatch DigestFiles(const std::vector<std::string>& files, bool use_io_uring) {
+  auto batch = FileDigestBatch();
+  if (use_io_uring && !files.empty()) {
+    auto entries = static_cast<uint32_t>(std::min<size_t>(files.size(), kMaxRingEntries));
+    auto ring = IoUring::Create(entries);
+    auto results = ring.ok()
+        ? DigestFilesWithIoUring(**ring, files)
+        : Result<std::vector<Result<FileDigest>>>(Error() << ring.error());
+    if (results.ok()) {
+      batch.backend = AsyncIoBackend::kIoUring;
+      batch.files = std::move(*results);
+      return batch;
+    }
+    LOG(INFO) << "Digesting files with a thread pool, io_uring is unavailable: "
+              << results.error();
+  }
+
+  batch.backend = AsyncIoBackend::kThreadPool;
+  batch.files = DigestFilesWithThreads(files);
+  return batch;
+}
+
+} // namespace aconfigd
+} // namespace android
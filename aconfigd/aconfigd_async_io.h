@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Ways a batch of file operations is carried out
+    enum class AsyncIoBackend {
+      /// Each step of all files is submitted to an io_uring at once
+      kIoUring,
+      /// Files are spread over a pool of threads, each done synchronously
+      kThreadPool,
+    };
+
+    /// Get the name of an async io backend
+    const char* AsyncIoBackendName(AsyncIoBackend backend);
+
+    /// A file digested in a batch
+    struct FileDigest {
+      /// Modification time in seconds, as GetFileTimeStamp reports it
+      int timestamp = 0;
+      /// Content digest, as GetFileDigest reports it
+      uint64_t digest = 0;
+    };
+
+    /// Files digested by DigestFiles, in the order they were asked for
+    struct FileDigestBatch {
+      AsyncIoBackend backend = AsyncIoBackend::kThreadPool;
+      std::vector<base::Result<FileDigest>> files;
+    };
+
+    /// Get the timestamps and content digests of a batch of files together. With
+    /// io_uring the opens of all files are submitted at once, then the stats of the
+    /// opened files, so the batch takes two round trips to the kernel whatever its
+    /// size. Each file is then hashed through a read only mapping, its content is
+    /// never copied. Falls back to a thread pool if io_uring is unavailable, or if
+    /// use_io_uring is false. Both backends stat the file they opened, and do not
+    /// follow symlinks. A file that does not exist fails with ENOENT.
+    FileDigestBatch DigestFiles(const std::vector<std::string>& files,
+                                bool use_io_uring = true);
+
+  } // namespace aconfigd
+} // namespace android
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Socket level load generator for aconfigd. Drives a number of concurrent clients
+/// with a configurable mix of flag query, flag override and new storage requests
+/// against a running aconfigd, and reports throughput and latency percentiles.
+///
+/// Usage:
+///   aconfigd_bench --container=<container> [--clients=N] [--requests=N]
+///       [--mix=query:90,override:9,new_storage:1] [--batch=K]
+///       [--package_map=<file> --flag_map=<file> --flag_val=<file>]
+///
+/// The flags to query and override are discovered with a container dump, so any
+/// container aconfigd knows about works, including synthetic large ones added with
+/// new storage messages before the run. Overrides write back the value each flag
+/// had when the run started, so the run leaves flag values untouched. aconfigd reads a
+/// request in a single recv, so --batch is limited to what fits in its buffer.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include <aconfigd.pb.h>
+#include "aconfigd.h"
+#include "aconfigd_client.h"
+
+using namespace android::aconfigd;
+using namespace android::base;
+
+namespace {
+
+enum Op { kQuery, kOverride, kNewStorage, kNumOps };
+
+const char* kOpNames[kNumOps] = {"query", "override", "new_storage"};
+
+struct BenchFlag {
+  std::string package_name;
+  std::string flag_name;
+  bool flag_value;
+};
+
+struct BenchOptions {
+  std::string container;
+  std::string package_map;
+  std::string flag_map;
+  std::string flag_val;
+  uint32_t clients = 4;
+  uint32_t requests = 1000;
+  uint32_t batch = 1;
+  uint32_t mix[kNumOps] = {90, 10, 0};
+};
+
+/// per client results, latencies are in ns and one entry per request
+struct ClientResult {
+  std::vector<uint64_t> latencies[kNumOps];
+  uint64_t errors = 0;
+};
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/// parse mix spec such as query:90,override:9,new_storage:1
+bool ParseMix(const std::string& spec, uint32_t mix[kNumOps]) {
+  std::fill(mix, mix + kNumOps, 0);
+  for (const auto& entry : Split(spec, ",")) {
+    auto parts = Split(entry, ":");
+    if (parts.size() != 2) {
+      return false;
+    }
+    auto op = std::find(kOpNames, kOpNames + kNumOps, parts[0]) - kOpNames;
+    if (op == kNumOps || !ParseUint(parts[1], &mix[op])) {
+      return false;
+    }
+  }
+  return mix[kQuery] + mix[kOverride] + mix[kNewStorage] > 0;
+}
+
+bool ParseOptions(int argc, char** argv, BenchOptions& options) {
+  for (int i = 1; i < argc; ++i) {
+    auto arg = std::string(argv[i]);
+    auto pos = arg.find('=');
+    if (!StartsWith(arg, "--") || pos == std::string::npos) {
+      return false;
+    }
+    auto name = arg.substr(2, pos - 2);
+    auto value = arg.substr(pos + 1);
+    bool ok = true;
+    if (name == "container") {
+      options.container = value;
+    } else if (name == "package_map") {
+      options.package_map = value;
+    } else if (name == "flag_map") {
+      options.flag_map = value;
+    } else if (name == "flag_val") {
+      options.flag_val = value;
+    } else if (name == "clients") {
+      ok = ParseUint(value, &options.clients, 1024u) && options.clients > 0;
+    } else if (name == "requests") {
+      ok = ParseUint(value, &options.requests) && options.requests > 0;
+    } else if (name == "batch") {
+      ok = ParseUint(value, &options.batch, 1024u) && options.batch > 0;
+    } else if (name == "mix") {
+      ok = ParseMix(value, options.mix);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+
+  if (options.container.empty()) {
+    return false;
+  }
+
+  bool has_storage_files = !options.package_map.empty() && !options.flag_map.empty()
+      && !options.flag_val.empty();
+  return options.mix[kNewStorage] == 0 || has_storage_files;
+}
+
+/// discover flags of the container under test
+Result<std::vector<BenchFlag>> DiscoverFlags(const std::string& container) {
+  auto messages = StorageRequestMessages{};
+  messages.add_msgs()->mutable_container_dump_message()->set_container(container);
+  auto return_messages = SendAconfigdMessages(messages);
+  if (!return_messages.ok()) {
+    return Error() << return_messages.error();
+  }
+
+  const auto& return_msg = return_messages->msgs(0);
+  if (return_msg.has_error_message()) {
+    return Error() << return_msg.error_message();
+  }
+
+  auto flags = std::vector<BenchFlag>();
+  for (const auto& package : return_msg.container_dump_message().packages()) {
+    for (const auto& flag : package.flags()) {
+      flags.push_back({package.package_name(), flag.flag_name(), flag.flag_value()});
+    }
+  }
+  if (flags.empty()) {
+    return Error() << "container " << container << " has no flags";
+  }
+  return flags;
+}
+
+void AddRequest(Op op, const BenchOptions& options, const BenchFlag& flag,
+                StorageRequestMessages& messages) {
+  auto* msg = messages.add_msgs();
+  switch (op) {
+    case kQuery: {
+      auto* query = msg->mutable_flag_query_message();
+      query->set_package_name(flag.package_name);
+      query->set_flag_name(flag.flag_name);
+      break;
+    }
+    case kOverride: {
+      auto* override_msg = msg->mutable_flag_override_message();
+      override_msg->set_package_name(flag.package_name);
+      override_msg->set_flag_name(flag.flag_name);
+      override_msg->set_flag_value(flag.flag_value ? "true" : "false");
+      break;
+    }
+    case kNewStorage: {
+      auto* new_storage = msg->mutable_new_storage_message();
+      new_storage->set_container(options.container);
+      new_storage->set_package_map(options.package_map);
+      new_storage->set_flag_map(options.flag_map);
+      new_storage->set_flag_value(options.flag_val);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/// run one client, each connection carries a batch of requests of the same type so
+/// that the latency of a connection can be attributed to a single op
+void RunClient(uint32_t client, const BenchOptions& options,
+               const std::vector<BenchFlag>& flags, ClientResult& result) {
+  auto rng = std::mt19937(client);
+  auto op_dist = std::discrete_distribution<int>(options.mix, options.mix + kNumOps);
+  auto flag_dist = std::uniform_int_distribution<size_t>(0, flags.size() - 1);
+
+  for (uint32_t i = 0; i < options.requests; ++i) {
+    auto op = static_cast<Op>(op_dist(rng));
+    auto messages = StorageRequestMessages{};
+    for (uint32_t j = 0; j < options.batch; ++j) {
+      AddRequest(op, options, flags[flag_dist(rng)], messages);
+    }
+
+    auto start_ns = NowNs();
+    auto return_messages = SendAconfigdMessages(messages, 0);
+    auto latency = NowNs() - start_ns;
+
+    if (!return_messages.ok()) {
+      result.errors++;
+      continue;
+    }
+    if (return_messages->msgs_size() != messages.msgs_size()) {
+      result.errors++;
+    }
+    for (const auto& return_msg : return_messages->msgs()) {
+      if (return_msg.has_error_message()) {
+        result.errors++;
+      }
+    }
+    result.latencies[op].push_back(latency);
+  }
+}
+
+/// largest batch whose requests fit in the aconfigd request buffer whichever flags are
+/// picked, aconfigd reads each request with a single recv of kBufferSize bytes
+uint32_t MaxBatch(const BenchOptions& options, const std::vector<BenchFlag>& flags) {
+  size_t max_request_size = 1;
+  for (int op = 0; op < kNumOps; ++op) {
+    if (options.mix[op] == 0) {
+      continue;
+    }
+    for (const auto& flag : flags) {
+      auto messages = StorageRequestMessages{};
+      AddRequest(static_cast<Op>(op), options, flag, messages);
+      max_request_size = std::max(max_request_size, messages.ByteSizeLong());
+    }
+  }
+  return static_cast<uint32_t>(kBufferSize / max_request_size);
+}
+
+double Percentile(const std::vector<uint64_t>& sorted, double p) {
+  auto index = static_cast<size_t>(p * (sorted.size() - 1));
+  return sorted[index] / 1000.0;
+}
+
+void Report(const char* name, std::vector<uint64_t>& latencies, double elapsed_s) {
+  if (latencies.empty()) {
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  printf("%-12s %10zu %12.1f %10.1f %10.1f %10.1f\n", name, latencies.size(),
+         latencies.size() / elapsed_s, Percentile(latencies, 0.5),
+         Percentile(latencies, 0.99), Percentile(latencies, 0.999));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  InitLogging(argv, &StderrLogger);
+
+  auto options = BenchOptions();
+  if (!ParseOptions(argc, argv, options)) {
+    LOG(ERROR) << "usage: aconfigd_bench --container=<container> [--clients=N] "
+               << "[--requests=N] [--mix=query:90,override:9,new_storage:1] "
+               << "[--batch=K] [--package_map=<file> --flag_map=<file> "
+               << "--flag_val=<file>]";
+    return 1;
+  }
+
+  auto flags = DiscoverFlags(options.container);
+  if (!flags.ok()) {
+    LOG(ERROR) << "failed to discover flags: " << flags.error();
+    return 1;
+  }
+
+  auto max_batch = MaxBatch(options, *flags);
+  if (options.batch > max_batch) {
+    LOG(ERROR) << "batch of " << options.batch << " requests may not fit in the "
+               << kBufferSize << " byte aconfigd request buffer, use --batch="
+               << max_batch << " or less";
+    return 1;
+  }
+
+  auto results = std::vector<ClientResult>(options.clients);
+  auto threads = std::vector<std::thread>();
+  auto start_ns = NowNs();
+  for (uint32_t i = 0; i < options.clients; ++i) {
+    threads.emplace_back(RunClient, i, std::cref(options), std::cref(*flags),
+                         std::ref(results[i]));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double elapsed_s = (NowNs() - start_ns) / 1e9;
+
+  auto all = std::vector<uint64_t>();
+  auto by_op = std::vector<std::vector<uint64_t>>(kNumOps);
+  uint64_t errors = 0;
+  for (auto& result : results) {
+    for (int op = 0; op < kNumOps; ++op) {
+      by_op[op].insert(by_op[op].end(), result.latencies[op].begin(),
+                       result.latencies[op].end());
+    }
+    errors += result.errors;
+  }
+  for (const auto& latencies : by_op) {
+    all.insert(all.end(), latencies.begin(), latencies.end());
+  }
+
+  printf("container %s, %zu flags, %u clients, batch %u, %.2fs, %" PRIu64 " errors\n",
+         options.container.c_str(), flags->size(), options.clients, options.batch,
+         elapsed_s, errors);
+  printf("%-12s %10s %12s %10s %10s %10s\n", "op", "conns", "conns/s", "p50(us)",
+         "p99(us)", "p999(us)");
+  for (int op = 0; op < kNumOps; ++op) {
+    Report(kOpNames[op], by_op[op], elapsed_s);
+  }
+  Report("all", all, elapsed_s);
+
+  return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,499 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+
+#include "aconfigd_boot_index.h"
+#include "aconfigd_storage_file.h"
+#include "aconfigd_util.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// A string in the strings section of the boot index
+struct BootIndexString {
+  uint32_t offset;
+  uint32_t size;
+};
+
+/// Boot index file header, all offsets are from the start of the file
+struct BootIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t file_size;
+  uint32_t num_containers;
+  uint32_t containers_offset;
+  uint32_t packages_offset;
+  uint32_t flags_offset;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+};
+
+/// A container entry of the boot index
+struct BootIndexContainerEntry {
+  BootIndexString container;
+  BootIndexString package_map;
+  BootIndexString flag_map;
+  BootIndexString flag_val;
+};
+
+/// Perfect hash table header, followed by a displacement per bucket and the slots
+struct BootIndexTableHeader {
+  uint32_t num_buckets;
+  uint32_t num_slots;
+};
+
+/// A perfect hash table slot
+struct BootIndexSlot {
+  BootIndexString key;
+  uint32_t container_index;
+  uint32_t value;
+};
+
+/// Container index of an empty slot
+constexpr uint32_t kEmptySlot = 0xFFFFFFFF;
+
+/// Give up building a table if a bucket cannot be placed with this many displacements
+constexpr uint32_t kMaxDisplacement = 1 << 20;
+
+/// FNV-1a offset basis, the key hash seed
+constexpr uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+
+/// Hash bytes onto a running FNV-1a hash, so composite keys hash without being built
+uint64_t HashBytes(uint64_t hash, const char* data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/// splitmix64 finalizer
+uint64_t Mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+uint64_t PackageKeyHash(const std::string& package) {
+  return HashBytes(kHashSeed, package.data(), package.size());
+}
+
+uint64_t FlagKeyHash(const std::string& package, const std::string& flag) {
+  auto hash = HashBytes(kHashSeed, package.data(), package.size());
+  hash = HashBytes(hash, "/", 1);
+  return HashBytes(hash, flag.data(), flag.size());
+}
+
+uint32_t BucketOf(uint64_t hash, uint32_t num_buckets) {
+  return static_cast<uint32_t>((hash >> 32) % num_buckets);
+}
+
+uint32_t SlotOf(uint64_t hash, uint32_t displacement, uint32_t num_slots) {
+  return static_cast<uint32_t>(
+      Mix(hash + displacement * 0x9E3779B97F4A7C15ULL) % num_slots);
+}
+
+/// A key to place in a perfect hash table
+struct TableKey {
+  uint64_t hash;
+  BootIndexString key;
+  uint32_t container_index;
+  uint32_t value;
+};
+
+/// Boot index being written
+class BootIndexBuilder {
+ public:
+  BootIndexString AddString(const std::string& str) {
+    auto entry = BootIndexString{static_cast<uint32_t>(strings_.size()),
+                                 static_cast<uint32_t>(str.size())};
+    strings_ += str;
+    return entry;
+  }
+
+  const std::string& strings() const { return strings_; }
+
+  /// Build a perfect hash table with hash and displace. Keys are grouped into
+  /// buckets, then the largest buckets first search for a displacement that puts all
+  /// of their keys in free slots.
+  Result<std::string> BuildTable(const std::vector<TableKey>& keys) {
+    auto header = BootIndexTableHeader();
+    header.num_buckets = keys.size() / 4 + 1;
+    header.num_slots = keys.size() + keys.size() / 4 + 1;
+
+    auto buckets = std::vector<std::vector<uint32_t>>(header.num_buckets);
+    for (uint32_t i = 0; i < keys.size(); ++i) {
+      buckets[BucketOf(keys[i].hash, header.num_buckets)].push_back(i);
+    }
+    auto order = std::vector<uint32_t>(header.num_buckets);
+    for (uint32_t i = 0; i < header.num_buckets; ++i) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+      return buckets[a].size() > buckets[b].size();
+    });
+
+    auto displacements = std::vector<uint32_t>(header.num_buckets, 0);
+    auto slots = std::vector<BootIndexSlot>(
+        header.num_slots, BootIndexSlot{{0, 0}, kEmptySlot, 0});
+    auto bucket_slots = std::vector<uint32_t>();
+    for (auto bucket : order) {
+      if (buckets[bucket].empty()) {
+        break;
+      }
+
+      bool placed = false;
+      for (uint32_t d = 0; d < kMaxDisplacement && !placed; ++d) {
+        bucket_slots.clear();
+        placed = true;
+        for (auto i : buckets[bucket]) {
+          auto slot = SlotOf(keys[i].hash, d, header.num_slots);
+          if (slots[slot].container_index != kEmptySlot
+              || std::find(bucket_slots.begin(), bucket_slots.end(), slot)
+                  != bucket_slots.end()) {
+            placed = false;
+            break;
+          }
+          bucket_slots.push_back(slot);
+        }
+        if (placed) {
+          displacements[bucket] = d;
+        }
+      }
+
+      if (!placed) {
+        return Error() << "Failed to place " << buckets[bucket].size()
+                       << " keys of bucket " << bucket;
+      }
+
+      for (size_t j = 0; j < bucket_slots.size(); ++j) {
+        const auto& key = keys[buckets[bucket][j]];
+        slots[bucket_slots[j]] = BootIndexSlot{key.key, key.container_index, key.value};
+      }
+    }
+
+    auto table = std::string();
+    table.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    table.append(reinterpret_cast<const char*>(displacements.data()),
+                 displacements.size() * sizeof(uint32_t));
+    table.append(reinterpret_cast<const char*>(slots.data()),
+                 slots.size() * sizeof(BootIndexSlot));
+    return table;
+  }
+
+ private:
+  std::string strings_;
+};
+
+/// The mapped boot index of the serving daemon
+struct MappedBootIndex {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  std::string file;
+  std::vector<std::string> containers;
+  std::unique_ptr<std::atomic<bool>[]> valid;
+};
+
+/// The boot index is mapped once at start and stays mapped
+static MappedBootIndex boot_index;
+
+const BootIndexHeader* GetHeader() {
+  return reinterpret_cast<const BootIndexHeader*>(boot_index.data);
+}
+
+/// Get a string of the strings section, bounds checked
+bool GetString(const BootIndexString& str, const char** data) {
+  const auto* header = GetHeader();
+  if (static_cast<uint64_t>(str.offset) + str.size > header->strings_size) {
+    return false;
+  }
+  *data = reinterpret_cast<const char*>(boot_index.data) + header->strings_offset
+      + str.offset;
+  return true;
+}
+
+std::string GetStringOrEmpty(const BootIndexString& str) {
+  const char* data = nullptr;
+  return GetString(str, &data) ? std::string(data, str.size) : std::string();
+}
+
+/// Probe the single candidate slot of a key, bounds checked
+const BootIndexSlot* ProbeTable(uint32_t table_offset, uint64_t hash) {
+  if (boot_index.data == nullptr
+      || static_cast<uint64_t>(table_offset) + sizeof(BootIndexTableHeader)
+          > boot_index.size) {
+    return nullptr;
+  }
+
+  auto table_header = BootIndexTableHeader();
+  memcpy(&table_header, boot_index.data + table_offset, sizeof(table_header));
+  if (table_header.num_buckets == 0 || table_header.num_slots == 0) {
+    return nullptr;
+  }
+
+  auto displacements_offset = static_cast<uint64_t>(table_offset)
+      + sizeof(BootIndexTableHeader);
+  auto slots_offset = displacements_offset
+      + static_cast<uint64_t>(table_header.num_buckets) * sizeof(uint32_t);
+  if (slots_offset + static_cast<uint64_t>(table_header.num_slots)
+      * sizeof(BootIndexSlot) > boot_index.size) {
+    return nullptr;
+  }
+
+  uint32_t displacement;
+  memcpy(&displacement, boot_index.data + displacements_offset
+         + BucketOf(hash, table_header.num_buckets) * sizeof(uint32_t),
+         sizeof(displacement));
+  auto slot = SlotOf(hash, displacement, table_header.num_slots);
+  const auto* entry = reinterpret_cast<const BootIndexSlot*>(
+      boot_index.data + slots_offset + slot * sizeof(BootIndexSlot));
+
+  if (entry->container_index >= boot_index.containers.size()
+      || !boot_index.valid[entry->container_index].load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+  return entry;
+}
+
+} // namespace
+
+/// Write the boot index of containers
+Result<void> WriteBootIndex(const std::string& file,
+                            const std::vector<BootIndexContainer>& containers) {
+  auto builder = BootIndexBuilder();
+  auto entries = std::vector<BootIndexContainerEntry>();
+  auto package_keys = std::vector<TableKey>();
+  auto flag_keys = std::vector<TableKey>();
+  auto packages_seen = std::unordered_set<std::string>();
+
+  for (uint32_t i = 0; i < containers.size(); ++i) {
+    const auto& container = containers[i];
+    entries.push_back({builder.AddString(container.container),
+                       builder.AddString(container.package_map),
+                       builder.AddString(container.flag_map),
+                       builder.AddString(container.flag_val)});
+
+    auto package_map = MapStorageFileAt(container.package_map);
+    if (!package_map.ok()) {
+      return Error() << package_map.error();
+    }
+    auto packages = ListPackages(*package_map);
+    UnmapStorageFile(*package_map);
+    if (!packages.ok()) {
+      return Error() << packages.error();
+    }
+
+    auto flag_map = MapStorageFileAt(container.flag_map);
+    if (!flag_map.ok()) {
+      return Error() << flag_map.error();
+    }
+    auto flags = ListFlags(*flag_map);
+    UnmapStorageFile(*flag_map);
+    if (!flags.ok()) {
+      return Error() << flags.error();
+    }
+
+    // a package shadowed by an earlier container is never looked up in this one
+    auto package_names = std::unordered_map<uint32_t, const PackageEntry*>();
+    for (const auto& package : *packages) {
+      if (!packages_seen.insert(package.package_name).second) {
+        continue;
+      }
+      package_names[package.package_id] = &package;
+      package_keys.push_back({PackageKeyHash(package.package_name),
+                              builder.AddString(package.package_name), i,
+                              package.boolean_start_index});
+    }
+
+    for (const auto& flag : *flags) {
+      auto it = package_names.find(flag.package_id);
+      if (it == package_names.end()) {
+        continue;
+      }
+      const auto& package = *it->second;
+      flag_keys.push_back({FlagKeyHash(package.package_name, flag.flag_name),
+                           builder.AddString(package.package_name + "/" + flag.flag_name),
+                           i, package.boolean_start_index + flag.flag_index});
+    }
+  }
+
+  auto package_table = builder.BuildTable(package_keys);
+  if (!package_table.ok()) {
+    return Error() << "Failed to build package table: " << package_table.error();
+  }
+  auto flag_table = builder.BuildTable(flag_keys);
+  if (!flag_table.ok()) {
+    return Error() << "Failed to build flag table: " << flag_table.error();
+  }
+
+  auto header = BootIndexHeader();
+  header.magic = kBootIndexMagic;
+  header.version = kBootIndexVersion;
+  header.num_containers = entries.size();
+  header.containers_offset = sizeof(header);
+  header.packages_offset = header.containers_offset
+      + entries.size() * sizeof(BootIndexContainerEntry);
+  header.flags_offset = header.packages_offset + package_table->size();
+  header.strings_offset = header.flags_offset + flag_table->size();
+  header.strings_size = builder.strings().size();
+  header.file_size = header.strings_offset + header.strings_size;
+
+  auto content = std::string();
+  content.reserve(header.file_size);
+  content.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  content.append(reinterpret_cast<const char*>(entries.data()),
+                 entries.size() * sizeof(BootIndexContainerEntry));
+  content += *package_table;
+  content += *flag_table;
+  content += builder.strings();
+
+  return WriteFileAtomically(content, file, 0644);
+}
+
+/// Map the boot index, only the header is checked
+Result<std::vector<BootIndexContainer>> LoadBootIndex(const std::string& file) {
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(file.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << file;
+  }
+
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1) {
+    return ErrnoError() << "fstat() failed for " << file;
+  }
+
+  auto size = static_cast<size_t>(st.st_size);
+  if (size < sizeof(BootIndexHeader)) {
+    return Error() << file << " is too small to be a boot index";
+  }
+
+  void* map_ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+  if (map_ptr == MAP_FAILED) {
+    return ErrnoError() << "mmap() failed for " << file;
+  }
+
+  const auto* header = static_cast<const BootIndexHeader*>(map_ptr);
+  if (header->magic != kBootIndexMagic || header->version != kBootIndexVersion
+      || header->file_size != size
+      || static_cast<uint64_t>(header->containers_offset)
+          + static_cast<uint64_t>(header->num_containers)
+          * sizeof(BootIndexContainerEntry) > size
+      || static_cast<uint64_t>(header->strings_offset) + header->strings_size > size) {
+    munmap(map_ptr, size);
+    return Error() << file << " is not a valid boot index";
+  }
+
+  if (boot_index.data != nullptr) {
+    munmap(const_cast<uint8_t*>(boot_index.data), boot_index.size);
+  }
+  boot_index.data = static_cast<const uint8_t*>(map_ptr);
+  boot_index.size = size;
+  boot_index.file = file;
+  boot_index.containers.clear();
+  boot_index.valid.reset(new std::atomic<bool>[header->num_containers]);
+
+  auto containers = std::vector<BootIndexContainer>();
+  const auto* entries = reinterpret_cast<const BootIndexContainerEntry*>(
+      boot_index.data + header->containers_offset);
+  for (uint32_t i = 0; i < header->num_containers; ++i) {
+    auto container = BootIndexContainer{GetStringOrEmpty(entries[i].container),
+                                        GetStringOrEmpty(entries[i].package_map),
+                                        GetStringOrEmpty(entries[i].flag_map),
+                                        GetStringOrEmpty(entries[i].flag_val)};
+    bool valid = !container.container.empty() && !container.package_map.empty()
+        && !container.flag_map.empty() && !container.flag_val.empty();
+    boot_index.valid[i].store(valid, std::memory_order_relaxed);
+    boot_index.containers.push_back(container.container);
+    if (valid) {
+      containers.push_back(std::move(container));
+    }
+  }
+
+  return containers;
+}
+
+/// Stop answering lookups of a container from the boot index
+void InvalidateBootIndexContainer(const std::string& container) {
+  if (boot_index.data == nullptr) {
+    return;
+  }
+
+  for (size_t i = 0; i < boot_index.containers.size(); ++i) {
+    if (boot_index.containers[i] == container) {
+      boot_index.valid[i].store(false, std::memory_order_release);
+
+      // a restarted daemon must not pick up the stale index either
+      unlink(boot_index.file.c_str());
+    }
+  }
+}
+
+/// Find a package in the boot index
+std::optional<BootIndexPackage> FindPackageInBootIndex(const std::string& package) {
+  const auto* slot = ProbeTable(
+      boot_index.data ? GetHeader()->packages_offset : 0, PackageKeyHash(package));
+  const char* key = nullptr;
+  if (slot == nullptr || slot->key.size != package.size() || !GetString(slot->key, &key)
+      || memcmp(key, package.data(), package.size()) != 0) {
+    return std::nullopt;
+  }
+  return BootIndexPackage{boot_index.containers[slot->container_index], slot->value};
+}
+
+/// Find the boolean flag value index of a flag in the boot index
+std::optional<uint32_t> FindFlagInBootIndex(const std::string& container,
+                                            const std::string& package,
+                                            const std::string& flag) {
+  const auto* slot = ProbeTable(
+      boot_index.data ? GetHeader()->flags_offset : 0, FlagKeyHash(package, flag));
+  const char* key = nullptr;
+  if (slot == nullptr || slot->key.size != package.size() + 1 + flag.size()
+      || !GetString(slot->key, &key)
+      || boot_index.containers[slot->container_index] != container
+      || memcmp(key, package.data(), package.size()) != 0
+      || key[package.size()] != '/'
+      || memcmp(key + package.size() + 1, flag.data(), flag.size()) != 0) {
+    return std::nullopt;
+  }
+  return slot->value;
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Boot index file magic, "ACBI"
+    static constexpr uint32_t kBootIndexMagic = 0x49424341;
+
+    /// Boot index file format version
+    static constexpr uint32_t kBootIndexVersion = 1;
+
+    /// Storage files of a container covered by the boot index
+    struct BootIndexContainer {
+      std::string container;
+      std::string package_map;
+      std::string flag_map;
+      std::string flag_val;
+    };
+
+    /// A package found in the boot index
+    struct BootIndexPackage {
+      std::string container;
+      uint32_t boolean_start_index;
+    };
+
+    /// Write the boot index of containers. The index holds the container storage file
+    /// records, a package to container table, and a package and flag to flag value
+    /// index table. Both tables are minimal perfect hash tables, so a lookup probes a
+    /// single slot.
+    base::Result<void> WriteBootIndex(const std::string& file,
+                                      const std::vector<BootIndexContainer>& containers);
+
+    /// Map the boot index, only the header is checked so this does not depend on the
+    /// index size. Returns the containers covered by the index.
+    base::Result<std::vector<BootIndexContainer>> LoadBootIndex(const std::string& file);
+
+    /// Stop answering lookups of a container from the boot index, called when the
+    /// storage files of the container change
+    void InvalidateBootIndexContainer(const std::string& container);
+
+    /// Find a package in the boot index
+    std::optional<BootIndexPackage> FindPackageInBootIndex(const std::string& package);
+
+    /// Find the boolean flag value index of a flag in the boot index
+    std::optional<uint32_t> FindFlagInBootIndex(const std::string& container,
+                                                const std::string& package,
+                                                const std::string& flag);
+
+  } // namespace aconfigd
+} // namespace android
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mutex>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+
+#include "aconfigd_capture.h"
+#include "aconfigd_stats.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Capture file layout: a header, then one record per request frame. A record is the
+/// frame's receive time as ns since the header's base time, the frame size, both
+/// varints, then the frame bytes.
+constexpr uint32_t kCaptureMagic = 0x50414341; // "ACAP"
+constexpr uint32_t kCaptureVersion = 2;
+
+/// File holding the id of the current boot, a UUID string
+constexpr char kBootIdFile[] = "/proc/sys/kernel/random/boot_id";
+
+struct CaptureHeader {
+  uint32_t magic;
+  uint32_t version;
+  /// CLOCK_MONOTONIC ns the capture file was created at
+  uint64_t base_ns;
+  /// Id of the boot the capture file was created in, zero padded
+  char boot_id[40];
+};
+
+/// Open capture file and the base time of its records, guarded by capture_mutex
+static base::unique_fd capture_fd;
+static uint64_t capture_base_ns = 0;
+static std::mutex capture_mutex;
+
+/// Get the id of the current boot, empty if it can not be read
+std::string GetBootId() {
+  auto boot_id = std::string();
+  if (!base::ReadFileToString(kBootIdFile, &boot_id)) {
+    return "";
+  }
+  return base::Trim(boot_id);
+}
+
+void AppendVarint(uint64_t value, std::string& out) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+bool ReadVarint(const std::string& in, size_t& pos, uint64_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+    auto byte = static_cast<uint8_t>(in[pos++]);
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Parse the records of a capture file, records stop at the first incomplete one and
+/// end is set to where it starts
+Result<CaptureHeader> ParseCapture(const std::string& content,
+                                   std::vector<CapturedRequest>* records,
+                                   size_t& end) {
+  auto header = CaptureHeader();
+  if (content.size() < sizeof(header)) {
+    return Error() << "Capture file is too short";
+  }
+  memcpy(&header, content.data(), sizeof(header));
+  if (header.magic != kCaptureMagic || header.version != kCaptureVersion) {
+    return Error() << "Unsupported capture file";
+  }
+
+  size_t pos = sizeof(header);
+  end = pos;
+  while (pos < content.size()) {
+    uint64_t offset_ns = 0;
+    uint64_t size = 0;
+    if (!ReadVarint(content, pos, offset_ns) || !ReadVarint(content, pos, size)
+        || size > content.size() - pos) {
+      break;
+    }
+    if (records) {
+      records->push_back({offset_ns, content.substr(pos, size)});
+    }
+    pos += size;
+    end = pos;
+  }
+  return header;
+}
+
+/// Reuse the header of a capture file of this boot, dropping a record cut short by a
+/// crash, otherwise start the file over. Without a boot id the file is always started
+/// over, since its base time can not be trusted.
+Result<uint64_t> PrepareCaptureFile(int fd) {
+  auto content = std::string();
+  if (!base::ReadFdToString(fd, &content)) {
+    return ErrnoError() << "Failed to read capture file";
+  }
+
+  auto new_header = CaptureHeader{kCaptureMagic, kCaptureVersion, NowNs(), {}};
+  auto boot_id = GetBootId();
+  strlcpy(new_header.boot_id, boot_id.c_str(), sizeof(new_header.boot_id));
+
+  size_t end = 0;
+  auto header = ParseCapture(content, nullptr, end);
+  if (header.ok() && !boot_id.empty()
+      && memcmp(header->boot_id, new_header.boot_id, sizeof(new_header.boot_id)) == 0) {
+    if (end != content.size() && ftruncate(fd, end) == -1) {
+      return ErrnoError() << "Failed to truncate capture file";
+    }
+    return header->base_ns;
+  }
+
+  if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+    return ErrnoError() << "Failed to truncate capture file";
+  }
+  if (!base::WriteFully(fd, &new_header, sizeof(new_header))) {
+    return ErrnoError() << "Failed to write capture file header";
+  }
+  return new_header.base_ns;
+}
+
+} // namespace
+
+/// Start appending every request frame to a capture file
+Result<void> StartRequestCapture(const std::string& file) {
+  auto fd = base::unique_fd(open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+  if (fd == -1) {
+    return ErrnoError() << "Failed to open " << file;
+  }
+
+  auto base_ns = PrepareCaptureFile(fd.get());
+  if (!base_ns.ok()) {
+    return Error() << base_ns.error();
+  }
+  if (lseek(fd.get(), 0, SEEK_END) == -1) {
+    return ErrnoError() << "Failed to seek to the end of " << file;
+  }
+
+  auto lock = std::lock_guard(capture_mutex);
+  capture_fd = std::move(fd);
+  capture_base_ns = *base_ns;
+  return {};
+}
+
+/// Check if request frames are being captured
+bool IsCapturingRequests() {
+  auto lock = std::lock_guard(capture_mutex);
+  return capture_fd != -1;
+}
+
+/// Append a request frame to the capture file
+void CaptureRequest(uint64_t received_ns, const char* frame, size_t size) {
+  auto lock = std::lock_guard(capture_mutex);
+  if (capture_fd == -1) {
+    return;
+  }
+
+  // a record goes out in a single write, so a crash leaves at most one partial record
+  auto record = std::string();
+  record.reserve(size + 16);
+  AppendVarint(received_ns > capture_base_ns ? received_ns - capture_base_ns : 0,
+               record);
+  AppendVarint(size, record);
+  record.append(frame, size);
+  if (!base::WriteFully(capture_fd.get(), record.data(), record.size())) {
+    PLOG(ERROR) << "Failed to write request capture, capturing stopped";
+    capture_fd.reset();
+  }
+}
+
+/// Read all request frames of a capture file
+Result<std::vector<CapturedRequest>> ReadRequestCapture(const std::string& file) {
+  auto content = std::string();
+  if (!base::ReadFileToString(file, &content)) {
+    return ErrnoError() << "Failed to read " << file;
+  }
+
+  auto records = std::vector<CapturedRequest>();
+  size_t end = 0;
+  auto header = ParseCapture(content, &records, end);
+  if (!header.ok()) {
+    return Error() << header.error() << ": " << file;
+  }
+  if (end != content.size()) {
+    LOG(WARNING) << "Ignoring incomplete record at the end of " << file;
+  }
+  return records;
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// A raw request frame read back from a capture file
+    struct CapturedRequest {
+      /// Time the frame was received, in ns since the capture file was created
+      uint64_t offset_ns;
+      /// Serialized StorageRequestMessages as received on the socket
+      std::string frame;
+    };
+
+    /// Start appending every request frame to a capture file. A capture file left by
+    /// an earlier run of the same boot is appended to, one from an earlier boot is
+    /// replaced, since its timestamps are from a different monotonic clock.
+    base::Result<void> StartRequestCapture(const std::string& file);
+
+    /// Check if request frames are being captured
+    bool IsCapturingRequests();
+
+    /// Append a request frame received at received_ns, monotonic, to the capture file.
+    /// Capturing stops on the first write error, serving requests does not.
+    void CaptureRequest(uint64_t received_ns, const char* frame, size_t size);
+
+    /// Read all request frames of a capture file, in the order they were received
+    base::Result<std::vector<CapturedRequest>> ReadRequestCapture(
+        const std::string& file);
+
+  } // namespace aconfigd
+} // namespace android
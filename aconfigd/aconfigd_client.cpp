@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "aconfigd.h"
+#include "aconfigd_client.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+/// Get aconfigd socket path
+std::string GetAconfigdSocketPath() {
+  auto* socket_path = getenv("ACONFIGD_SOCKET");
+  if (socket_path && *socket_path) {
+    return socket_path;
+  }
+  return std::string("/dev/socket/") + kAconfigdSocket;
+}
+
+/// Connect to aconfigd socket
+Result<base::unique_fd> ConnectAconfigdSocket(int num_retries) {
+  auto sock_fd = base::unique_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (sock_fd == -1) {
+    return ErrnoError() << "failed create socket";
+  }
+
+  auto addr = sockaddr_un();
+  addr.sun_family = AF_UNIX;
+  auto path = GetAconfigdSocketPath();
+  strlcpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path));
+
+  for (int retry = 0; ; retry++) {
+    if (connect(sock_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+      return sock_fd;
+    }
+    if (retry >= num_retries) {
+      break;
+    }
+    sleep(1);
+  }
+
+  return ErrnoError() << "failed to connect to aconfigd socket";
+}
+
+/// Send serialized request messages on a new connection to aconfigd
+Result<std::string> SendAconfigdRequest(const std::string& request, int num_retries) {
+  auto sock_fd = ConnectAconfigdSocket(num_retries);
+  if (!sock_fd.ok()) {
+    return Error() << sock_fd.error();
+  }
+
+  auto result = TEMP_FAILURE_RETRY(send(*sock_fd, request.c_str(), request.size(), 0));
+  if (result != static_cast<long>(request.size())) {
+    return ErrnoError() << "send() failed";
+  }
+
+  // aconfigd closes the connection once the whole reply is sent
+  auto reply = std::string();
+  char buffer[kBufferSize];
+  while (true) {
+    auto num_bytes = TEMP_FAILURE_RETRY(recv(*sock_fd, buffer, sizeof(buffer), 0));
+    if (num_bytes < 0) {
+      return ErrnoError() << "recv() failed";
+    } else if (num_bytes == 0) {
+      break;
+    }
+    reply.append(buffer, num_bytes);
+  }
+
+  return reply;
+}
+
+/// Send request messages on a new connection to aconfigd
+Result<StorageReturnMessages> SendAconfigdMessages(const StorageRequestMessages& messages,
+                                                   int num_retries) {
+  auto request = std::string();
+  if (!messages.SerializeToString(&request)) {
+    return Error() << "failed to serialize pb to string";
+  }
+
+  auto reply = SendAconfigdRequest(request, num_retries);
+  if (!reply.ok()) {
+    return Error() << reply.error();
+  }
+
+  auto return_messages = StorageReturnMessages{};
+  if (!return_messages.ParseFromString(*reply)) {
+    return Error() << "failed to parse string into proto";
+  }
+
+  return return_messages;
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <android-base/result.h>
+#include <android-base/unique_fd.h>
+#include <aconfigd.pb.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Get aconfigd socket path, ACONFIGD_SOCKET overrides the on device socket so that
+    /// clients can reach an aconfigd running off device
+    std::string GetAconfigdSocketPath();
+
+    /// Connect to aconfigd socket, retrying once a second while aconfigd starts up
+    base::Result<base::unique_fd> ConnectAconfigdSocket(int num_retries = 5);
+
+    /// Send serialized request messages on a new connection to aconfigd, and return
+    /// the serialized reply
+    base::Result<std::string> SendAconfigdRequest(const std::string& request,
+                                                  int num_retries = 5);
+
+    /// Send request messages on a new connection to aconfigd, and return the reply
+    base::Result<StorageReturnMessages> SendAconfigdMessages(
+        const StorageRequestMessages& messages, int num_retries = 5);
+
+  } // namespace aconfigd
+} // namespace android
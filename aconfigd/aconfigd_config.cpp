@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "aconfigd_config.h"
+
+using namespace android::base;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+AconfigdConfig& MutableConfig() {
+  static AconfigdConfig config;
+  return config;
+}
+
+} // namespace
+
+/// Get the current config
+const AconfigdConfig& GetConfig() {
+  return MutableConfig();
+}
+
+/// Replace the current config
+void SetConfig(AconfigdConfig config) {
+  MutableConfig() = std::move(config);
+}
+
+/// Parse config command line options on top of the current config
+Result<std::vector<std::string>> ParseConfigArgs(int argc, char** argv) {
+  auto config = GetConfig();
+  auto remaining = std::vector<std::string>();
+  bool has_container = false;
+
+  for (int i = 1; i < argc; ++i) {
+    auto arg = std::string(argv[i]);
+    auto value = arg.substr(arg.find('=') + 1);
+    if (StartsWith(arg, "--storage_root=")) {
+      if (value.empty()) {
+        return Error() << "empty storage root";
+      }
+      config.storage_root = value;
+    } else if (StartsWith(arg, "--socket=")) {
+      config.socket_path = value;
+    } else if (StartsWith(arg, "--capture=")) {
+      if (value.empty()) {
+        return Error() << "empty capture file";
+      }
+      config.capture_file = value;
+    } else if (StartsWith(arg, "--container=")) {
+      auto pos = value.find(':');
+      if (pos == 0 || pos == std::string::npos || pos == value.size() - 1) {
+        return Error() << "invalid container option " << arg;
+      }
+      if (!has_container) {
+        config.platform_containers.clear();
+        has_container = true;
+      }
+      config.platform_containers.emplace_back(value.substr(0, pos),
+                                              value.substr(pos + 1));
+    } else {
+      remaining.push_back(arg);
+    }
+  }
+
+  SetConfig(std::move(config));
+  return remaining;
+}
+
+/// Dir of persistent flag value and flag info copies
+std::string GetFlagsDir() {
+  return GetConfig().storage_root + "/flags";
+}
+
+/// Dir of boot flag value and flag info snapshots
+std::string GetBootDir() {
+  return GetConfig().storage_root + "/boot";
+}
+
+/// Persistent storage records pb file full path
+std::string GetPersistentStorageRecordsFile() {
+  return GetConfig().storage_root + "/persistent_storage_file_records.pb";
+}
+
+/// Persistent storage record extensions pb file full path
+std::string GetPersistentStorageRecordExtensionsFile() {
+  return GetConfig().storage_root + "/persistent_storage_record_extensions.pb";
+}
+
+/// Available storage records pb file full path
+std::string GetAvailableStorageRecordsFile() {
+  return GetBootDir() + "/available_storage_file_records.pb";
+}
+
+/// Staged flag overrides file full path
+std::string GetStagedFlagOverridesFile() {
+  return GetConfig().storage_root + "/staged_flag_overrides.pb";
+}
+
+/// Boot index file full path
+std::string GetBootIndexFile() {
+  return GetBootDir() + "/boot_index.bin";
+}
+
+/// Cached flag info file full path
+std::string GetFlagInfoCacheFile(const std::string& container,
+                                 uint64_t package_map_digest,
+                                 uint64_t flag_map_digest) {
+  return StringPrintf("%s/%s.info.%016" PRIx64 "%016" PRIx64, GetFlagsDir().c_str(),
+                      container.c_str(), package_map_digest, flag_map_digest);
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Storage root, socket and container layout aconfigd runs with. The defaults are
+    /// the on device layout, tests and benchmarks relocate everything under a temp dir.
+    struct AconfigdConfig {
+      /// Root dir of persistent storage records, flag value copies and boot snapshots
+      std::string storage_root = "/metadata/aconfig";
+
+      /// Unix socket path to listen on, empty to use the socket created by init
+      std::string socket_path;
+
+      /// File to append every raw request frame to for later replay, empty to not
+      /// capture requests
+      std::string capture_file;
+
+      /// Platform containers and the dirs holding their storage files
+      std::vector<std::pair<std::string, std::string>> platform_containers = {
+        {"system", "/system/etc/aconfig"},
+        {"system_ext", "/system_ext/etc/aconfig"},
+        {"vendor", "/vendor/etc/aconfig"},
+        {"product", "/product/etc/aconfig"}};
+    };
+
+    /// Get the current config
+    const AconfigdConfig& GetConfig();
+
+    /// Replace the current config, must be called before any storage is touched
+    void SetConfig(AconfigdConfig config);
+
+    /// Parse --storage_root=<dir>, --socket=<path>, --capture=<file> and
+    /// --container=<name>:<dir> command line options on top of the current config.
+    /// --container may be given several times and replaces the default platform
+    /// containers. Remaining arguments are returned in order.
+    base::Result<std::vector<std::string>> ParseConfigArgs(int argc, char** argv);
+
+    /// Dir of persistent flag value and flag info copies
+    std::string GetFlagsDir();
+
+    /// Dir of boot flag value and flag info snapshots
+    std::string GetBootDir();
+
+    /// Persistent storage records pb file full path
+    std::string GetPersistentStorageRecordsFile();
+
+    /// Persistent storage record extensions pb file full path
+    std::string GetPersistentStorageRecordExtensionsFile();
+
+    /// Available storage records pb file full path
+    std::string GetAvailableStorageRecordsFile();
+
+    /// Staged flag overrides file full path
+    std::string GetStagedFlagOverridesFile();
+
+    /// Boot index file full path
+    std::string GetBootIndexFile();
+
+    /// Cached flag info file full path, a container's flag info file as created from
+    /// package and flag maps with the given content digests
+    std::string GetFlagInfoCacheFile(const std::string& container,
+                                     uint64_t package_map_digest,
+                                     uint64_t flag_map_digest);
+
+  } // namespace aconfigd
+} // namespace android
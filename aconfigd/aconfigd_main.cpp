@@ -17,14 +17,35 @@
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
 #include <cutils/sockets.h>
+#include <google/protobuf/arena.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <vector>
 
 #include "com_android_aconfig_new_storage.h"
 #include "aconfigd.h"
+#include "aconfigd_capture.h"
+#include "aconfigd_config.h"
+#include "aconfigd_scheduler.h"
+#include "aconfigd_stats.h"
+#include "aconfigd_subscription.h"
 #include "aconfigd_util.h"
+#include "aconfigd_warm_up.h"
 
 using namespace android::aconfigd;
 
+/// Size of the arena block request and return messages are allocated from. Message
+/// objects that fit are placed in it, larger ones spill over into blocks that are
+/// released at the start of the next round of requests. Flag queries served from the
+/// boot index then make no heap allocation, other requests still allocate for
+/// writer mappings, storage records and error results. aconfigd_scaling_bench reports
+/// the allocations made per request.
+static constexpr size_t kArenaBlockSize = 64 * 1024;
+
 static int aconfigd_init() {
   auto init_result = InitializeInMemoryStorageRecords();
   if (!init_result.ok()) {
@@ -35,14 +56,23 @@ static int aconfigd_init() {
 
   // TODO: remove this check once b/330134027 is fixed. This is temporary as android
   // on chrome os vm does not have /metadata partition at the moment.
-  DIR* dir = opendir("/metadata/aconfig");
+  DIR* dir = opendir(GetConfig().storage_root.c_str());
   if (!dir) {
     return {};
   }
   closedir(dir);
 
+  // the flags and boot dirs are created by init on device, but not under a relocated
+  // storage root
+  for (const auto& storage_dir : {GetFlagsDir(), GetBootDir()}) {
+    if (mkdir(storage_dir.c_str(), 0755) == -1 && errno != EEXIST) {
+      PLOG(ERROR) << "failed to create " << storage_dir;
+      return 1;
+    }
+  }
+
   // clear boot dir to start fresh at each boot
-  auto remove_result = RemoveFilesInDir("/metadata/aconfig/boot");
+  auto remove_result = RemoveFilesInDir(GetBootDir());
   if (!remove_result.ok()) {
     LOG(ERROR) <<"failed to clear boot dir: " << remove_result.error();
     return 1;
@@ -57,77 +87,215 @@ static int aconfigd_init() {
   return 0;
 }
 
-static int aconfigd_start() {
-  auto init_result = InitializeInMemoryStorageRecords();
-  if (!init_result.ok()) {
-    LOG(ERROR) << "Failed to initialize persistent storage records in memory: "
-               << init_result.error();
-    return 1;
+/// Get the listening aconfigd socket, either the one created by init, or a socket
+/// bound to the configured socket path
+static android::base::unique_fd get_aconfigd_socket() {
+  const auto& socket_path = GetConfig().socket_path;
+  if (socket_path.empty()) {
+    return android::base::unique_fd(android_get_control_socket(kAconfigdSocket));
   }
 
-  auto aconfigd_fd = android::base::unique_fd(android_get_control_socket(kAconfigdSocket));
-  if (aconfigd_fd == -1) {
-    PLOG(ERROR) << "failed to get aconfigd socket";
-    return 1;
+  auto sock_fd = android::base::unique_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (sock_fd == -1) {
+    return sock_fd;
   }
 
-  if (listen(aconfigd_fd, 8) < 0) {
-    PLOG(ERROR) << "failed to listen to socket";
-    return 1;
-  };
-
   auto addr = sockaddr_un();
   addr.sun_family = AF_UNIX;
-  auto path = std::string("/dev/socket/") + kAconfigdSocket;
-  strlcpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path));
-  socklen_t addr_len = sizeof(addr);
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    LOG(ERROR) << "socket path is too long: " << socket_path;
+    return android::base::unique_fd();
+  }
+  strlcpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path));
 
-  while(true) {
-    LOG(INFO) << "start accepting client requests";
+  unlink(socket_path.c_str());
+  if (bind(sock_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+    PLOG(ERROR) << "failed to bind " << socket_path;
+    return android::base::unique_fd();
+  }
+  return sock_fd;
+}
+
+/// Accept a round of clients that are ready on the aconfigd socket, parse their
+/// requests into the arena and queue them. Returns false if aconfigd should stop.
+static bool accept_requests(const android::base::unique_fd& aconfigd_fd,
+                            google::protobuf::Arena& arena,
+                            RequestScheduler& scheduler) {
+  auto addr = sockaddr_un();
+  for (size_t i = 0; i < kMaxPendingRequests; i++) {
+    // the first client is known to be ready, only take more that do not block
+    auto pfd = pollfd{aconfigd_fd.get(), POLLIN, 0};
+    if (i > 0 && TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) <= 0) {
+      break;
+    }
+
+    socklen_t addr_len = sizeof(addr);
     auto client_fd = android::base::unique_fd(accept4(
         aconfigd_fd, reinterpret_cast<sockaddr*>(&addr), &addr_len, SOCK_CLOEXEC));
     if (client_fd == -1) {
       PLOG(ERROR) << "failed to establish connection";
-      break;
+      return false;
     }
-    LOG(INFO) << "received a client requests";
+    Trace(TraceEvent::kAccept);
+    auto received_ns = NowNs();
 
-    char buffer[kBufferSize] = {};
+    char buffer[kBufferSize];
     auto num_bytes = TEMP_FAILURE_RETRY(recv(client_fd, buffer, sizeof(buffer), 0));
     if (num_bytes < 0) {
       PLOG(ERROR) << "failed to read from aconfigd socket";
-      break;
+      return false;
     } else if (num_bytes == 0) {
       LOG(ERROR) << "failed to read from aconfigd socket, empty message";
-      break;
+      return false;
     }
-    auto msg = std::string(buffer, num_bytes);
+    CaptureRequest(received_ns, buffer, num_bytes);
 
-    auto messages = StorageRequestMessages{};
-    if (!messages.ParseFromString(msg)) {
+    auto& messages =
+        *google::protobuf::Arena::CreateMessage<StorageRequestMessages>(&arena);
+    bool parsed = false;
+    {
+      ScopedStageTimer timer(Stage::kParse);
+      parsed = messages.ParseFromArray(buffer, num_bytes);
+    }
+    if (!parsed) {
+      Trace(TraceEvent::kParseError, num_bytes);
       LOG(ERROR) << "Could not parse message from aconfig storage init socket";
       continue;
     }
 
-    auto return_messages = StorageReturnMessages();
-    for (auto& msg : messages.msgs()) {
-      auto* return_msg = return_messages.add_msgs();
-      HandleSocketRequest(msg, *return_msg);
-      if (!return_msg->has_error_message()) {
-        LOG(ERROR) << "failed to handle socket request: " << return_msg->error_message();
-      }
+    scheduler.Add(std::move(client_fd), messages, received_ns);
+  }
+  return true;
+}
+
+/// Handle a scheduled request and reply to the client
+static void serve_request(PendingRequest request,
+                          google::protobuf::Arena& arena,
+                          std::string& send_buffer) {
+  auto const& messages = *request.messages;
+  auto& return_messages =
+      *google::protobuf::Arena::CreateMessage<StorageReturnMessages>(&arena);
+  if (request.deadline_ns != 0 && NowNs() > request.deadline_ns) {
+    RejectLateRequest(messages, return_messages);
+  } else {
+    ScopedStageTimer timer(Stage::kHandle);
+    HandleSocketRequests(messages, return_messages);
+  }
+  for (auto& return_msg : return_messages.msgs()) {
+    if (return_msg.has_error_message()) {
+      LOG(ERROR) << "failed to handle socket request: " << return_msg.error_message();
+    }
+  }
+
+  // subscribed connections stay open and get size prefixed messages
+  auto subscriptions = std::vector<StorageRequestMessage::SubscribeMessage>();
+  for (int i = 0; i < messages.msgs_size(); i++) {
+    if (messages.msgs(i).has_subscribe_message()
+        && return_messages.msgs(i).has_subscribe_message()) {
+      subscriptions.push_back(messages.msgs(i).subscribe_message());
+    }
+  }
+
+  if (!subscriptions.empty()) {
+    auto send_result = SendFramedMessage(request.client_fd.get(), return_messages);
+    if (!send_result.ok()) {
+      LOG(ERROR) << "failed to send return message: " << send_result.error();
+      return;
     }
 
-    auto return_content = std::string();
-    if (!return_messages.SerializeToString(&return_content)) {
-      LOG(ERROR) << "failed to serialize return messages to string";
+    auto subscribe_result = AddSubscriber(std::move(request.client_fd), subscriptions);
+    if (!subscribe_result.ok()) {
+      LOG(ERROR) << "failed to add subscriber: " << subscribe_result.error();
+    }
+    return;
+  }
+
+  // serialize into the reused send buffer, it only grows for the largest reply
+  ScopedStageTimer timer(Stage::kSend);
+  send_buffer.resize(return_messages.ByteSizeLong());
+  return_messages.SerializeWithCachedSizesToArray(
+      reinterpret_cast<uint8_t*>(send_buffer.data()));
+
+  auto num = TEMP_FAILURE_RETRY(
+      send(request.client_fd, send_buffer.data(), send_buffer.size(), 0));
+  if (num != static_cast<long>(send_buffer.size())) {
+    Trace(TraceEvent::kSendError, send_buffer.size());
+    PLOG(ERROR) << "failed to send return message";
+  }
+}
+
+static int aconfigd_start() {
+  auto init_result = InitializeStorageForServing();
+  if (!init_result.ok()) {
+    LOG(ERROR) << "Failed to initialize storage for serving: " << init_result.error();
+    return 1;
+  }
+
+  // storage files are read ahead while the socket is set up and first requests come
+  // in, rather than faulted in by those requests
+  StartStorageWarmUp();
+
+  auto aconfigd_fd = get_aconfigd_socket();
+  if (aconfigd_fd == -1) {
+    PLOG(ERROR) << "failed to get aconfigd socket";
+    return 1;
+  }
+
+  if (listen(aconfigd_fd, 8) < 0) {
+    PLOG(ERROR) << "failed to listen to socket";
+    return 1;
+  };
+
+  // capturing is a debugging aid, serve without it rather than not at all
+  const auto& capture_file = GetConfig().capture_file;
+  if (!capture_file.empty()) {
+    auto capture_result = StartRequestCapture(capture_file);
+    if (!capture_result.ok()) {
+      LOG(ERROR) << "failed to start request capture: " << capture_result.error();
+    }
+  }
+
+  // request handling state reused across requests
+  alignas(std::max_align_t) static char arena_block[kArenaBlockSize];
+  auto arena_options = google::protobuf::ArenaOptions();
+  arena_options.initial_block = arena_block;
+  arena_options.initial_block_size = sizeof(arena_block);
+  auto arena = google::protobuf::Arena(arena_options);
+  auto send_buffer = std::string();
+  auto poll_fds = std::vector<pollfd>();
+  auto scheduler = RequestScheduler();
+
+  while(true) {
+    // wait for a client, a subscriber hang up, or pending flag changes to be due
+    poll_fds.clear();
+    poll_fds.push_back({aconfigd_fd.get(), POLLIN, 0});
+    AppendSubscriberPollFds(&poll_fds);
+    if (TEMP_FAILURE_RETRY(poll(poll_fds.data(), poll_fds.size(),
+                                GetFlagChangePushTimeoutMs())) < 0) {
+      PLOG(ERROR) << "failed to poll aconfigd socket";
+      break;
+    }
+
+    for (size_t i = 1; i < poll_fds.size(); i++) {
+      HandleSubscriberPollEvent(poll_fds[i]);
+    }
+
+    if (GetFlagChangePushTimeoutMs() == 0) {
+      PushFlagChanges();
+    }
+
+    if (!(poll_fds[0].revents & POLLIN)) {
       continue;
     }
 
-    auto num = TEMP_FAILURE_RETRY(
-        send(client_fd, return_content.c_str(), return_content.size(), 0));
-    if (num != static_cast<long>(return_content.size())) {
-      PLOG(ERROR) << "failed to send return message";
+    // messages of the previous round are released in bulk
+    arena.Reset();
+    if (!accept_requests(aconfigd_fd, arena, scheduler)) {
+      break;
+    }
+
+    while (!scheduler.Empty()) {
+      serve_request(scheduler.Next(), arena, send_buffer);
     }
   }
 
@@ -136,18 +304,30 @@ static int aconfigd_start() {
 }
 
 int main(int argc, char** argv) {
+#ifdef __ANDROID__
   if (!com::android::aconfig_new_storage::enable_aconfig_storage_daemon()) {
     return 0;
   }
+#endif
 
+#ifdef __ANDROID__
   android::base::InitLogging(argv, &android::base::KernelLogger);
+#else
+  android::base::InitLogging(argv, &android::base::StderrLogger);
+#endif
+
+  auto args = ParseConfigArgs(argc, argv);
+  if (!args.ok()) {
+    LOG(ERROR) << "invalid aconfigd command: " << args.error();
+    return 1;
+  }
 
-  if (argc > 2 || (argc == 2 && strcmp("--initialize", argv[1]) != 0)) {
+  if (args->size() > 1 || (args->size() == 1 && (*args)[0] != "--initialize")) {
     LOG(ERROR) << "invalid aconfigd command";
     return 1;
   }
 
-  if (argc == 2 && strcmp("--initialize", argv[1]) == 0) {
+  if (args->size() == 1) {
     return aconfigd_init();
   }
 
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "aconfigd_mapping_cache.h"
+#include "aconfigd_storage_file.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Number of storage file types mapped for a container
+constexpr int kNumFileTypes = 3;
+
+/// Registered storage files of a container and their cached mappings, indexed by
+/// storage file type
+struct ContainerMappings {
+  std::string files[kNumFileTypes];
+  ReadOnlyMapping mappings[kNumFileTypes];
+};
+
+/// Read only mappings keyed by container, guarded by mappings_mutex
+static std::unordered_map<std::string, ContainerMappings> container_mappings;
+static std::shared_mutex mappings_mutex;
+
+/// Get the slot of a storage file type
+Result<int> GetFileTypeIndex(aconfig_storage::StorageFileType file_type) {
+  switch (file_type) {
+    case aconfig_storage::StorageFileType::package_map:
+      return 0;
+    case aconfig_storage::StorageFileType::flag_map:
+      return 1;
+    case aconfig_storage::StorageFileType::flag_val:
+      return 2;
+    default:
+      return Error() << "Unsupported storage file type";
+  }
+}
+
+/// Map a file read only, the mapping is released with its last reference
+Result<ReadOnlyMapping> MapReadOnly(const std::string& file) {
+  auto mapped_file = MapStorageFileAt(file);
+  if (!mapped_file.ok()) {
+    return Error() << mapped_file.error();
+  }
+  return ReadOnlyMapping(
+      new aconfig_storage::MappedStorageFile(*mapped_file),
+      [](const aconfig_storage::MappedStorageFile* file) {
+        auto unmapped = *file;
+        UnmapStorageFile(unmapped);
+        delete file;
+      });
+}
+
+} // namespace
+
+/// Register the storage files of a container for read only mapping
+void SetReadOnlyStorageFiles(const std::string& container,
+                             const std::string& package_map,
+                             const std::string& flag_map,
+                             const std::string& flag_val) {
+  auto lock = std::unique_lock(mappings_mutex);
+  auto& entry = container_mappings[container];
+  entry = ContainerMappings();
+  entry.files[0] = package_map;
+  entry.files[1] = flag_map;
+  entry.files[2] = flag_val;
+}
+
+/// Get the containers with registered storage files
+std::vector<std::string> GetReadOnlyStorageContainers() {
+  auto lock = std::shared_lock(mappings_mutex);
+  auto containers = std::vector<std::string>();
+  containers.reserve(container_mappings.size());
+  for (auto const& [container, entry] : container_mappings) {
+    containers.push_back(container);
+  }
+  return containers;
+}
+
+/// Get a read only mapping of a registered container storage file
+Result<ReadOnlyMapping> GetReadOnlyMapping(const std::string& container,
+                                           aconfig_storage::StorageFileType file_type) {
+  auto index = GetFileTypeIndex(file_type);
+  if (!index.ok()) {
+    return Error() << index.error();
+  }
+
+  {
+    auto lock = std::shared_lock(mappings_mutex);
+    auto it = container_mappings.find(container);
+    if (it == container_mappings.end()) {
+      return Error() << "Missing storage files of container " << container;
+    }
+    if (it->second.mappings[*index]) {
+      return it->second.mappings[*index];
+    }
+  }
+
+  auto lock = std::unique_lock(mappings_mutex);
+  auto it = container_mappings.find(container);
+  if (it == container_mappings.end()) {
+    return Error() << "Missing storage files of container " << container;
+  }
+
+  // another thread may have mapped the file in the meantime
+  auto& mapping = it->second.mappings[*index];
+  if (!mapping) {
+    auto mapped_file = MapReadOnly(it->second.files[*index]);
+    if (!mapped_file.ok()) {
+      return Error() << mapped_file.error();
+    }
+    mapping = *mapped_file;
+  }
+  return mapping;
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+#include <aconfig_storage/aconfig_storage_read_api.hpp>
+
+namespace android {
+  namespace aconfigd {
+
+    /// A read only storage file mapping, unmapped once the last user releases it
+    using ReadOnlyMapping = std::shared_ptr<const aconfig_storage::MappedStorageFile>;
+
+    /// Register the storage files of a container for read only mapping. flag_val is the
+    /// persistent flag value copy, in place updates through the writer mapping are
+    /// visible through the read only mapping. Mappings of previously registered files
+    /// are dropped, users holding them keep them valid until they release them.
+    void SetReadOnlyStorageFiles(const std::string& container,
+                                 const std::string& package_map,
+                                 const std::string& flag_map,
+                                 const std::string& flag_val);
+
+    /// Get the containers with registered storage files
+    std::vector<std::string> GetReadOnlyStorageContainers();
+
+    /// Get a read only mapping of a registered container storage file. Mappings are
+    /// cached and shared, this is safe to call from multiple threads.
+    base::Result<ReadOnlyMapping> GetReadOnlyMapping(
+        const std::string& container,
+        aconfig_storage::StorageFileType file_type);
+
+  } // namespace aconfigd
+} // namespace android
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Replays request frames captured by aconfigd --capture=<file> against a running
+/// aconfigd, and reports the latency of every request and percentiles over all.
+///
+/// Usage:
+///   aconfigd_replay --trace=<file> [--pace=original|fast] [--quiet]
+///
+/// With original pacing each frame is sent at the same offset from the first one as
+/// when it was captured, or right away if replay has fallen behind. With fast pacing
+/// frames are sent back to back. Frames are sent one at a time on a new connection
+/// each, as clients do. Frames with subscribe messages are skipped, since aconfigd
+/// keeps their connections open.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+
+#include <aconfigd.pb.h>
+#include "aconfigd_capture.h"
+#include "aconfigd_client.h"
+#include "aconfigd_stats.h"
+
+using namespace android::aconfigd;
+using namespace android::base;
+
+namespace {
+
+struct ReplayOptions {
+  std::string trace;
+  bool original_pace = true;
+  bool quiet = false;
+};
+
+void SleepUntilNs(uint64_t deadline_ns) {
+  auto ts = timespec();
+  ts.tv_sec = deadline_ns / 1000000000ULL;
+  ts.tv_nsec = deadline_ns % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+  }
+}
+
+bool ParseOptions(int argc, char** argv, ReplayOptions& options) {
+  for (int i = 1; i < argc; ++i) {
+    auto arg = std::string(argv[i]);
+    if (arg == "--quiet") {
+      options.quiet = true;
+    } else if (StartsWith(arg, "--trace=")) {
+      options.trace = arg.substr(strlen("--trace="));
+    } else if (arg == "--pace=original") {
+      options.original_pace = true;
+    } else if (arg == "--pace=fast") {
+      options.original_pace = false;
+    } else {
+      return false;
+    }
+  }
+  return !options.trace.empty();
+}
+
+bool HasSubscribeMessage(const StorageRequestMessages& messages) {
+  for (const auto& message : messages.msgs()) {
+    if (message.has_subscribe_message()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+double Percentile(const std::vector<uint64_t>& sorted, double p) {
+  auto index = static_cast<size_t>(p * (sorted.size() - 1));
+  return sorted[index] / 1000.0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  InitLogging(argv, &StderrLogger);
+
+  auto options = ReplayOptions();
+  if (!ParseOptions(argc, argv, options)) {
+    LOG(ERROR) << "usage: aconfigd_replay --trace=<file> [--pace=original|fast] "
+               << "[--quiet]";
+    return 1;
+  }
+
+  auto requests = ReadRequestCapture(options.trace);
+  if (!requests.ok()) {
+    LOG(ERROR) << "failed to read trace: " << requests.error();
+    return 1;
+  }
+  if (requests->empty()) {
+    LOG(ERROR) << "trace " << options.trace << " has no requests";
+    return 1;
+  }
+
+  if (!options.quiet) {
+    printf("%8s %12s %12s %8s %6s %12s %8s\n", "request", "offset(ms)", "sent(ms)",
+           "bytes", "msgs", "latency(us)", "errors");
+  }
+
+  auto latencies = std::vector<uint64_t>();
+  uint64_t errors = 0;
+  uint64_t skipped = 0;
+  auto first_offset_ns = requests->front().offset_ns;
+  auto start_ns = NowNs();
+  for (size_t i = 0; i < requests->size(); ++i) {
+    const auto& request = (*requests)[i];
+    auto messages = StorageRequestMessages();
+    bool parsed = messages.ParseFromString(request.frame);
+    if (parsed && HasSubscribeMessage(messages)) {
+      skipped++;
+      continue;
+    }
+
+    auto offset_ns = request.offset_ns - first_offset_ns;
+    if (options.original_pace) {
+      SleepUntilNs(start_ns + offset_ns);
+    }
+
+    // frames aconfigd could not parse are sent as captured, aconfigd closes their
+    // connections without a reply
+    auto sent_ns = NowNs();
+    auto reply = SendAconfigdRequest(request.frame, 0);
+    auto latency = NowNs() - sent_ns;
+    latencies.push_back(latency);
+
+    uint64_t request_errors = 0;
+    auto return_messages = StorageReturnMessages();
+    if (!reply.ok()) {
+      LOG(ERROR) << "request " << i << " failed: " << reply.error();
+      request_errors = 1;
+    } else if (parsed && !return_messages.ParseFromString(*reply)) {
+      request_errors = 1;
+    } else {
+      // every message of a request gets a reply message
+      if (parsed && return_messages.msgs_size() != messages.msgs_size()) {
+        request_errors = 1;
+      }
+      for (const auto& return_msg : return_messages.msgs()) {
+        request_errors += return_msg.has_error_message();
+      }
+    }
+    errors += request_errors;
+
+    if (!options.quiet) {
+      printf("%8zu %12.3f %12.3f %8zu %6d %12.1f %8" PRIu64 "\n", i, offset_ns / 1e6,
+             (sent_ns - start_ns) / 1e6, request.frame.size(),
+             parsed ? messages.msgs_size() : 0, latency / 1000.0, request_errors);
+    }
+  }
+  double elapsed_s = (NowNs() - start_ns) / 1e9;
+
+  if (latencies.empty()) {
+    LOG(ERROR) << "trace " << options.trace << " has only subscribe requests";
+    return 1;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  printf("trace %s, %zu requests, %" PRIu64 " skipped, %s pace, %.2fs, %" PRIu64
+         " errors\n",
+         options.trace.c_str(), latencies.size(), skipped,
+         options.original_pace ? "original" : "fast", elapsed_s, errors);
+  printf("%10s %10s %10s %10s %10s\n", "p50(us)", "p90(us)", "p99(us)", "p999(us)",
+         "max(us)");
+  printf("%10.1f %10.1f %10.1f %10.1f %10.1f\n", Percentile(latencies, 0.5),
+         Percentile(latencies, 0.9), Percentile(latencies, 0.99),
+         Percentile(latencies, 0.999), latencies.back() / 1000.0);
+
+  return errors == 0 ? 0 : 1;
+}
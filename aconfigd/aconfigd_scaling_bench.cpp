@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// In process scaling benchmark of aconfigd storage handling. For every combination
+/// of container count and container size, generates synthetic containers, then times
+/// platform storage initialization, loading the boot index for serving, flag lookups
+/// and flag overrides, calling straight into the request handlers so socket costs do
+/// not hide how they scale. Requests are handled on an arena the way aconfigd does,
+/// and the heap allocations each request still makes are counted.
+///
+/// Usage:
+///   aconfigd_scaling_bench [--containers=1,4] [--packages=10,100,1000,10000]
+///       [--flags_per_package=10] [--lookups=N] [--overrides=N] [--work_dir=<dir>]
+///
+/// Each combination runs in a child process against its own storage root under
+/// work_dir, so in memory state of one run does not leak into the next.
+
+#include <ftw.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <google/protobuf/arena.h>
+
+#include "aconfigd.h"
+#include "aconfigd_config.h"
+#include "aconfigd_stats.h"
+#include "aconfigd_storage_gen.h"
+
+using namespace android::aconfigd;
+using namespace android::base;
+
+/// heap allocations made by the process, operator new is replaced to count them
+static std::atomic<uint64_t> num_allocations{0};
+
+void* operator new(size_t size) {
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto* ptr = malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+namespace {
+
+struct ScalingOptions {
+  std::vector<uint32_t> containers = {1, 4};
+  std::vector<uint32_t> packages = {10, 100, 1000, 10000};
+  std::vector<uint32_t> flags_per_package = {10};
+  uint32_t lookups = 10000;
+  uint32_t overrides = 1000;
+#if defined(__ANDROID__)
+  std::string work_dir = "/data/local/tmp";
+#else
+  std::string work_dir = "/tmp";
+#endif
+};
+
+/// A flag of a synthetic container and the value it was generated with
+struct ScalingFlag {
+  std::string package_name;
+  std::string flag_name;
+  bool flag_value;
+};
+
+/// parse a comma separated list such as 10,100,1000
+bool ParseList(const std::string& spec, std::vector<uint32_t>& values) {
+  values.clear();
+  for (const auto& entry : Split(spec, ",")) {
+    uint32_t value = 0;
+    if (!ParseUint(entry, &value) || value == 0) {
+      return false;
+    }
+    values.push_back(value);
+  }
+  return !values.empty();
+}
+
+bool ParseOptions(int argc, char** argv, ScalingOptions& options) {
+  for (int i = 1; i < argc; ++i) {
+    auto arg = std::string(argv[i]);
+    auto pos = arg.find('=');
+    if (!StartsWith(arg, "--") || pos == std::string::npos) {
+      return false;
+    }
+    auto name = arg.substr(2, pos - 2);
+    auto value = arg.substr(pos + 1);
+    bool ok = true;
+    if (name == "containers") {
+      ok = ParseList(value, options.containers);
+    } else if (name == "packages") {
+      ok = ParseList(value, options.packages);
+    } else if (name == "flags_per_package") {
+      ok = ParseList(value, options.flags_per_package);
+    } else if (name == "lookups") {
+      ok = ParseUint(value, &options.lookups) && options.lookups > 0;
+    } else if (name == "overrides") {
+      ok = ParseUint(value, &options.overrides);
+    } else if (name == "work_dir") {
+      options.work_dir = value;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int RemovePath(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+/// time each message through the request handler, latencies are in ns. Return
+/// messages are created on an arena that is reset between requests, as aconfigd does,
+/// so allocations only counts what request handling itself takes from the heap.
+std::vector<uint64_t> TimeRequests(const std::vector<StorageRequestMessage>& messages,
+                                   uint64_t& allocations, uint64_t& errors) {
+  auto latencies = std::vector<uint64_t>();
+  latencies.reserve(messages.size());
+
+  alignas(std::max_align_t) static char arena_block[64 * 1024];
+  auto arena_options = google::protobuf::ArenaOptions();
+  arena_options.initial_block = arena_block;
+  arena_options.initial_block_size = sizeof(arena_block);
+  auto arena = google::protobuf::Arena(arena_options);
+
+  for (const auto& message : messages) {
+    arena.Reset();
+    auto start_allocations = num_allocations.load(std::memory_order_relaxed);
+    auto start_ns = NowNs();
+    auto& return_message =
+        *google::protobuf::Arena::CreateMessage<StorageReturnMessage>(&arena);
+    HandleSocketRequest(message, return_message);
+    latencies.push_back(NowNs() - start_ns);
+    allocations += num_allocations.load(std::memory_order_relaxed) - start_allocations;
+    if (return_message.has_error_message()) {
+      errors++;
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+double Percentile(const std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  auto index = static_cast<size_t>(p * (sorted.size() - 1));
+  return sorted[index] / 1000.0;
+}
+
+/// run one combination against a fresh storage root, meant to run in its own process
+int RunScalingPoint(const ScalingOptions& options, uint32_t num_containers,
+                    uint32_t num_packages, uint32_t flags_per_package,
+                    const std::string& root) {
+  auto config = AconfigdConfig();
+  config.storage_root = root + "/storage";
+  config.platform_containers.clear();
+
+  auto flags = std::vector<ScalingFlag>();
+  for (uint32_t i = 0; i < num_containers; ++i) {
+    auto gen_options = StorageGenOptions();
+    gen_options.container = "synthetic" + std::to_string(i);
+    gen_options.num_packages = num_packages;
+    gen_options.flags_per_package = flags_per_package;
+
+    auto dir = root + "/" + gen_options.container;
+    if (mkdir(dir.c_str(), 0755) == -1) {
+      PLOG(ERROR) << "failed to create " << dir;
+      return 1;
+    }
+    auto gen_result = GenerateStorageFiles(gen_options, dir);
+    if (!gen_result.ok()) {
+      LOG(ERROR) << "failed to generate " << gen_options.container << ": "
+                 << gen_result.error();
+      return 1;
+    }
+    config.platform_containers.push_back({gen_options.container, dir});
+  }
+
+  for (const auto& dir : {config.storage_root, config.storage_root + "/flags",
+                          config.storage_root + "/boot"}) {
+    if (mkdir(dir.c_str(), 0755) == -1) {
+      PLOG(ERROR) << "failed to create " << dir;
+      return 1;
+    }
+  }
+  SetConfig(config);
+
+  auto start_ns = NowNs();
+  auto init_result = InitializeInMemoryStorageRecords();
+  if (init_result.ok()) {
+    init_result = InitializePlatformStorage();
+  }
+  auto init_ns = NowNs() - start_ns;
+  if (!init_result.ok()) {
+    LOG(ERROR) << "failed to initialize platform storage: " << init_result.error();
+    return 1;
+  }
+
+  start_ns = NowNs();
+  auto serve_result = InitializeStorageForServing();
+  auto serve_ns = NowNs() - start_ns;
+  if (!serve_result.ok()) {
+    LOG(ERROR) << "failed to initialize storage for serving: " << serve_result.error();
+    return 1;
+  }
+
+  // sample flags uniformly across all containers, the same sample for every run
+  auto rng = std::mt19937(0);
+  auto container_dist = std::uniform_int_distribution<uint32_t>(0, num_containers - 1);
+  auto package_dist = std::uniform_int_distribution<uint32_t>(0, num_packages - 1);
+  auto flag_dist = std::uniform_int_distribution<uint32_t>(0, flags_per_package - 1);
+  auto sample = [&]() {
+    auto container = "synthetic" + std::to_string(container_dist(rng));
+    auto package = package_dist(rng);
+    auto flag = flag_dist(rng);
+    // every other flag of a synthetic container is enabled
+    bool value = (uint64_t(package) * flags_per_package + flag) % 2;
+    return ScalingFlag{SyntheticPackageName(container, package),
+                       SyntheticFlagName(flag), value};
+  };
+
+  auto lookups = std::vector<StorageRequestMessage>(options.lookups);
+  for (auto& message : lookups) {
+    auto flag = sample();
+    auto* query = message.mutable_flag_query_message();
+    query->set_package_name(flag.package_name);
+    query->set_flag_name(flag.flag_name);
+  }
+
+  // overrides write back the generated value, so lookups see the same values
+  auto overrides = std::vector<StorageRequestMessage>(options.overrides);
+  for (auto& message : overrides) {
+    auto flag = sample();
+    auto* override_msg = message.mutable_flag_override_message();
+    override_msg->set_package_name(flag.package_name);
+    override_msg->set_flag_name(flag.flag_name);
+    override_msg->set_flag_value(flag.flag_value ? "true" : "false");
+  }
+
+  uint64_t errors = 0;
+  uint64_t lookup_allocations = 0;
+  uint64_t override_allocations = 0;
+  auto lookup_latencies = TimeRequests(lookups, lookup_allocations, errors);
+  auto override_latencies = TimeRequests(overrides, override_allocations, errors);
+
+  printf("%10u %10u %10" PRIu64 " %10.1f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f "
+         "%10.2f %8" PRIu64 "\n",
+         num_containers, num_packages,
+         uint64_t(num_containers) * num_packages * flags_per_package, init_ns / 1e6,
+         serve_ns / 1e6, Percentile(lookup_latencies, 0.5),
+         Percentile(lookup_latencies, 0.99),
+         double(lookup_allocations) / lookups.size(),
+         Percentile(override_latencies, 0.5), Percentile(override_latencies, 0.99),
+         overrides.empty() ? 0.0 : double(override_allocations) / overrides.size(),
+         errors);
+  fflush(stdout);
+  return errors == 0 ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  InitLogging(argv, &StderrLogger);
+
+  auto options = ScalingOptions();
+  if (!ParseOptions(argc, argv, options)) {
+    LOG(ERROR) << "usage: aconfigd_scaling_bench [--containers=1,4] "
+               << "[--packages=10,100,1000,10000] [--flags_per_package=10] "
+               << "[--lookups=N] [--overrides=N] [--work_dir=<dir>]";
+    return 1;
+  }
+
+  printf("%10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %8s\n",
+         "containers", "packages", "flags", "init(ms)", "serve(ms)", "get p50",
+         "get p99", "get alloc", "set p50", "set p99", "set alloc", "errors");
+  printf("%54s %10s %10s %10s %10s %10s %10s\n", "", "(us)", "(us)", "(/req)", "(us)",
+         "(us)", "(/req)");
+  fflush(stdout);
+
+  int status = 0;
+  for (auto flags_per_package : options.flags_per_package) {
+    for (auto num_containers : options.containers) {
+      for (auto num_packages : options.packages) {
+        auto root = options.work_dir + "/aconfigd_scaling_XXXXXX";
+        if (mkdtemp(root.data()) == nullptr) {
+          PLOG(ERROR) << "failed to create a dir under " << options.work_dir;
+          return 1;
+        }
+
+        auto pid = fork();
+        if (pid == -1) {
+          PLOG(ERROR) << "fork failed";
+          return 1;
+        }
+        if (pid == 0) {
+          _exit(RunScalingPoint(options, num_containers, num_packages,
+                                flags_per_package, root));
+        }
+
+        int child_status = 0;
+        if (waitpid(pid, &child_status, 0) == -1 || !WIFEXITED(child_status)
+            || WEXITSTATUS(child_status) != 0) {
+          status = 1;
+        }
+        nftw(root.c_str(), RemovePath, 16, FTW_DEPTH | FTW_PHYS);
+      }
+    }
+  }
+  return status;
+}
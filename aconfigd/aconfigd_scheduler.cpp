@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "aconfigd_scheduler.h"
+#include "aconfigd_stats.h"
+
+namespace android {
+namespace aconfigd {
+
+/// Get the priority class of a request
+RequestClass ClassifyRequest(const StorageRequestMessages& messages) {
+  bool bulk = false;
+  int cost = 0;
+  for (auto const& message : messages.msgs()) {
+    switch (message.msg_case()) {
+      case StorageRequestMessage::kNewStorageMessage:
+        return RequestClass::kBoot;
+      case StorageRequestMessage::kFlagQueryMessage:
+      case StorageRequestMessage::kSubscribeMessage:
+      case StorageRequestMessage::kStatsMessage:
+        cost += 1;
+        break;
+      case StorageRequestMessage::kPackageDumpMessage:
+        cost += kPackageReadCost;
+        break;
+      case StorageRequestMessage::kBulkFlagQueryMessage:
+        // a query without a package reads the whole container
+        if (message.bulk_flag_query_message().package_name().empty()) {
+          bulk = true;
+        } else {
+          cost += kPackageReadCost;
+        }
+        break;
+      default:
+        bulk = true;
+        break;
+    }
+  }
+  return bulk || cost > kMaxQueryBatchSize ? RequestClass::kBulk : RequestClass::kQuery;
+}
+
+/// Queue a request
+void RequestScheduler::Add(base::unique_fd client_fd,
+                           const StorageRequestMessages& messages,
+                           uint64_t received_ns) {
+  auto request = PendingRequest();
+  request.client_fd = std::move(client_fd);
+  request.messages = &messages;
+  request.request_class = ClassifyRequest(messages);
+  if (messages.deadline_ms() > 0) {
+    request.deadline_ns = received_ns + messages.deadline_ms() * 1000000ULL;
+  }
+  request.sequence = next_sequence_++;
+  queue_.push(std::move(request));
+}
+
+/// Take the next request to handle
+PendingRequest RequestScheduler::Next() {
+  // the top is only moved out right before it is popped, the order does not look at
+  // the client fd
+  auto request = std::move(const_cast<PendingRequest&>(queue_.top()));
+  queue_.pop();
+  return request;
+}
+
+/// priority_queue puts the greatest element on top, so a request is "less" than
+/// another if it should be handled after it
+bool RequestScheduler::Order::operator()(const PendingRequest& a,
+                                         const PendingRequest& b) const {
+  if (a.request_class != b.request_class) {
+    return a.request_class > b.request_class;
+  }
+  if (a.deadline_ns != b.deadline_ns) {
+    // requests without a deadline go after those with one
+    if (a.deadline_ns == 0 || b.deadline_ns == 0) {
+      return a.deadline_ns == 0;
+    }
+    return a.deadline_ns > b.deadline_ns;
+  }
+  return a.sequence > b.sequence;
+}
+
+/// Fill return messages of a request that missed its deadline
+void RejectLateRequest(const StorageRequestMessages& messages,
+                       StorageReturnMessages& return_messages) {
+  for (auto const& message : messages.msgs()) {
+    *return_messages.add_msgs()->mutable_error_message() = "Request deadline exceeded";
+    RecordMessage(message.msg_case(), 0, true);
+  }
+  Trace(TraceEvent::kDeadlineExceeded, messages.msgs_size());
+}
+
+} // namespace aconfigd
+} // namespace android
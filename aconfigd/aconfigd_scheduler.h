@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <queue>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <aconfigd.pb.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Priority classes of requests, served in this order
+    enum class RequestClass {
+      /// Batches registering new storage, boot waits on them
+      kBoot,
+      /// Short read only batches
+      kQuery,
+      /// Batches changing flag values, whole container reads and other large reads
+      kBulk,
+    };
+
+    /// Largest cost of reads still served as a query, a single flag read costs 1
+    static constexpr int kMaxQueryBatchSize = 16;
+
+    /// Cost of reading all flags of a package
+    static constexpr int kPackageReadCost = 4;
+
+    /// Most requests accepted into a single scheduling round
+    static constexpr size_t kMaxPendingRequests = 32;
+
+    /// A received request waiting to be handled
+    struct PendingRequest {
+      base::unique_fd client_fd;
+      const StorageRequestMessages* messages = nullptr;
+      RequestClass request_class = RequestClass::kBulk;
+      /// Monotonic time the request has to be handled by, 0 for no deadline
+      uint64_t deadline_ns = 0;
+      /// Arrival order, breaks ties within a class
+      uint64_t sequence = 0;
+    };
+
+    /// Get the priority class of a request
+    RequestClass ClassifyRequest(const StorageRequestMessages& messages);
+
+    /// Orders received requests by priority class, then earliest deadline, then
+    /// arrival. Requests are accepted in rounds of at most kMaxPendingRequests and
+    /// each round is drained before the next, so no class starves. Requests are read
+    /// and handled one at a time, so only requests accepted in the same round are
+    /// reordered: a query arriving while a bulk batch is handled, or while a slow
+    /// client is read, still waits for it.
+    class RequestScheduler {
+     public:
+      /// Queue a request received at received_ns
+      void Add(base::unique_fd client_fd,
+               const StorageRequestMessages& messages,
+               uint64_t received_ns);
+
+      bool Empty() const { return queue_.empty(); }
+
+      /// Take the next request to handle
+      PendingRequest Next();
+
+     private:
+      struct Order {
+        bool operator()(const PendingRequest& a, const PendingRequest& b) const;
+      };
+
+      std::priority_queue<PendingRequest, std::vector<PendingRequest>, Order> queue_;
+      uint64_t next_sequence_ = 0;
+    };
+
+    /// Fill return messages of a request that missed its deadline
+    void RejectLateRequest(const StorageRequestMessages& messages,
+                           StorageReturnMessages& return_messages);
+
+  } // namespace aconfigd
+} // namespace android
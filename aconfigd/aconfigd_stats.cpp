@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+#include "aconfigd_stats.h"
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Maximum number of distinct request message types tracked
+constexpr int kMaxMessageTypes = 32;
+
+/// Latency histogram with power of two buckets, safe to update concurrently
+struct LatencyHistogram {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> buckets[kNumLatencyBuckets] = {};
+
+  void Record(uint64_t latency_ns) {
+    uint32_t bucket = latency_ns == 0 ? 0 : 63 - __builtin_clzll(latency_ns);
+    bucket = std::min(bucket, kNumLatencyBuckets - 1);
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(latency_ns, std::memory_order_relaxed);
+  }
+
+  void Fill(const std::string& name,
+            StorageReturnMessage::StatsReturnMessage::Histogram* histogram) const {
+    histogram->set_name(name);
+    histogram->set_count(count.load(std::memory_order_relaxed));
+    histogram->set_total_ns(total_ns.load(std::memory_order_relaxed));
+    for (auto const& bucket : buckets) {
+      histogram->add_buckets(bucket.load(std::memory_order_relaxed));
+    }
+  }
+
+  void Reset() {
+    count.store(0, std::memory_order_relaxed);
+    total_ns.store(0, std::memory_order_relaxed);
+    for (auto& bucket : buckets) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+/// Per message type counters
+struct MessageTypeStats {
+  std::atomic<uint64_t> errors{0};
+  LatencyHistogram latency;
+};
+
+/// A trace ring buffer slot. The sequence is zero while the slot is being written,
+/// and the trace index plus one once the slot is complete.
+struct TraceSlot {
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<uint64_t> timestamp_ns{0};
+  std::atomic<uint64_t> arg{0};
+  std::atomic<uint32_t> event{0};
+};
+
+static LatencyHistogram stage_latencies[static_cast<int>(Stage::kNumStages)];
+static MessageTypeStats message_type_stats[kMaxMessageTypes];
+static TraceSlot trace_buffer[kTraceBufferSize];
+static std::atomic<uint64_t> trace_head{0};
+static std::atomic<uint64_t> warm_up_ns{0};
+
+const char* StageName(Stage stage) {
+  switch (stage) {
+    case Stage::kParse:
+      return "parse";
+    case Stage::kHandle:
+      return "handle";
+    case Stage::kContainerLookup:
+      return "container_lookup";
+    case Stage::kOffsetLookup:
+      return "offset_lookup";
+    case Stage::kMapping:
+      return "mapping";
+    case Stage::kSend:
+      return "send";
+    case Stage::kNumStages:
+      break;
+  }
+  return "unknown";
+}
+
+std::string MessageTypeName(int type) {
+  switch (type) {
+    case StorageRequestMessage::kNewStorageMessage:
+      return "new_storage";
+    case StorageRequestMessage::kFlagOverrideMessage:
+      return "flag_override";
+    case StorageRequestMessage::kFlagQueryMessage:
+      return "flag_query";
+    case StorageRequestMessage::kPackageDumpMessage:
+      return "package_dump";
+    case StorageRequestMessage::kContainerDumpMessage:
+      return "container_dump";
+    case StorageRequestMessage::kSubscribeMessage:
+      return "subscribe";
+    case StorageRequestMessage::kStatsMessage:
+      return "stats";
+    case StorageRequestMessage::kResetOverridesMessage:
+      return "reset_overrides";
+    case StorageRequestMessage::kStagedFlagOverrideMessage:
+      return "staged_flag_override";
+    case StorageRequestMessage::kPendingChangesMessage:
+      return "pending_changes";
+    case StorageRequestMessage::kBulkFlagQueryMessage:
+      return "bulk_flag_query";
+    default:
+      return "message_type_" + std::to_string(type);
+  }
+}
+
+const char* TraceEventName(uint32_t event) {
+  switch (static_cast<TraceEvent>(event)) {
+    case TraceEvent::kAccept:
+      return "accept";
+    case TraceEvent::kRequest:
+      return "request";
+    case TraceEvent::kRequestError:
+      return "request_error";
+    case TraceEvent::kParseError:
+      return "parse_error";
+    case TraceEvent::kSendError:
+      return "send_error";
+    case TraceEvent::kSubscriberAdded:
+      return "subscriber_added";
+    case TraceEvent::kFlagChangesPushed:
+      return "flag_changes_pushed";
+    case TraceEvent::kDeadlineExceeded:
+      return "deadline_exceeded";
+    case TraceEvent::kWarmUpDone:
+      return "warm_up_done";
+  }
+  return "unknown";
+}
+
+} // namespace
+
+/// Append an event to the trace ring buffer, overwriting the oldest event
+void Trace(TraceEvent event, uint64_t arg) {
+  auto index = trace_head.fetch_add(1, std::memory_order_relaxed);
+  auto& slot = trace_buffer[index % kTraceBufferSize];
+  slot.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.timestamp_ns.store(NowNs(), std::memory_order_relaxed);
+  slot.arg.store(arg, std::memory_order_relaxed);
+  slot.event.store(static_cast<uint32_t>(event), std::memory_order_relaxed);
+  slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+/// Record the latency of a request handling stage
+void RecordStageLatency(Stage stage, uint64_t latency_ns) {
+  stage_latencies[static_cast<int>(stage)].Record(latency_ns);
+}
+
+/// Record a handled message and its latency
+void RecordMessage(StorageRequestMessage::MsgCase type,
+                   uint64_t latency_ns,
+                   bool error) {
+  auto index = static_cast<int>(type);
+  if (index < 0 || index >= kMaxMessageTypes) {
+    return;
+  }
+  auto& stats = message_type_stats[index];
+  stats.latency.Record(latency_ns);
+  if (error) {
+    stats.errors.fetch_add(1, std::memory_order_relaxed);
+  }
+  Trace(error ? TraceEvent::kRequestError : TraceEvent::kRequest, index);
+}
+
+/// Record how long the storage file warm up at start took
+void RecordWarmUp(uint64_t duration_ns) {
+  // a warm up that took under a ns still has to read as done
+  warm_up_ns.store(duration_ns > 0 ? duration_ns : 1, std::memory_order_relaxed);
+  Trace(TraceEvent::kWarmUpDone, duration_ns);
+}
+
+/// Fill a stats return message with the current counters, histograms and trace
+void GetStats(const StorageRequestMessage::StatsMessage& msg,
+              StorageReturnMessage::StatsReturnMessage& stats) {
+  for (int type = 0; type < kMaxMessageTypes; type++) {
+    auto& type_stats = message_type_stats[type];
+    auto requests = type_stats.latency.count.load(std::memory_order_relaxed);
+    if (requests == 0) {
+      continue;
+    }
+    auto name = MessageTypeName(type);
+    auto* type_stats_pb = stats.add_message_types();
+    type_stats_pb->set_message_type(name);
+    type_stats_pb->set_requests(requests);
+    type_stats_pb->set_errors(type_stats.errors.load(std::memory_order_relaxed));
+    type_stats.latency.Fill(name, type_stats_pb->mutable_latency());
+  }
+
+  for (int stage = 0; stage < static_cast<int>(Stage::kNumStages); stage++) {
+    stage_latencies[stage].Fill(StageName(static_cast<Stage>(stage)), stats.add_stages());
+  }
+
+  auto warm_up = warm_up_ns.load(std::memory_order_relaxed);
+  if (warm_up != 0) {
+    stats.set_warm_up_ns(warm_up);
+  }
+
+  if (msg.include_trace()) {
+    auto head = trace_head.load(std::memory_order_acquire);
+    auto begin = head > kTraceBufferSize ? head - kTraceBufferSize : 0;
+    for (auto index = begin; index < head; index++) {
+      auto& slot = trace_buffer[index % kTraceBufferSize];
+      auto sequence = slot.sequence.load(std::memory_order_acquire);
+      auto timestamp_ns = slot.timestamp_ns.load(std::memory_order_relaxed);
+      auto arg = slot.arg.load(std::memory_order_relaxed);
+      auto event = slot.event.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // skip slots being written or already overwritten by a newer event
+      if (sequence != index + 1
+          || slot.sequence.load(std::memory_order_relaxed) != sequence) {
+        continue;
+      }
+      auto* event_pb = stats.add_trace_events();
+      event_pb->set_timestamp_ns(timestamp_ns);
+      event_pb->set_event(TraceEventName(event));
+      event_pb->set_arg(arg);
+    }
+  }
+
+  if (msg.reset()) {
+    for (auto& type_stats : message_type_stats) {
+      type_stats.errors.store(0, std::memory_order_relaxed);
+      type_stats.latency.Reset();
+    }
+    for (auto& stage_latency : stage_latencies) {
+      stage_latency.Reset();
+    }
+  }
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <cstdint>
+
+#include <aconfigd.pb.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Request handling stages timed by aconfigd
+    enum class Stage {
+      kParse,
+      kHandle,
+      kContainerLookup,
+      kOffsetLookup,
+      kMapping,
+      kSend,
+      kNumStages,
+    };
+
+    /// Events recorded in the in memory trace ring buffer
+    enum class TraceEvent : uint32_t {
+      kAccept,
+      kRequest,
+      kRequestError,
+      kParseError,
+      kSendError,
+      kSubscriberAdded,
+      kFlagChangesPushed,
+      kDeadlineExceeded,
+      kWarmUpDone,
+    };
+
+    /// Number of entries in the trace ring buffer
+    static constexpr uint32_t kTraceBufferSize = 1024;
+
+    /// Number of power of two latency histogram buckets
+    static constexpr uint32_t kNumLatencyBuckets = 32;
+
+    /// Get the current monotonic time in nanoseconds
+    inline uint64_t NowNs() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+    }
+
+    /// Append an event to the trace ring buffer, overwriting the oldest event
+    void Trace(TraceEvent event, uint64_t arg = 0);
+
+    /// Record the latency of a request handling stage
+    void RecordStageLatency(Stage stage, uint64_t latency_ns);
+
+    /// Record a handled message and its latency
+    void RecordMessage(StorageRequestMessage::MsgCase type,
+                       uint64_t latency_ns,
+                       bool error);
+
+    /// Record how long the storage file warm up at start took
+    void RecordWarmUp(uint64_t duration_ns);
+
+    /// Fill a stats return message with the current counters, histograms and
+    /// optionally the trace
+    void GetStats(const StorageRequestMessage::StatsMessage& msg,
+                  StorageReturnMessage::StatsReturnMessage& stats);
+
+    /// Times a request handling stage for the lifetime of the object
+    class ScopedStageTimer {
+     public:
+      explicit ScopedStageTimer(Stage stage) : stage_(stage), start_ns_(NowNs()) {}
+      ~ScopedStageTimer() { RecordStageLatency(stage_, NowNs() - start_ns_); }
+
+      ScopedStageTimer(const ScopedStageTimer&) = delete;
+      ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+
+     private:
+      Stage stage_;
+      uint64_t start_ns_;
+    };
+
+  } // namespace aconfigd
+} // namespace android
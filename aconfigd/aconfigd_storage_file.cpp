@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <optional>
+
+#include <android-base/unique_fd.h>
+
+#include "aconfigd_storage_file.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Bounds checked little endian reader over a mapped storage file
+class StorageFileReader {
+ public:
+  StorageFileReader(const aconfig_storage::MappedStorageFile& file, size_t offset)
+      : data_(static_cast<const uint8_t*>(file.file_ptr))
+      , size_(file.file_size)
+      , offset_(offset)
+  {}
+
+  size_t offset() const { return offset_; }
+
+  Result<uint32_t> ReadU32() {
+    if (offset_ + sizeof(uint32_t) > size_) {
+      return Error() << "unexpected end of file at offset " << offset_;
+    }
+    uint32_t value;
+    memcpy(&value, data_ + offset_, sizeof(value));
+    offset_ += sizeof(value);
+    return value;
+  }
+
+  Result<uint8_t> ReadU8() {
+    if (offset_ + sizeof(uint8_t) > size_) {
+      return Error() << "unexpected end of file at offset " << offset_;
+    }
+    return data_[offset_++];
+  }
+
+  Result<uint16_t> ReadU16() {
+    if (offset_ + sizeof(uint16_t) > size_) {
+      return Error() << "unexpected end of file at offset " << offset_;
+    }
+    uint16_t value;
+    memcpy(&value, data_ + offset_, sizeof(value));
+    offset_ += sizeof(value);
+    return value;
+  }
+
+  Result<std::string> ReadString() {
+    auto len = ReadU32();
+    if (!len.ok()) {
+      return Error() << len.error();
+    }
+    if (offset_ + *len > size_) {
+      return Error() << "string of length " << *len << " at offset " << offset_
+                     << " runs past end of file";
+    }
+    auto value = std::string(reinterpret_cast<const char*>(data_ + offset_), *len);
+    offset_ += *len;
+    return value;
+  }
+
+  Result<void> SkipString() {
+    auto len = ReadU32();
+    if (!len.ok()) {
+      return Error() << len.error();
+    }
+    if (offset_ + *len > size_) {
+      return Error() << "string of length " << *len << " at offset " << offset_
+                     << " runs past end of file";
+    }
+    offset_ += *len;
+    return {};
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t offset_;
+};
+
+/// Common header of package map and flag map files
+struct TableHeader {
+  uint32_t version;
+  std::string container;
+  uint8_t file_type;
+  uint32_t file_size;
+  uint32_t num_entries;
+  uint32_t bucket_offset;
+  uint32_t node_offset;
+};
+
+Result<TableHeader> ParseTableHeader(StorageFileReader& reader) {
+  auto header = TableHeader();
+  auto version = reader.ReadU32();
+  if (!version.ok()) {
+    return Error() << "Failed to parse header: " << version.error();
+  }
+
+  auto container = reader.ReadString();
+  if (!container.ok()) {
+    return Error() << "Failed to parse header: " << container.error();
+  }
+
+  auto file_type = reader.ReadU8();
+  if (!file_type.ok()) {
+    return Error() << "Failed to parse header: " << file_type.error();
+  }
+
+  uint32_t* fields[] = {&header.file_size, &header.num_entries,
+                        &header.bucket_offset, &header.node_offset};
+  for (auto* field : fields) {
+    auto value = reader.ReadU32();
+    if (!value.ok()) {
+      return Error() << "Failed to parse header: " << value.error();
+    }
+    *field = *value;
+  }
+
+  header.version = *version;
+  header.container = *container;
+  header.file_type = *file_type;
+  return header;
+}
+
+} // namespace
+
+/// Map a storage file by its path for reading
+Result<aconfig_storage::MappedStorageFile> MapStorageFileAt(const std::string& file) {
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(file.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << file;
+  }
+
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1) {
+    return ErrnoError() << "fstat() failed for " << file;
+  }
+
+  auto mapped_file = aconfig_storage::MappedStorageFile();
+  mapped_file.file_size = static_cast<size_t>(st.st_size);
+  mapped_file.file_ptr = mmap(
+      nullptr, mapped_file.file_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+  if (mapped_file.file_ptr == MAP_FAILED) {
+    return ErrnoError() << "mmap() failed for " << file;
+  }
+  return mapped_file;
+}
+
+/// Release a storage file mapped with MapStorageFileAt
+void UnmapStorageFile(aconfig_storage::MappedStorageFile& file) {
+  if (file.file_ptr) {
+    munmap(file.file_ptr, file.file_size);
+    file.file_ptr = nullptr;
+    file.file_size = 0;
+  }
+}
+
+/// List all packages in a mapped package map file
+Result<std::vector<PackageEntry>> ListPackages(
+    const aconfig_storage::MappedStorageFile& package_map) {
+  auto reader = StorageFileReader(package_map, 0);
+  auto header = ParseTableHeader(reader);
+  if (!header.ok()) {
+    return Error() << header.error();
+  }
+
+  auto packages = std::vector<PackageEntry>();
+  packages.reserve(header->num_entries);
+  reader = StorageFileReader(package_map, header->node_offset);
+  while (reader.offset() < header->file_size) {
+    auto entry = PackageEntry();
+    auto package_name = reader.ReadString();
+    if (!package_name.ok()) {
+      return Error() << "Failed to parse package node: " << package_name.error();
+    }
+    entry.package_name = std::move(*package_name);
+
+    uint32_t next_offset = 0;
+    uint32_t* fields[] = {&entry.package_id, &entry.boolean_start_index, &next_offset};
+    for (auto* field : fields) {
+      auto value = reader.ReadU32();
+      if (!value.ok()) {
+        return Error() << "Failed to parse package node: " << value.error();
+      }
+      *field = *value;
+    }
+    packages.push_back(std::move(entry));
+  }
+
+  return packages;
+}
+
+namespace {
+
+/// List the flags in a mapped flag map file, only those of package_id if it is set
+Result<std::vector<FlagEntry>> ParseFlagNodes(
+    const aconfig_storage::MappedStorageFile& flag_map,
+    std::optional<uint32_t> package_id) {
+  auto reader = StorageFileReader(flag_map, 0);
+  auto header = ParseTableHeader(reader);
+  if (!header.ok()) {
+    return Error() << header.error();
+  }
+
+  auto flags = std::vector<FlagEntry>();
+  if (!package_id) {
+    flags.reserve(header->num_entries);
+  }
+  reader = StorageFileReader(flag_map, header->node_offset);
+  while (reader.offset() < header->file_size) {
+    auto entry = FlagEntry();
+    auto node_package_id = reader.ReadU32();
+    if (!node_package_id.ok()) {
+      return Error() << "Failed to parse flag node: " << node_package_id.error();
+    }
+    entry.package_id = *node_package_id;
+
+    // nodes of other packages are stepped over without copying their names
+    bool wanted = !package_id || *package_id == entry.package_id;
+    if (wanted) {
+      auto flag_name = reader.ReadString();
+      if (!flag_name.ok()) {
+        return Error() << "Failed to parse flag node: " << flag_name.error();
+      }
+      entry.flag_name = std::move(*flag_name);
+    } else {
+      auto skip_result = reader.SkipString();
+      if (!skip_result.ok()) {
+        return Error() << "Failed to parse flag node: " << skip_result.error();
+      }
+    }
+
+    uint16_t* fields[] = {&entry.flag_type, &entry.flag_index};
+    for (auto* field : fields) {
+      auto value = reader.ReadU16();
+      if (!value.ok()) {
+        return Error() << "Failed to parse flag node: " << value.error();
+      }
+      *field = *value;
+    }
+
+    auto next_offset = reader.ReadU32();
+    if (!next_offset.ok()) {
+      return Error() << "Failed to parse flag node: " << next_offset.error();
+    }
+    if (wanted) {
+      flags.push_back(std::move(entry));
+    }
+  }
+
+  return flags;
+}
+
+} // namespace
+
+/// List all flags in a mapped flag map file
+Result<std::vector<FlagEntry>> ListFlags(
+    const aconfig_storage::MappedStorageFile& flag_map) {
+  return ParseFlagNodes(flag_map, std::nullopt);
+}
+
+/// List the flags of one package in a mapped flag map file
+Result<std::vector<FlagEntry>> ListPackageFlags(
+    const aconfig_storage::MappedStorageFile& flag_map,
+    uint32_t package_id) {
+  return ParseFlagNodes(flag_map, package_id);
+}
+
+/// Parse the header of a mapped flag value file
+Result<FlagValueHeader> ParseFlagValueHeader(
+    const aconfig_storage::MappedStorageFile& flag_val) {
+  auto reader = StorageFileReader(flag_val, 0);
+  auto header = FlagValueHeader();
+  auto version = reader.ReadU32();
+  if (!version.ok()) {
+    return Error() << "Failed to parse flag value header: " << version.error();
+  }
+
+  auto container = reader.ReadString();
+  if (!container.ok()) {
+    return Error() << "Failed to parse flag value header: " << container.error();
+  }
+
+  auto file_type = reader.ReadU8();
+  if (!file_type.ok()) {
+    return Error() << "Failed to parse flag value header: " << file_type.error();
+  }
+
+  uint32_t* fields[] = {&header.file_size, &header.num_flags,
+                        &header.boolean_value_offset};
+  for (auto* field : fields) {
+    auto value = reader.ReadU32();
+    if (!value.ok()) {
+      return Error() << "Failed to parse flag value header: " << value.error();
+    }
+    *field = *value;
+  }
+
+  header.version = *version;
+  header.container = *container;
+  header.file_type = *file_type;
+  // widened, so a corrupt offset and count cannot wrap around past the check
+  if (header.file_size > flag_val.file_size
+      || static_cast<uint64_t>(header.boolean_value_offset) + header.num_flags
+          > header.file_size) {
+    return Error() << "Flag value file of " << header.container << " is truncated";
+  }
+  return header;
+}
+
+} // namespace aconfigd
+} // namespace android
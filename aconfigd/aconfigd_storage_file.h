@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <android-base/result.h>
+#include <aconfig_storage/aconfig_storage_read_api.hpp>
+
+namespace android {
+  namespace aconfigd {
+
+    /// A package node in a package map file
+    struct PackageEntry {
+      std::string package_name;
+      uint32_t package_id;
+      uint32_t boolean_start_index;
+    };
+
+    /// A flag node in a flag map file
+    struct FlagEntry {
+      uint32_t package_id;
+      std::string flag_name;
+      uint16_t flag_type;
+      uint16_t flag_index;
+    };
+
+    /// Flag value file header
+    struct FlagValueHeader {
+      uint32_t version;
+      std::string container;
+      uint8_t file_type;
+      uint32_t file_size;
+      uint32_t num_flags;
+      uint32_t boolean_value_offset;
+    };
+
+    /// Map a storage file by its path for reading, the mapping is released with
+    /// UnmapStorageFile
+    base::Result<aconfig_storage::MappedStorageFile> MapStorageFileAt(
+        const std::string& file);
+
+    /// Release a storage file mapped with MapStorageFileAt
+    void UnmapStorageFile(aconfig_storage::MappedStorageFile& file);
+
+    /// List all packages in a mapped package map file
+    base::Result<std::vector<PackageEntry>> ListPackages(
+        const aconfig_storage::MappedStorageFile& package_map);
+
+    /// List all flags in a mapped flag map file
+    base::Result<std::vector<FlagEntry>> ListFlags(
+        const aconfig_storage::MappedStorageFile& flag_map);
+
+    /// List the flags of one package in a mapped flag map file
+    base::Result<std::vector<FlagEntry>> ListPackageFlags(
+        const aconfig_storage::MappedStorageFile& flag_map,
+        uint32_t package_id);
+
+    /// Parse the header of a mapped flag value file
+    base::Result<FlagValueHeader> ParseFlagValueHeader(
+        const aconfig_storage::MappedStorageFile& flag_val);
+
+  } // namespace aconfigd
+} // namespace android
@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <android-base/file.h>
+
+#include "aconfigd_storage_gen.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Storage file version written
+constexpr uint32_t kStorageFileVersion = 1;
+
+/// Storage file types, as in the common storage file header
+constexpr uint8_t kPackageMapFileType = 0;
+constexpr uint8_t kFlagMapFileType = 1;
+constexpr uint8_t kFlagValFileType = 2;
+
+/// Hash table sizes aconfig picks from, the smallest one holding twice the entries
+constexpr uint32_t kHashPrimes[] = {
+    7, 17, 29, 53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593, 49157, 98317,
+    196613, 393241, 786433, 1572869, 3145739, 6291469, 12582917, 25165843, 50331653,
+    100663319, 201326611, 402653189, 805306457, 1610612741};
+
+/// Little endian storage file content
+class StorageFileWriter {
+ public:
+  void U8(uint8_t value) { content_.push_back(static_cast<char>(value)); }
+
+  void U16(uint16_t value) { Append(&value, sizeof(value)); }
+
+  void U32(uint32_t value) { Append(&value, sizeof(value)); }
+
+  void String(const std::string& value) {
+    U32(static_cast<uint32_t>(value.size()));
+    content_.append(value);
+  }
+
+  /// Overwrite a u32 written before
+  void PatchU32(size_t offset, uint32_t value) {
+    memcpy(content_.data() + offset, &value, sizeof(value));
+  }
+
+  /// Write the common header, the file size is patched by Finish
+  void Header(const std::string& container, uint8_t file_type) {
+    U32(kStorageFileVersion);
+    String(container);
+    U8(file_type);
+    file_size_offset_ = content_.size();
+    U32(0);
+  }
+
+  uint32_t Offset() const { return static_cast<uint32_t>(content_.size()); }
+
+  Result<void> Finish(const std::string& file) {
+    PatchU32(file_size_offset_, Offset());
+    if (!base::WriteStringToFile(content_, file)) {
+      return ErrnoError() << "WriteStringToFile failed for " << file;
+    }
+    return {};
+  }
+
+ private:
+  void Append(const void* value, size_t size) {
+    content_.append(static_cast<const char*>(value), size);
+  }
+
+  std::string content_;
+  size_t file_size_offset_ = 0;
+};
+
+uint64_t Rotl(uint64_t x, int b) {
+  return (x << b) | (x >> (64 - b));
+}
+
+/// SipHash-1-3 with zero keys over the bytes of a str as Rust hashes it, followed by
+/// a 0xff terminator, which is how aconfig assigns buckets
+uint64_t HashStr(const std::string& str) {
+  auto bytes = str + '\xff';
+  uint64_t v0 = 0x736f6d6570736575ULL;
+  uint64_t v1 = 0x646f72616e646f6dULL;
+  uint64_t v2 = 0x6c7967656e657261ULL;
+  uint64_t v3 = 0x7465646279746573ULL;
+  auto round = [&]() {
+    v0 += v1; v1 = Rotl(v1, 13); v1 ^= v0; v0 = Rotl(v0, 32);
+    v2 += v3; v3 = Rotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = Rotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = Rotl(v1, 17); v1 ^= v2; v2 = Rotl(v2, 32);
+  };
+
+  size_t i = 0;
+  for (; i + 8 <= bytes.size(); i += 8) {
+    uint64_t m;
+    memcpy(&m, bytes.data() + i, sizeof(m));
+    v3 ^= m;
+    round();
+    v0 ^= m;
+  }
+  uint64_t last = static_cast<uint64_t>(bytes.size()) << 56;
+  for (size_t j = 0; i + j < bytes.size(); ++j) {
+    last |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i + j])) << (8 * j);
+  }
+  v3 ^= last;
+  round();
+  v0 ^= last;
+
+  v2 ^= 0xff;
+  round();
+  round();
+  round();
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+Result<uint32_t> GetTableSize(uint32_t num_entries) {
+  for (auto prime : kHashPrimes) {
+    if (prime >= 2ULL * num_entries) {
+      return prime;
+    }
+  }
+  return Error() << "Too many entries for a storage hash table: " << num_entries;
+}
+
+/// A node of a storage hash table, nodes are written in bucket order and nodes sharing
+/// a bucket are chained in the order they were added
+struct HashNode {
+  uint32_t bucket;
+  uint32_t entry;
+};
+
+std::vector<HashNode> SortByBucket(const std::vector<std::string>& keys,
+                                   uint32_t num_buckets) {
+  auto nodes = std::vector<HashNode>();
+  nodes.reserve(keys.size());
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    nodes.push_back({static_cast<uint32_t>(HashStr(keys[i]) % num_buckets), i});
+  }
+  std::stable_sort(nodes.begin(), nodes.end(),
+                   [](const HashNode& a, const HashNode& b) { return a.bucket < b.bucket; });
+  return nodes;
+}
+
+/// Write a hash table file, write_node writes the node of an entry followed by its
+/// next offset
+template <typename WriteNode>
+Result<void> WriteHashTable(const std::string& file,
+                            const std::string& container,
+                            uint8_t file_type,
+                            const std::vector<std::string>& keys,
+                            WriteNode write_node) {
+  auto num_buckets = GetTableSize(static_cast<uint32_t>(keys.size()));
+  if (!num_buckets.ok()) {
+    return Error() << num_buckets.error();
+  }
+
+  auto writer = StorageFileWriter();
+  writer.Header(container, file_type);
+  writer.U32(static_cast<uint32_t>(keys.size()));
+  auto offsets_offset = writer.Offset();
+  writer.U32(0);
+  writer.U32(0);
+
+  auto bucket_offset = writer.Offset();
+  for (uint32_t i = 0; i < *num_buckets; ++i) {
+    writer.U32(0);
+  }
+  auto node_offset = writer.Offset();
+  writer.PatchU32(offsets_offset, bucket_offset);
+  writer.PatchU32(offsets_offset + 4, node_offset);
+
+  auto nodes = SortByBucket(keys, *num_buckets);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    auto offset = writer.Offset();
+    bool chained = i > 0 && nodes[i - 1].bucket == nodes[i].bucket;
+    if (!chained) {
+      writer.PatchU32(bucket_offset + 4 * nodes[i].bucket, offset);
+    }
+    write_node(writer, nodes[i].entry);
+    auto next_offset = writer.Offset();
+    writer.U32(0);
+    if (i + 1 < nodes.size() && nodes[i + 1].bucket == nodes[i].bucket) {
+      writer.PatchU32(next_offset, writer.Offset());
+    }
+  }
+
+  return writer.Finish(file);
+}
+
+} // namespace
+
+/// Name of synthetic package i of a container
+std::string SyntheticPackageName(const std::string& container, uint32_t package) {
+  return "com.android.synthetic." + container + ".package_" + std::to_string(package);
+}
+
+/// Name of synthetic flag i of a package
+std::string SyntheticFlagName(uint32_t flag) {
+  return "flag_" + std::to_string(flag);
+}
+
+/// Write storage files of a container
+Result<void> GenerateStorageFiles(const std::string& container,
+                                  const std::vector<StorageGenPackage>& packages,
+                                  const std::string& dir) {
+  auto package_names = std::vector<std::string>();
+  auto start_indices = std::vector<uint32_t>();
+  package_names.reserve(packages.size());
+  start_indices.reserve(packages.size());
+  uint64_t num_flags = 0;
+  for (const auto& package : packages) {
+    if (package.flags.size() > UINT16_MAX) {
+      return Error() << "Too many flags in " << package.name << ": "
+                     << package.flags.size();
+    }
+    package_names.push_back(package.name);
+    start_indices.push_back(static_cast<uint32_t>(num_flags));
+    num_flags += package.flags.size();
+    if (num_flags > UINT32_MAX / 2) {
+      return Error() << "Too many flags: " << num_flags;
+    }
+  }
+
+  auto result = WriteHashTable(
+      dir + "/package.map", container, kPackageMapFileType, package_names,
+      [&](StorageFileWriter& writer, uint32_t package) {
+        writer.String(package_names[package]);
+        writer.U32(package);
+        writer.U32(start_indices[package]);
+      });
+  if (!result.ok()) {
+    return Error() << "Failed to write package map: " << result.error();
+  }
+
+  // flags are keyed by "<package id>/<flag name>"
+  auto flag_keys = std::vector<std::string>();
+  auto flag_ids = std::vector<std::pair<uint32_t, uint16_t>>();
+  flag_keys.reserve(num_flags);
+  flag_ids.reserve(num_flags);
+  for (uint32_t i = 0; i < packages.size(); ++i) {
+    for (uint32_t j = 0; j < packages[i].flags.size(); ++j) {
+      flag_keys.push_back(std::to_string(i) + "/" + packages[i].flags[j].name);
+      flag_ids.emplace_back(i, static_cast<uint16_t>(j));
+    }
+  }
+
+  result = WriteHashTable(
+      dir + "/flag.map", container, kFlagMapFileType, flag_keys,
+      [&](StorageFileWriter& writer, uint32_t flag) {
+        auto [package, index] = flag_ids[flag];
+        const auto& stored_flag = packages[package].flags[index];
+        writer.U32(package);
+        writer.String(stored_flag.name);
+        writer.U16(static_cast<uint16_t>(stored_flag.type));
+        writer.U16(index);
+      });
+  if (!result.ok()) {
+    return Error() << "Failed to write flag map: " << result.error();
+  }
+
+  auto writer = StorageFileWriter();
+  writer.Header(container, kFlagValFileType);
+  writer.U32(static_cast<uint32_t>(num_flags));
+  writer.U32(writer.Offset() + 4);
+  for (const auto& package : packages) {
+    for (const auto& flag : package.flags) {
+      writer.U8(flag.value);
+    }
+  }
+  result = writer.Finish(dir + "/flag.val");
+  if (!result.ok()) {
+    return Error() << "Failed to write flag value file: " << result.error();
+  }
+  return {};
+}
+
+/// Write storage files of a synthetic container
+Result<void> GenerateStorageFiles(const StorageGenOptions& options,
+                                  const std::string& dir) {
+  if (options.num_packages == 0 || options.flags_per_package == 0) {
+    return Error() << "A synthetic container needs at least one package and flag";
+  }
+  if (options.flags_per_package > UINT16_MAX) {
+    return Error() << "Too many flags per package: " << options.flags_per_package;
+  }
+  auto num_flags = uint64_t(options.num_packages) * options.flags_per_package;
+  if (num_flags > UINT32_MAX / 2) {
+    return Error() << "Too many flags: " << num_flags;
+  }
+
+  auto packages = std::vector<StorageGenPackage>(options.num_packages);
+  for (uint32_t i = 0; i < options.num_packages; ++i) {
+    packages[i].name = SyntheticPackageName(options.container, i);
+    packages[i].flags.resize(options.flags_per_package);
+    for (uint32_t j = 0; j < options.flags_per_package; ++j) {
+      packages[i].flags[j].name = SyntheticFlagName(j);
+      packages[i].flags[j].value = (uint64_t(i) * options.flags_per_package + j) % 2;
+    }
+  }
+  return GenerateStorageFiles(options.container, packages, dir);
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Flag types, as stored in flag map nodes
+    enum class StorageGenFlagType : uint16_t {
+      kReadWriteBoolean = 0,
+      kReadOnlyBoolean = 1,
+      kFixedReadOnlyBoolean = 2,
+    };
+
+    /// A flag of a generated container
+    struct StorageGenFlag {
+      std::string name;
+      StorageGenFlagType type = StorageGenFlagType::kReadWriteBoolean;
+      bool value = false;
+    };
+
+    /// A package of a generated container, flags are in flag index order
+    struct StorageGenPackage {
+      std::string name;
+      std::vector<StorageGenFlag> flags;
+    };
+
+    /// Shape of a synthetic container
+    struct StorageGenOptions {
+      std::string container = "synthetic";
+      uint32_t num_packages = 100;
+      uint32_t flags_per_package = 10;
+    };
+
+    /// Name of synthetic package i of a container, unique across containers
+    std::string SyntheticPackageName(const std::string& container, uint32_t package);
+
+    /// Name of synthetic flag i of a package
+    std::string SyntheticFlagName(uint32_t flag);
+
+    /// Write package.map, flag.map and flag.val of a container into dir, in the same
+    /// v1 layout aconfig produces, bucket hashes and node order included, so the
+    /// files match aconfig's byte for byte. Packages are in package id order.
+    base::Result<void> GenerateStorageFiles(const std::string& container,
+                                            const std::vector<StorageGenPackage>& packages,
+                                            const std::string& dir);
+
+    /// Write the storage files of a synthetic container into dir. All flags are read
+    /// write, every other flag is enabled.
+    base::Result<void> GenerateStorageFiles(const StorageGenOptions& options,
+                                            const std::string& dir);
+
+  } // namespace aconfigd
+} // namespace android
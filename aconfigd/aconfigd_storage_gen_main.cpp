@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Writes the storage files of a synthetic container of any size, for load testing
+/// aconfigd with containers far larger than the checked in test data.
+///
+/// Usage:
+///   aconfigd_storage_gen --out_dir=<dir> [--container=<name>] [--packages=N]
+///       [--flags_per_package=N]
+///
+/// Packages are named com.android.synthetic.<container>.package_<i> and flags
+/// flag_<j>. The files can be fed to aconfigd with a new storage message, or listed
+/// as a platform container with --container=<name>:<dir>.
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include "aconfigd_storage_gen.h"
+
+using namespace android::aconfigd;
+using namespace android::base;
+
+namespace {
+
+bool ParseOptions(int argc, char** argv, StorageGenOptions& options,
+                  std::string& out_dir) {
+  for (int i = 1; i < argc; ++i) {
+    auto arg = std::string(argv[i]);
+    auto pos = arg.find('=');
+    if (!StartsWith(arg, "--") || pos == std::string::npos) {
+      return false;
+    }
+    auto name = arg.substr(2, pos - 2);
+    auto value = arg.substr(pos + 1);
+    bool ok = true;
+    if (name == "out_dir") {
+      out_dir = value;
+    } else if (name == "container") {
+      options.container = value;
+      ok = !value.empty();
+    } else if (name == "packages") {
+      ok = ParseUint(value, &options.num_packages) && options.num_packages > 0;
+    } else if (name == "flags_per_package") {
+      ok = ParseUint(value, &options.flags_per_package, 65535u)
+          && options.flags_per_package > 0;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return !out_dir.empty();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  InitLogging(argv, &StderrLogger);
+
+  auto options = StorageGenOptions();
+  auto out_dir = std::string();
+  if (!ParseOptions(argc, argv, options, out_dir)) {
+    LOG(ERROR) << "usage: aconfigd_storage_gen --out_dir=<dir> [--container=<name>] "
+               << "[--packages=N] [--flags_per_package=N]";
+    return 1;
+  }
+
+  auto result = GenerateStorageFiles(options, out_dir);
+  if (!result.ok()) {
+    LOG(ERROR) << "failed to generate storage files: " << result.error();
+    return 1;
+  }
+
+  LOG(INFO) << "wrote container " << options.container << " with "
+            << options.num_packages << " packages and "
+            << uint64_t(options.num_packages) * options.flags_per_package
+            << " flags to " << out_dir;
+  return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <unordered_set>
+
+#include <android-base/logging.h>
+
+#include "aconfigd_stats.h"
+#include "aconfigd_subscription.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/// A client connection subscribed to flag changes
+struct Subscriber {
+  base::unique_fd fd;
+  std::unordered_set<std::string> packages;
+  std::unordered_set<std::string> flags;
+
+  bool IsSubscribed(const std::string& package, const std::string& flag) const {
+    return packages.count(package) || flags.count(package + "/" + flag);
+  }
+};
+
+/// Subscriber connections
+static std::vector<Subscriber> subscribers;
+
+/// Latest values of flags changed since the last push, keyed by package and flag
+static std::map<std::pair<std::string, std::string>, bool> pending_flag_changes;
+
+/// Containers with new storage files since the last push
+static std::set<std::string> pending_container_changes;
+
+/// Time of the first and the latest change since the last push
+static Clock::time_point first_change_time;
+static Clock::time_point last_change_time;
+
+/// Record the time of a change
+void TouchPendingChanges() {
+  auto now = Clock::now();
+  if (pending_flag_changes.empty() && pending_container_changes.empty()) {
+    first_change_time = now;
+  }
+  last_change_time = now;
+}
+
+} // namespace
+
+/// Send a size prefixed message on a subscriber connection
+Result<void> SendFramedMessage(int fd, const StorageReturnMessages& messages) {
+  auto content = std::string(sizeof(uint32_t), '\0');
+  if (!messages.AppendToString(&content)) {
+    return Error() << "failed to serialize return messages to string";
+  }
+
+  uint32_t size = htonl(static_cast<uint32_t>(content.size() - sizeof(uint32_t)));
+  memcpy(content.data(), &size, sizeof(size));
+
+  // never block the serving loop on a slow subscriber
+  size_t sent = 0;
+  while (sent < content.size()) {
+    auto num = TEMP_FAILURE_RETRY(send(fd, content.data() + sent, content.size() - sent,
+                                       MSG_NOSIGNAL | MSG_DONTWAIT));
+    if (num < 0) {
+      return ErrnoError() << "send() failed";
+    }
+    sent += num;
+  }
+
+  return {};
+}
+
+/// Check if another subscriber connection can be kept open
+bool CanAddSubscriber() {
+  return subscribers.size() < kMaxSubscribers;
+}
+
+/// Keep a client connection open to push changes of the subscribed flags to it
+Result<void> AddSubscriber(
+    base::unique_fd client_fd,
+    const std::vector<StorageRequestMessage::SubscribeMessage>& subscriptions) {
+  if (!CanAddSubscriber()) {
+    return Error() << "Too many subscribers";
+  }
+
+  auto subscriber = Subscriber();
+  subscriber.fd = std::move(client_fd);
+  for (auto const& msg : subscriptions) {
+    for (auto const& package : msg.package_names()) {
+      subscriber.packages.insert(package);
+    }
+    for (auto const& flag : msg.flags()) {
+      subscriber.flags.insert(flag.package_name() + "/" + flag.flag_name());
+    }
+  }
+  subscribers.push_back(std::move(subscriber));
+  Trace(TraceEvent::kSubscriberAdded, subscribers.size());
+
+  return {};
+}
+
+/// Add subscriber connections to a poll set, to notice when they hang up
+void AppendSubscriberPollFds(std::vector<pollfd>* fds) {
+  for (auto const& subscriber : subscribers) {
+    fds->push_back({subscriber.fd.get(), POLLIN, 0});
+  }
+}
+
+/// Handle a poll event on a subscriber connection. Subscribers are not expected to
+/// send anything after subscribing, so any event means the connection is done.
+void HandleSubscriberPollEvent(const pollfd& fd) {
+  if (!fd.revents) {
+    return;
+  }
+  subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                   [&fd](const Subscriber& subscriber) {
+                                     return subscriber.fd.get() == fd.fd;
+                                   }),
+                    subscribers.end());
+}
+
+/// Check if any client is subscribed to changes
+bool HasSubscribers() {
+  return !subscribers.empty();
+}
+
+/// Record a flag value change to be pushed to subscribers
+void RecordFlagChange(const std::string& package,
+                      const std::string& flag,
+                      bool value) {
+  if (subscribers.empty()) {
+    return;
+  }
+  TouchPendingChanges();
+  pending_flag_changes[{package, flag}] = value;
+}
+
+/// Record new storage files of a container to be pushed to subscribers
+void RecordContainerChange(const std::string& container) {
+  if (subscribers.empty()) {
+    return;
+  }
+  TouchPendingChanges();
+  pending_container_changes.insert(container);
+}
+
+/// Get the time to wait before pending changes must be pushed
+int GetFlagChangePushTimeoutMs() {
+  if (pending_flag_changes.empty() && pending_container_changes.empty()) {
+    return -1;
+  }
+
+  auto coalesce_deadline =
+      last_change_time + std::chrono::milliseconds(kFlagChangeCoalesceMs);
+  auto max_delay_deadline =
+      first_change_time + std::chrono::milliseconds(kFlagChangeMaxDelayMs);
+  auto deadline = std::min(coalesce_deadline, max_delay_deadline);
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - Clock::now());
+  return std::max(0, static_cast<int>(remaining.count()));
+}
+
+/// Push pending changes to subscribers
+void PushFlagChanges() {
+  uint64_t num_notified = 0;
+  for (auto it = subscribers.begin(); it != subscribers.end();) {
+    auto messages = StorageReturnMessages();
+    auto* event = messages.add_msgs()->mutable_flag_change_event_message();
+    for (auto const& [key, value] : pending_flag_changes) {
+      if (it->IsSubscribed(key.first, key.second)) {
+        auto* change = event->add_changes();
+        change->set_package_name(key.first);
+        change->set_flag_name(key.second);
+        change->set_flag_value(value);
+      }
+    }
+    for (auto const& container : pending_container_changes) {
+      event->add_containers(container);
+    }
+
+    if (event->changes_size() == 0 && event->containers_size() == 0) {
+      ++it;
+      continue;
+    }
+
+    auto send_result = SendFramedMessage(it->fd.get(), messages);
+    if (!send_result.ok()) {
+      LOG(WARNING) << "dropping flag change subscriber: " << send_result.error();
+      it = subscribers.erase(it);
+    } else {
+      num_notified++;
+      ++it;
+    }
+  }
+  Trace(TraceEvent::kFlagChangesPushed, num_notified);
+
+  pending_flag_changes.clear();
+  pending_container_changes.clear();
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <poll.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+#include <android-base/unique_fd.h>
+#include <aconfigd.pb.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Maximum number of subscriber connections
+    static constexpr size_t kMaxSubscribers = 64;
+
+    /// Time to wait for more flag changes before pushing them to subscribers
+    static constexpr int kFlagChangeCoalesceMs = 20;
+
+    /// Maximum time a flag change is held back to coalesce it with later changes
+    static constexpr int kFlagChangeMaxDelayMs = 200;
+
+    /// Send a size prefixed message on a subscriber connection
+    base::Result<void> SendFramedMessage(int fd, const StorageReturnMessages& messages);
+
+    /// Check if another subscriber connection can be kept open
+    bool CanAddSubscriber();
+
+    /// Keep a client connection open to push changes of the subscribed flags to it
+    base::Result<void> AddSubscriber(
+        base::unique_fd client_fd,
+        const std::vector<StorageRequestMessage::SubscribeMessage>& subscriptions);
+
+    /// Add subscriber connections to a poll set, to notice when they hang up
+    void AppendSubscriberPollFds(std::vector<pollfd>* fds);
+
+    /// Handle a poll event on a subscriber connection
+    void HandleSubscriberPollEvent(const pollfd& fd);
+
+    /// Check if any client is subscribed to changes
+    bool HasSubscribers();
+
+    /// Record a flag value change to be pushed to subscribers
+    void RecordFlagChange(const std::string& package,
+                          const std::string& flag,
+                          bool value);
+
+    /// Record new storage files of a container to be pushed to subscribers
+    void RecordContainerChange(const std::string& container);
+
+    /// Get the time to wait before pending changes must be pushed, -1 if there are
+    /// no pending changes
+    int GetFlagChangePushTimeoutMs();
+
+    /// Push pending changes to subscribers
+    void PushFlagChanges();
+
+  } // namespace aconfigd
+} // namespace android
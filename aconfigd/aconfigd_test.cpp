@@ -14,8 +14,20 @@
  * limitations under the License.
  */
 
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <map>
+#include <random>
 
 #include <gtest/gtest.h>
 #include <cutils/sockets.h>
@@ -28,6 +40,17 @@
 #include <protos/aconfig_storage_metadata.pb.h>
 #include <aconfigd.pb.h>
 #include "aconfigd.h"
+#include "aconfigd_async_io.h"
+#include "aconfigd_boot_index.h"
+#include "aconfigd_capture.h"
+#include "aconfigd_client.h"
+#include "aconfigd_scheduler.h"
+#include "aconfigd_stats.h"
+#include "aconfigd_storage_file.h"
+#include "aconfigd_storage_gen.h"
+#include "aconfigd_util.h"
+#include "aconfigd_value_kernels.h"
+#include "aconfigd/value_snapshot.h"
 
 using storage_records_pb = android::aconfig_storage_metadata::storage_files;
 using storage_record_pb = android::aconfig_storage_metadata::storage_file_info;
@@ -35,59 +58,36 @@ using storage_record_pb = android::aconfig_storage_metadata::storage_file_info;
 namespace android {
 namespace aconfigd {
 
-base::Result<base::unique_fd> connect_aconfigd_socket() {
-  auto sock_fd = base::unique_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
-  if (sock_fd == -1) {
-    return base::ErrnoError() << "failed create socket";
-  }
-
-  auto addr = sockaddr_un();
-  addr.sun_family = AF_UNIX;
-  auto path = std::string("/dev/socket/") + kAconfigdSocket;
-  strlcpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path));
-
-  bool success = false;
-  for (int retry = 0; retry < 5; retry++) {
-    if (connect(sock_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
-      success = true;
-      break;
-    }
-    sleep(1);
-  }
-
-  if (!success) {
-    return base::ErrnoError() << "failed to connect to aconfigd socket";
-  }
+// storage root of the aconfigd under test, ACONFIGD_STORAGE_ROOT points the tests at an
+// aconfigd running off device with a relocated storage root
+std::string get_storage_root() {
+  auto* storage_root = getenv("ACONFIGD_STORAGE_ROOT");
+  return storage_root && *storage_root ? storage_root : kAconfigStorageRoot;
+}
 
-  return sock_fd;
+base::Result<base::unique_fd> connect_aconfigd_socket() {
+  return ConnectAconfigdSocket();
 }
 
 // send a message to aconfigd socket, and capture return message
 base::Result<StorageReturnMessages> send_message(const StorageRequestMessages& messages) {
-  auto sock_fd = connect_aconfigd_socket();
-  if (!sock_fd.ok()) {
-    return Error() << sock_fd.error();
-  }
-
-  auto message_string = std::string();
-  if (!messages.SerializeToString(&message_string)) {
-    return Error() << "failed to serialize pb to string";
-  }
+  return SendAconfigdMessages(messages);
+}
 
-  auto result = TEMP_FAILURE_RETRY(
-      send(*sock_fd, message_string.c_str(), message_string.size(), 0));
-  if (result != static_cast<long>(message_string.size())) {
-    return ErrnoError() << "send() failed";
+// receive a size prefixed message on a subscribed connection
+base::Result<StorageReturnMessages> recv_framed_message(int sock_fd) {
+  uint32_t size = 0;
+  if (!base::ReadFully(sock_fd, &size, sizeof(size))) {
+    return ErrnoError() << "failed to read message size";
   }
 
-  char buffer[kBufferSize] = {};
-  auto num_bytes = TEMP_FAILURE_RETRY(recv(*sock_fd, buffer, sizeof(buffer), 0));
-  if (num_bytes < 0) {
-    return ErrnoError() << "recv() failed";
+  auto content = std::string(ntohl(size), '\0');
+  if (!base::ReadFully(sock_fd, content.data(), content.size())) {
+    return ErrnoError() << "failed to read message";
   }
 
   auto return_messages = StorageReturnMessages{};
-  if (!return_messages.ParseFromString(std::string(buffer, num_bytes))) {
+  if (!return_messages.ParseFromString(content)) {
     return Error() << "failed to parse string into proto";
   }
 
@@ -128,6 +128,198 @@ base::Result<StorageReturnMessages> send_flag_query_message(const std::string& p
   return send_message(messages);
 }
 
+base::Result<StorageReturnMessages> send_package_dump_message(const std::string& package) {
+  auto messages = StorageRequestMessages{};
+  auto* message = messages.add_msgs();
+  auto* msg = message->mutable_package_dump_message();
+  msg->set_package_name(package);
+  return send_message(messages);
+}
+
+base::Result<StorageReturnMessages> send_container_dump_message(
+    const std::string& container) {
+  auto messages = StorageRequestMessages{};
+  auto* message = messages.add_msgs();
+  auto* msg = message->mutable_container_dump_message();
+  msg->set_container(container);
+  return send_message(messages);
+}
+
+base::Result<StorageReturnMessages> send_reset_overrides_message(
+    const std::string& container, const std::string& package) {
+  auto messages = StorageRequestMessages{};
+  auto* message = messages.add_msgs();
+  auto* msg = message->mutable_reset_overrides_message();
+  msg->set_container(container);
+  msg->set_package_name(package);
+  return send_message(messages);
+}
+
+base::Result<StorageReturnMessages> send_staged_flag_override_message(
+    const std::string& package, const std::string& flag, const std::string& value) {
+  auto messages = StorageRequestMessages{};
+  auto* message = messages.add_msgs();
+  auto* msg = message->mutable_staged_flag_override_message();
+  msg->set_package_name(package);
+  msg->set_flag_name(flag);
+  msg->set_flag_value(value);
+  return send_message(messages);
+}
+
+base::Result<StorageReturnMessages> send_pending_changes_message(
+    const std::string& container) {
+  auto messages = StorageRequestMessages{};
+  auto* message = messages.add_msgs();
+  auto* msg = message->mutable_pending_changes_message();
+  msg->set_container(container);
+  return send_message(messages);
+}
+
+base::Result<StorageReturnMessages> send_bulk_flag_query_message(
+    const std::string& container, const std::string& package) {
+  auto messages = StorageRequestMessages{};
+  auto* message = messages.add_msgs();
+  auto* msg = message->mutable_bulk_flag_query_message();
+  msg->set_container(container);
+  msg->set_package_name(package);
+  msg->set_list_enabled(true);
+  return send_message(messages);
+}
+
+// write a synthetic container next to the test binary, where aconfigd already reads
+// the test storage files from, returns its dir. Each layout gets a dir of its own.
+base::Result<std::string> generate_container(const std::string& container,
+                                             uint32_t num_packages,
+                                             uint32_t flags_per_package) {
+  auto dir = base::GetExecutableDirectory() + "/generated";
+  auto layout = container + "." + std::to_string(num_packages) + "x"
+      + std::to_string(flags_per_package);
+  for (auto const& path : {dir, dir + "/" + layout}) {
+    if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+      return ErrnoError() << "mkdir() failed for " << path;
+    }
+  }
+  dir += "/" + layout;
+
+  auto options = StorageGenOptions();
+  options.container = container;
+  options.num_packages = num_packages;
+  options.flags_per_package = flags_per_package;
+  auto gen_result = GenerateStorageFiles(options, dir);
+  if (!gen_result.ok()) {
+    return Error() << gen_result.error();
+  }
+  return dir;
+}
+
+void add_new_storage_message(StorageRequestMessages& messages,
+                             const std::string& container,
+                             const std::string& dir) {
+  auto* msg = messages.add_msgs()->mutable_new_storage_message();
+  msg->set_container(container);
+  msg->set_package_map(dir + "/package.map");
+  msg->set_flag_map(dir + "/flag.map");
+  msg->set_flag_value(dir + "/flag.val");
+}
+
+#ifndef __ANDROID__
+// start the aconfigd installed next to the test binary, returns its pid
+pid_t start_aconfigd(const std::vector<std::string>& args) {
+  auto daemon = base::GetExecutableDirectory() + "/aconfigd";
+  auto pid = fork();
+  if (pid == 0) {
+    auto argv = std::vector<char*>{daemon.data()};
+    for (auto const& arg : args) {
+      argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    execv(daemon.c_str(), argv.data());
+    _exit(127);
+  }
+  return pid;
+}
+
+// wait for an aconfigd started by start_aconfigd to exit, returns its exit status or
+// -1 if it did not exit normally
+int wait_aconfigd(pid_t pid) {
+  int status = 0;
+  if (pid <= 0 || TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid
+      || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+// wait for the aconfigd on ACONFIGD_SOCKET to serve requests. The probe is a real
+// request, aconfigd stops on a connection that closes without sending one.
+bool wait_for_aconfigd() {
+  auto messages = StorageRequestMessages{};
+  messages.add_msgs()->mutable_stats_message();
+  for (int i = 0; i < 500; i++) {
+    if (SendAconfigdMessages(messages, 0).ok()) {
+      return true;
+    }
+    usleep(10000);
+  }
+  return false;
+}
+
+int remove_path(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+// container the aconfigd started by HostAconfigdEnvironment indexes at boot
+constexpr char kBootIndexedContainer[] = "boot_index_test";
+
+// off device no aconfigd is started by init, so unless ACONFIGD_SOCKET points the
+// tests at one, initialize a temporary storage root and serve it for the tests
+class HostAconfigdEnvironment : public ::testing::Environment {
+ public:
+  void SetUp() override {
+    auto* socket_path = getenv("ACONFIGD_SOCKET");
+    if (socket_path && *socket_path) {
+      return;
+    }
+
+    auto* tmp_dir = getenv("TMPDIR");
+    root_ = std::string(tmp_dir && *tmp_dir ? tmp_dir : "/tmp") + "/aconfigd_test_XXXXXX";
+    ASSERT_NE(mkdtemp(root_.data()), nullptr) << strerror(errno);
+    auto indexed_dir = generate_container(kBootIndexedContainer, 2, 4);
+    ASSERT_TRUE(indexed_dir.ok()) << indexed_dir.error();
+    auto storage_root_arg = "--storage_root=" + root_;
+    auto container_arg = "--container=" + std::string(kBootIndexedContainer) + ":"
+        + *indexed_dir;
+    ASSERT_EQ(wait_aconfigd(start_aconfigd(
+        {storage_root_arg, container_arg, "--initialize"})), 0);
+
+    auto socket = root_ + "/aconfigd.sock";
+    pid_ = start_aconfigd({storage_root_arg, container_arg, "--socket=" + socket});
+    setenv("ACONFIGD_SOCKET", socket.c_str(), 1);
+    setenv("ACONFIGD_STORAGE_ROOT", root_.c_str(), 1);
+    ASSERT_TRUE(wait_for_aconfigd());
+  }
+
+  void TearDown() override {
+    if (pid_ > 0) {
+      kill(pid_, SIGTERM);
+      wait_aconfigd(pid_);
+    }
+    if (!root_.empty()) {
+      nftw(root_.c_str(), remove_path, 16, FTW_DEPTH | FTW_PHYS);
+      unsetenv("ACONFIGD_SOCKET");
+      unsetenv("ACONFIGD_STORAGE_ROOT");
+    }
+  }
+
+ private:
+  std::string root_;
+  pid_t pid_ = -1;
+};
+
+static auto* const host_aconfigd_environment =
+    ::testing::AddGlobalTestEnvironment(new HostAconfigdEnvironment());
+#endif
+
 TEST(aconfigd_socket, new_storage_message) {
   auto new_storage_result = send_new_storage_message();
   ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
@@ -135,7 +327,7 @@ TEST(aconfigd_socket, new_storage_message) {
   auto return_message = new_storage_result->msgs(0);
   ASSERT_TRUE(return_message.has_new_storage_message());
 
-  auto pb_file = "/metadata/aconfig/boot/available_storage_file_records.pb";
+  auto pb_file = get_storage_root() + "/boot/available_storage_file_records.pb";
   auto records_pb = storage_records_pb();
   auto content = std::string();
   ASSERT_TRUE(base::ReadFileToString(pb_file, &content)) << strerror(errno);
@@ -151,6 +343,112 @@ TEST(aconfigd_socket, new_storage_message) {
   ASSERT_TRUE(found);
 }
 
+TEST(aconfigd_socket, flag_info_cache) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+
+  // a single cached flag info file, for the current maps of the container
+  auto flags_dir = get_storage_root() + "/flags";
+  auto* dir = opendir(flags_dir.c_str());
+  ASSERT_NE(dir, nullptr) << strerror(errno);
+  int num_cached = 0;
+  while (auto* entry = readdir(dir)) {
+    if (std::string(entry->d_name).rfind("mockup.info.", 0) == 0) {
+      num_cached++;
+    }
+  }
+  closedir(dir);
+  ASSERT_EQ(num_cached, 1);
+}
+
+TEST(aconfigd_socket, batched_new_storage_message) {
+  // containers of their own, so their records are made by this batch and not by
+  // earlier tests
+  auto containers = std::vector<std::string>{"batch_test_0", "batch_test_1"};
+  auto messages = StorageRequestMessages{};
+  for (auto const& container : containers) {
+    auto dir = generate_container(container, 2, 4);
+    ASSERT_TRUE(dir.ok()) << dir.error();
+    add_new_storage_message(messages, container, *dir);
+  }
+  // a container that fails does not fail the rest of the batch
+  add_new_storage_message(messages, "batch_test_missing",
+                          base::GetExecutableDirectory() + "/generated/missing");
+  // a container repeated in a batch gets a single record
+  add_new_storage_message(messages, containers[0],
+                          base::GetExecutableDirectory() + "/generated/" + containers[0]);
+
+  auto new_storage_result = send_message(messages);
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 4);
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+  ASSERT_TRUE(new_storage_result->msgs(1).has_new_storage_message());
+  ASSERT_TRUE(new_storage_result->msgs(2).has_error_message());
+  ASSERT_TRUE(new_storage_result->msgs(3).has_new_storage_message());
+
+  auto pb_file = get_storage_root() + "/boot/available_storage_file_records.pb";
+  auto records_pb = storage_records_pb();
+  auto content = std::string();
+  ASSERT_TRUE(base::ReadFileToString(pb_file, &content)) << strerror(errno);
+  ASSERT_TRUE(records_pb.ParseFromString(content)) << strerror(errno);
+
+  auto found = std::map<std::string, int>();
+  for (auto& entry : records_pb.files()) {
+    found[entry.container()]++;
+  }
+  ASSERT_EQ(found[containers[0]], 1);
+  ASSERT_EQ(found[containers[1]], 1);
+  ASSERT_EQ(found["batch_test_missing"], 0);
+
+  auto flag_query_result = send_flag_query_message(
+      SyntheticPackageName(containers[1], 1), SyntheticFlagName(1));
+  ASSERT_TRUE(flag_query_result.ok()) << flag_query_result.error();
+  ASSERT_EQ(flag_query_result->msgs_size(), 1);
+  ASSERT_TRUE(flag_query_result->msgs(0).has_flag_query_message());
+  ASSERT_EQ(flag_query_result->msgs(0).flag_query_message().flag_value(), "true");
+}
+
+#ifndef __ANDROID__
+TEST(aconfigd_socket, boot_index_fallback) {
+  // package 1 flag 0 holds value index 4 with 4 flags per package, disabled
+  auto container = std::string(kBootIndexedContainer);
+  auto package = SyntheticPackageName(container, 1);
+  auto flag = SyntheticFlagName(0);
+  auto query_result = send_flag_query_message(package, flag);
+  ASSERT_TRUE(query_result.ok()) << query_result.error();
+  ASSERT_EQ(query_result->msgs_size(), 1);
+  if (query_result->msgs(0).has_error_message()) {
+    GTEST_SKIP() << "aconfigd under test was not started with " << container;
+  }
+  ASSERT_EQ(query_result->msgs(0).flag_query_message().flag_value(), "false");
+
+  // the changed container is dropped from the boot index, lookups must fall back to
+  // its new maps, where the flag moves to value index 3, enabled
+  auto dir = generate_container(container, 2, 3);
+  ASSERT_TRUE(dir.ok()) << dir.error();
+  auto messages = StorageRequestMessages{};
+  add_new_storage_message(messages, container, *dir);
+  auto new_storage_result = send_message(messages);
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+  query_result = send_flag_query_message(package, flag);
+  ASSERT_TRUE(query_result.ok()) << query_result.error();
+  ASSERT_EQ(query_result->msgs_size(), 1);
+  ASSERT_TRUE(query_result->msgs(0).has_flag_query_message());
+  ASSERT_EQ(query_result->msgs(0).flag_query_message().flag_value(), "true");
+
+  // put the boot layout back, so the test holds when run again against this aconfigd
+  dir = generate_container(container, 2, 4);
+  ASSERT_TRUE(dir.ok()) << dir.error();
+  messages = StorageRequestMessages{};
+  add_new_storage_message(messages, container, *dir);
+  new_storage_result = send_message(messages);
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+}
+#endif
+
 TEST(aconfigd_socket, flag_override_message) {
   auto new_storage_result = send_new_storage_message();
   ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
@@ -191,6 +489,115 @@ TEST(aconfigd_socket, flag_override_message) {
   ASSERT_EQ(query.flag_value(), "false");
 }
 
+TEST(aconfigd_socket, value_snapshot_follows_flag_override) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  auto return_message = new_storage_result->msgs(0);
+  ASSERT_TRUE(return_message.has_new_storage_message());
+
+  auto reader = ValueSnapshotReader::Open("mockup", get_storage_root());
+  ASSERT_TRUE(reader.ok()) << reader.error();
+
+  for (auto const& value : {"true", "false"}) {
+    auto flag_override_result = send_flag_override_message(
+        "com.android.aconfig.storage.test_1", "enabled_rw", value);
+    ASSERT_TRUE(flag_override_result.ok()) << flag_override_result.error();
+    ASSERT_EQ(flag_override_result->msgs_size(), 1);
+    return_message = flag_override_result->msgs(0);
+    ASSERT_TRUE(return_message.has_flag_override_message());
+
+    auto snapshot_value = (*reader)->GetBooleanFlagValue(
+        "com.android.aconfig.storage.test_1", "enabled_rw");
+    ASSERT_TRUE(snapshot_value.ok()) << snapshot_value.error();
+    ASSERT_EQ(*snapshot_value, std::string(value) == "true");
+  }
+}
+
+TEST(aconfigd_socket, value_snapshot_reader_follows_layout_change) {
+  auto container = std::string("snapshot_layout_test");
+  auto package = SyntheticPackageName(container, 1);
+  auto flag = SyntheticFlagName(0);
+  std::unique_ptr<ValueSnapshotReader> reader;
+
+  // package 1 flag 0 holds value index package * flags_per_package, odd indices are
+  // enabled. 8x1 keeps the flag count of 2x4 but moves the flag, 2x3 changes the
+  // count. The open reader must not keep using a cached index across either.
+  struct Layout {
+    uint32_t num_packages;
+    uint32_t flags_per_package;
+  };
+  for (auto layout : {Layout{2, 4}, Layout{8, 1}, Layout{2, 3}, Layout{2, 4}}) {
+    SCOPED_TRACE(std::to_string(layout.num_packages) + "x"
+                 + std::to_string(layout.flags_per_package));
+    auto dir = generate_container(container, layout.num_packages,
+                                  layout.flags_per_package);
+    ASSERT_TRUE(dir.ok()) << dir.error();
+    auto messages = StorageRequestMessages{};
+    add_new_storage_message(messages, container, *dir);
+    auto new_storage_result = send_message(messages);
+    ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+    ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+    if (!reader) {
+      auto opened = ValueSnapshotReader::Open(container, get_storage_root());
+      ASSERT_TRUE(opened.ok()) << opened.error();
+      reader = std::move(*opened);
+    }
+
+    uint32_t expected_index = layout.flags_per_package;
+    auto value = reader->GetBooleanFlagValue(package, flag);
+    ASSERT_TRUE(value.ok()) << value.error();
+    EXPECT_EQ(*value, expected_index % 2 == 1);
+    auto index = reader->GetBooleanFlagIndex(package, flag);
+    ASSERT_TRUE(index.ok()) << index.error();
+    EXPECT_EQ(*index, expected_index);
+  }
+}
+
+// count the mappings of files under dir in this process
+size_t count_mappings_under(const std::string& dir) {
+  auto maps = std::string();
+  if (!base::ReadFileToString("/proc/self/maps", &maps)) {
+    return 0;
+  }
+  size_t count = 0;
+  for (size_t pos = maps.find(dir + "/"); pos != std::string::npos;
+       pos = maps.find(dir + "/", pos + 1)) {
+    count++;
+  }
+  return count;
+}
+
+TEST(aconfigd_socket, value_snapshot_reader_maps_storage_once) {
+  auto container = std::string("snapshot_mapping_test");
+  auto dir = generate_container(container, 4, 4);
+  ASSERT_TRUE(dir.ok()) << dir.error();
+  auto messages = StorageRequestMessages{};
+  add_new_storage_message(messages, container, *dir);
+  auto new_storage_result = send_message(messages);
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+  // every flag is looked up once, the package and flag maps stay mapped once
+  {
+    auto reader = ValueSnapshotReader::Open(container, get_storage_root());
+    ASSERT_TRUE(reader.ok()) << reader.error();
+    for (uint32_t i = 0; i < 4; ++i) {
+      for (uint32_t j = 0; j < 4; ++j) {
+        auto index = (*reader)->GetBooleanFlagIndex(
+            SyntheticPackageName(container, i), SyntheticFlagName(j));
+        ASSERT_TRUE(index.ok()) << index.error();
+        EXPECT_EQ(*index, i * 4 + j);
+      }
+    }
+    EXPECT_EQ(count_mappings_under(*dir), 2);
+  }
+
+  // and are unmapped with the reader
+  EXPECT_EQ(count_mappings_under(*dir), 0);
+}
+
 TEST(aconfigd_socket, invalid_flag_override_message) {
   auto new_storage_result = send_new_storage_message();
   ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
@@ -226,5 +633,1094 @@ TEST(aconfigd_socket, invalid_flag_query_message) {
   ASSERT_TRUE(errmsg.find("unknown is not found in mockup") != std::string::npos);
 }
 
+TEST(aconfigd_socket, package_dump_message) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  auto return_message = new_storage_result->msgs(0);
+  ASSERT_TRUE(return_message.has_new_storage_message());
+
+  auto dump_result = send_package_dump_message("com.android.aconfig.storage.test_1");
+  ASSERT_TRUE(dump_result.ok()) << dump_result.error();
+  ASSERT_EQ(dump_result->msgs_size(), 1);
+  return_message = dump_result->msgs(0);
+  ASSERT_TRUE(return_message.has_package_dump_message());
+  auto dump = return_message.package_dump_message();
+  ASSERT_EQ(dump.container(), "mockup");
+  ASSERT_EQ(dump.flags_size(), 3);
+  ASSERT_EQ(dump.flags(0).flag_name(), "disabled_rw");
+  ASSERT_FALSE(dump.flags(0).flag_value());
+  ASSERT_EQ(dump.flags(1).flag_name(), "enabled_ro");
+  ASSERT_TRUE(dump.flags(1).flag_value());
+  ASSERT_EQ(dump.flags(2).flag_name(), "enabled_rw");
+}
+
+TEST(aconfigd_socket, container_dump_message) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  auto return_message = new_storage_result->msgs(0);
+  ASSERT_TRUE(return_message.has_new_storage_message());
+
+  auto dump_result = send_container_dump_message("mockup");
+  ASSERT_TRUE(dump_result.ok()) << dump_result.error();
+  ASSERT_EQ(dump_result->msgs_size(), 1);
+  return_message = dump_result->msgs(0);
+  ASSERT_TRUE(return_message.has_container_dump_message());
+  auto dump = return_message.container_dump_message();
+  ASSERT_EQ(dump.packages_size(), 3);
+  int num_flags = 0;
+  for (auto const& package : dump.packages()) {
+    num_flags += package.flags_size();
+  }
+  ASSERT_EQ(num_flags, 8);
+
+  // a package dump reads only the package's range, it must agree with the container
+  for (auto const& package : dump.packages()) {
+    auto package_result = send_package_dump_message(package.package_name());
+    ASSERT_TRUE(package_result.ok()) << package_result.error();
+    ASSERT_EQ(package_result->msgs_size(), 1);
+    ASSERT_TRUE(package_result->msgs(0).has_package_dump_message());
+    auto package_dump = package_result->msgs(0).package_dump_message();
+    ASSERT_EQ(package_dump.flags_size(), package.flags_size());
+    for (int i = 0; i < package.flags_size(); ++i) {
+      ASSERT_EQ(package_dump.flags(i).flag_name(), package.flags(i).flag_name());
+      ASSERT_EQ(package_dump.flags(i).flag_value(), package.flags(i).flag_value());
+    }
+  }
+}
+
+TEST(aconfigd_socket, invalid_package_dump_message) {
+  auto dump_result = send_package_dump_message("com.android.aconfig.storage.unknown");
+  ASSERT_TRUE(dump_result.ok()) << dump_result.error();
+  ASSERT_EQ(dump_result->msgs_size(), 1);
+  auto return_message = dump_result->msgs(0);
+  ASSERT_TRUE(return_message.has_error_message());
+}
+
+TEST(aconfigd_socket, reset_overrides_message) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+  // reset a single package, then the whole container
+  auto resets = std::vector<std::pair<std::string, std::string>>{
+    {"", "com.android.aconfig.storage.test_1"}, {"mockup", ""}};
+  for (auto const& [container, package] : resets) {
+    auto flag_override_result = send_flag_override_message(
+        "com.android.aconfig.storage.test_1", "enabled_rw", "false");
+    ASSERT_TRUE(flag_override_result.ok()) << flag_override_result.error();
+    ASSERT_EQ(flag_override_result->msgs_size(), 1);
+    ASSERT_TRUE(flag_override_result->msgs(0).has_flag_override_message());
+
+    auto reset_result = send_reset_overrides_message(container, package);
+    ASSERT_TRUE(reset_result.ok()) << reset_result.error();
+    ASSERT_EQ(reset_result->msgs_size(), 1);
+    auto return_message = reset_result->msgs(0);
+    ASSERT_TRUE(return_message.has_reset_overrides_message());
+    ASSERT_GE(return_message.reset_overrides_message().num_flags_reset(), 1);
+
+    auto flag_query_result = send_flag_query_message(
+        "com.android.aconfig.storage.test_1", "enabled_rw");
+    ASSERT_TRUE(flag_query_result.ok()) << flag_query_result.error();
+    ASSERT_EQ(flag_query_result->msgs_size(), 1);
+    return_message = flag_query_result->msgs(0);
+    ASSERT_TRUE(return_message.has_flag_query_message());
+    ASSERT_EQ(return_message.flag_query_message().flag_value(), "true");
+  }
+}
+
+TEST(aconfigd_socket, invalid_reset_overrides_message) {
+  auto reset_result = send_reset_overrides_message(
+      "", "com.android.aconfig.storage.unknown");
+  ASSERT_TRUE(reset_result.ok()) << reset_result.error();
+  ASSERT_EQ(reset_result->msgs_size(), 1);
+  ASSERT_TRUE(reset_result->msgs(0).has_error_message());
+}
+
+TEST(aconfigd_socket, staged_flag_override_message) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+  auto flag_query_result = send_flag_query_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw");
+  ASSERT_TRUE(flag_query_result.ok()) << flag_query_result.error();
+  ASSERT_EQ(flag_query_result->msgs_size(), 1);
+  ASSERT_TRUE(flag_query_result->msgs(0).has_flag_query_message());
+  auto value = flag_query_result->msgs(0).flag_query_message().flag_value();
+
+  // stage the current value, so the next boot is not affected by the test
+  auto staged_result = send_staged_flag_override_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw", value);
+  ASSERT_TRUE(staged_result.ok()) << staged_result.error();
+  ASSERT_EQ(staged_result->msgs_size(), 1);
+  ASSERT_TRUE(staged_result->msgs(0).has_staged_flag_override_message());
+
+  auto pb_file = get_storage_root() + "/staged_flag_overrides.pb";
+  auto staged_pb = StagedFlagOverrides();
+  auto content = std::string();
+  ASSERT_TRUE(base::ReadFileToString(pb_file, &content)) << strerror(errno);
+  ASSERT_TRUE(staged_pb.ParseFromString(content));
+  ASSERT_GE(staged_pb.overrides_size(), 1);
+  auto const& last = staged_pb.overrides(staged_pb.overrides_size() - 1);
+  ASSERT_EQ(last.package_name(), "com.android.aconfig.storage.test_1");
+  ASSERT_EQ(last.flag_name(), "enabled_rw");
+  ASSERT_EQ(last.flag_value(), value == "true");
+
+  staged_result = send_staged_flag_override_message(
+      "com.android.aconfig.storage.test_1", "unknown", "true");
+  ASSERT_TRUE(staged_result.ok()) << staged_result.error();
+  ASSERT_EQ(staged_result->msgs_size(), 1);
+  ASSERT_TRUE(staged_result->msgs(0).has_error_message());
+
+  staged_result = send_staged_flag_override_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw", "yes");
+  ASSERT_TRUE(staged_result.ok()) << staged_result.error();
+  ASSERT_EQ(staged_result->msgs_size(), 1);
+  ASSERT_TRUE(staged_result->msgs(0).has_error_message());
+}
+
+TEST(aconfigd_socket, pending_changes_message) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+  auto flag_query_result = send_flag_query_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw");
+  ASSERT_TRUE(flag_query_result.ok()) << flag_query_result.error();
+  ASSERT_EQ(flag_query_result->msgs_size(), 1);
+  ASSERT_TRUE(flag_query_result->msgs(0).has_flag_query_message());
+  auto value = flag_query_result->msgs(0).flag_query_message().flag_value();
+
+  // a change is pending while the persistent value differs from the boot value, so it
+  // is listed after exactly one of the two overrides
+  int num_found = 0;
+  for (auto const& flag_value : {"true", "false"}) {
+    auto flag_override_result = send_flag_override_message(
+        "com.android.aconfig.storage.test_1", "enabled_rw", flag_value);
+    ASSERT_TRUE(flag_override_result.ok()) << flag_override_result.error();
+    ASSERT_EQ(flag_override_result->msgs_size(), 1);
+    ASSERT_TRUE(flag_override_result->msgs(0).has_flag_override_message());
+
+    auto pending_result = send_pending_changes_message("mockup");
+    ASSERT_TRUE(pending_result.ok()) << pending_result.error();
+    ASSERT_EQ(pending_result->msgs_size(), 1);
+    ASSERT_TRUE(pending_result->msgs(0).has_pending_changes_message());
+    auto const& pending = pending_result->msgs(0).pending_changes_message();
+    ASSERT_EQ(pending.container(), "mockup");
+
+    for (auto const& change : pending.changes()) {
+      ASSERT_NE(change.boot_flag_value(), change.flag_value());
+      if (change.package_name() == "com.android.aconfig.storage.test_1"
+          && change.flag_name() == "enabled_rw") {
+        ASSERT_EQ(change.flag_value(), std::string(flag_value) == "true");
+        num_found++;
+      }
+    }
+  }
+  ASSERT_EQ(num_found, 1);
+
+  auto flag_override_result = send_flag_override_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw", value);
+  ASSERT_TRUE(flag_override_result.ok()) << flag_override_result.error();
+
+  auto pending_result = send_pending_changes_message("unknown");
+  ASSERT_TRUE(pending_result.ok()) << pending_result.error();
+  ASSERT_EQ(pending_result->msgs_size(), 1);
+  ASSERT_TRUE(pending_result->msgs(0).has_error_message());
+}
+
+TEST(aconfigd_socket, bulk_flag_query_message) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+  auto bulk_result = send_bulk_flag_query_message(
+      "", "com.android.aconfig.storage.test_1");
+  ASSERT_TRUE(bulk_result.ok()) << bulk_result.error();
+  ASSERT_EQ(bulk_result->msgs_size(), 1);
+  ASSERT_TRUE(bulk_result->msgs(0).has_bulk_flag_query_message());
+  auto const& bulk = bulk_result->msgs(0).bulk_flag_query_message();
+  ASSERT_EQ(bulk.container(), "mockup");
+  ASSERT_EQ(bulk.start_index(), 0);
+  ASSERT_EQ(bulk.num_flags(), 3);
+  ASSERT_EQ(bulk.flag_values().size(), 1);
+
+  // bulk values agree with single flag queries
+  uint32_t num_enabled = 0;
+  auto flag_names = std::vector<std::string>{"disabled_rw", "enabled_ro", "enabled_rw"};
+  for (uint32_t i = 0; i < flag_names.size(); ++i) {
+    auto flag_query_result = send_flag_query_message(
+        "com.android.aconfig.storage.test_1", flag_names[i]);
+    ASSERT_TRUE(flag_query_result.ok()) << flag_query_result.error();
+    ASSERT_EQ(flag_query_result->msgs_size(), 1);
+    ASSERT_TRUE(flag_query_result->msgs(0).has_flag_query_message());
+    bool value = flag_query_result->msgs(0).flag_query_message().flag_value() == "true";
+    ASSERT_EQ(((bulk.flag_values()[0] >> i) & 1) != 0, value);
+    num_enabled += value;
+  }
+  ASSERT_EQ(bulk.num_enabled(), num_enabled);
+  ASSERT_EQ(static_cast<uint32_t>(bulk.enabled_indices_size()), num_enabled);
+
+  bulk_result = send_bulk_flag_query_message("mockup", "");
+  ASSERT_TRUE(bulk_result.ok()) << bulk_result.error();
+  ASSERT_EQ(bulk_result->msgs_size(), 1);
+  ASSERT_TRUE(bulk_result->msgs(0).has_bulk_flag_query_message());
+  ASSERT_EQ(bulk_result->msgs(0).bulk_flag_query_message().num_flags(), 8);
+
+  bulk_result = send_bulk_flag_query_message("", "");
+  ASSERT_TRUE(bulk_result.ok()) << bulk_result.error();
+  ASSERT_EQ(bulk_result->msgs_size(), 1);
+  ASSERT_TRUE(bulk_result->msgs(0).has_error_message());
+}
+
+TEST(aconfigd_socket, snapshot_read_messages) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+  auto messages = StorageRequestMessages{};
+  messages.set_snapshot_read(true);
+  for (auto const& flag : {"disabled_rw", "enabled_rw"}) {
+    auto* msg = messages.add_msgs()->mutable_flag_query_message();
+    msg->set_package_name("com.android.aconfig.storage.test_1");
+    msg->set_flag_name(flag);
+  }
+  auto* override_msg = messages.add_msgs()->mutable_flag_override_message();
+  override_msg->set_package_name("com.android.aconfig.storage.test_1");
+  override_msg->set_flag_name("enabled_rw");
+  override_msg->set_flag_value("true");
+
+  auto snapshot_result = send_message(messages);
+  ASSERT_TRUE(snapshot_result.ok()) << snapshot_result.error();
+  ASSERT_EQ(snapshot_result->msgs_size(), 3);
+  ASSERT_TRUE(snapshot_result->msgs(0).has_flag_query_message());
+  ASSERT_TRUE(snapshot_result->msgs(1).has_flag_query_message());
+  ASSERT_TRUE(snapshot_result->msgs(2).has_error_message());
+  auto generation = snapshot_result->msgs(0).flag_query_message().generation();
+  ASSERT_EQ(snapshot_result->msgs(1).flag_query_message().generation(), generation);
+
+  // the reported generation is the one the value snapshot is at
+  auto reader = ValueSnapshotReader::Open("mockup", get_storage_root());
+  ASSERT_TRUE(reader.ok()) << reader.error();
+  auto indices = std::vector<uint32_t>();
+  for (auto const& flag : {"disabled_rw", "enabled_rw"}) {
+    auto index = (*reader)->GetBooleanFlagIndex("com.android.aconfig.storage.test_1",
+                                                flag);
+    ASSERT_TRUE(index.ok()) << index.error();
+    indices.push_back(*index);
+  }
+  auto values = std::vector<bool>();
+  auto snapshot_generation = (*reader)->GetBooleanFlagValues(indices, &values);
+  ASSERT_TRUE(snapshot_generation.ok()) << snapshot_generation.error();
+  ASSERT_EQ(*snapshot_generation, generation);
+  for (size_t i = 0; i < values.size(); ++i) {
+    EXPECT_EQ(snapshot_result->msgs(i).flag_query_message().flag_value(),
+              values[i] ? "true" : "false");
+  }
+
+  // an override moves the container to a later generation
+  auto flag_override_result = send_flag_override_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw", "true");
+  ASSERT_TRUE(flag_override_result.ok()) << flag_override_result.error();
+  ASSERT_EQ(flag_override_result->msgs_size(), 1);
+  ASSERT_TRUE(flag_override_result->msgs(0).has_flag_override_message());
+
+  auto flag_query_result = send_flag_query_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw");
+  ASSERT_TRUE(flag_query_result.ok()) << flag_query_result.error();
+  ASSERT_EQ(flag_query_result->msgs_size(), 1);
+  ASSERT_TRUE(flag_query_result->msgs(0).has_flag_query_message());
+  auto query_generation = flag_query_result->msgs(0).flag_query_message().generation();
+  ASSERT_GT(query_generation, generation);
+  snapshot_generation = (*reader)->GetBooleanFlagValues(indices, &values);
+  ASSERT_TRUE(snapshot_generation.ok()) << snapshot_generation.error();
+  ASSERT_EQ(*snapshot_generation, query_generation);
+}
+
+TEST(aconfigd_socket, deadline_messages) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  ASSERT_EQ(new_storage_result->msgs_size(), 1);
+  ASSERT_TRUE(new_storage_result->msgs(0).has_new_storage_message());
+
+  // a request handled within its deadline is served as usual
+  auto messages = StorageRequestMessages{};
+  messages.set_deadline_ms(60000);
+  auto* msg = messages.add_msgs()->mutable_flag_query_message();
+  msg->set_package_name("com.android.aconfig.storage.test_1");
+  msg->set_flag_name("enabled_ro");
+
+  auto deadline_result = send_message(messages);
+  ASSERT_TRUE(deadline_result.ok()) << deadline_result.error();
+  ASSERT_EQ(deadline_result->msgs_size(), 1);
+  ASSERT_TRUE(deadline_result->msgs(0).has_flag_query_message());
+  ASSERT_EQ(deadline_result->msgs(0).flag_query_message().flag_value(), "true");
+}
+
+TEST(aconfigd_socket, subscribe_message) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+
+  auto sock_fd = connect_aconfigd_socket();
+  ASSERT_TRUE(sock_fd.ok()) << sock_fd.error();
+
+  auto messages = StorageRequestMessages{};
+  auto* msg = messages.add_msgs()->mutable_subscribe_message();
+  msg->add_package_names("com.android.aconfig.storage.test_1");
+  auto message_string = std::string();
+  ASSERT_TRUE(messages.SerializeToString(&message_string));
+  ASSERT_TRUE(base::WriteFully(*sock_fd, message_string.data(), message_string.size()));
+
+  auto subscribe_result = recv_framed_message(*sock_fd);
+  ASSERT_TRUE(subscribe_result.ok()) << subscribe_result.error();
+  ASSERT_EQ(subscribe_result->msgs_size(), 1);
+  ASSERT_TRUE(subscribe_result->msgs(0).has_subscribe_message());
+
+  auto flag_override_result = send_flag_override_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw", "true");
+  ASSERT_TRUE(flag_override_result.ok()) << flag_override_result.error();
+  flag_override_result = send_flag_override_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw", "false");
+  ASSERT_TRUE(flag_override_result.ok()) << flag_override_result.error();
+
+  auto event_result = recv_framed_message(*sock_fd);
+  ASSERT_TRUE(event_result.ok()) << event_result.error();
+  ASSERT_EQ(event_result->msgs_size(), 1);
+  ASSERT_TRUE(event_result->msgs(0).has_flag_change_event_message());
+  auto event = event_result->msgs(0).flag_change_event_message();
+  ASSERT_GE(event.changes_size(), 1);
+  auto change = event.changes(event.changes_size() - 1);
+  ASSERT_EQ(change.package_name(), "com.android.aconfig.storage.test_1");
+  ASSERT_EQ(change.flag_name(), "enabled_rw");
+}
+
+TEST(aconfigd_socket, stats_message) {
+  auto new_storage_result = send_new_storage_message();
+  ASSERT_TRUE(new_storage_result.ok()) << new_storage_result.error();
+  auto flag_query_result = send_flag_query_message(
+      "com.android.aconfig.storage.test_1", "enabled_rw");
+  ASSERT_TRUE(flag_query_result.ok()) << flag_query_result.error();
+
+  auto messages = StorageRequestMessages{};
+  auto* msg = messages.add_msgs()->mutable_stats_message();
+  msg->set_include_trace(true);
+  auto stats_result = send_message(messages);
+  ASSERT_TRUE(stats_result.ok()) << stats_result.error();
+  ASSERT_EQ(stats_result->msgs_size(), 1);
+  ASSERT_TRUE(stats_result->msgs(0).has_stats_message());
+  auto stats = stats_result->msgs(0).stats_message();
+
+  bool found = false;
+  for (auto const& type_stats : stats.message_types()) {
+    if (type_stats.message_type() == "flag_query") {
+      found = true;
+      ASSERT_GE(type_stats.requests(), 1);
+      ASSERT_EQ(type_stats.latency().buckets_size(), 32);
+    }
+  }
+  ASSERT_TRUE(found);
+  ASSERT_EQ(stats.stages_size(), 6);
+  ASSERT_GT(stats.trace_events_size(), 0);
+}
+
+TEST(aconfigd_socket, warm_up_stats) {
+  // the warm up runs in the background after start, give it a moment to finish
+  auto stats = StorageReturnMessage::StatsReturnMessage();
+  for (int i = 0; i < 10; ++i) {
+    auto messages = StorageRequestMessages{};
+    messages.add_msgs()->mutable_stats_message();
+    auto stats_result = send_message(messages);
+    ASSERT_TRUE(stats_result.ok()) << stats_result.error();
+    ASSERT_EQ(stats_result->msgs_size(), 1);
+    ASSERT_TRUE(stats_result->msgs(0).has_stats_message());
+    stats = stats_result->msgs(0).stats_message();
+    if (stats.has_warm_up_ns()) {
+      break;
+    }
+    usleep(100000);
+  }
+  ASSERT_GT(stats.warm_up_ns(), 0);
+}
+
+// write synthetic containers and a boot index of them to a temp dir, and load it
+void write_and_load_boot_index(const base::TemporaryDir& temp_dir,
+                               std::vector<BootIndexContainer>* containers) {
+  for (auto const& container : {"boot_index_0", "boot_index_1"}) {
+    auto dir = std::string(temp_dir.path) + "/" + container;
+    ASSERT_EQ(mkdir(dir.c_str(), 0755), 0) << strerror(errno);
+    auto options = StorageGenOptions();
+    options.container = container;
+    options.num_packages = 3;
+    options.flags_per_package = 5;
+    auto gen_result = GenerateStorageFiles(options, dir);
+    ASSERT_TRUE(gen_result.ok()) << gen_result.error();
+    containers->push_back(
+        {container, dir + "/package.map", dir + "/flag.map", dir + "/flag.val"});
+  }
+
+  auto index_file = std::string(temp_dir.path) + "/boot_index.bin";
+  auto write_result = WriteBootIndex(index_file, *containers);
+  ASSERT_TRUE(write_result.ok()) << write_result.error();
+
+  auto content = std::string();
+  ASSERT_TRUE(base::ReadFileToString(index_file, &content)) << strerror(errno);
+  ASSERT_GE(content.size(), 2 * sizeof(uint32_t));
+  uint32_t header[2];
+  memcpy(header, content.data(), sizeof(header));
+  ASSERT_EQ(header[0], kBootIndexMagic);
+  ASSERT_EQ(header[1], kBootIndexVersion);
+
+  auto loaded = LoadBootIndex(index_file);
+  ASSERT_TRUE(loaded.ok()) << loaded.error();
+  ASSERT_EQ(loaded->size(), containers->size());
+}
+
+// check boot index lookups of every flag of a container against the storage maps
+void expect_boot_index_matches_maps(const BootIndexContainer& container) {
+  auto package_map = MapStorageFileAt(container.package_map);
+  ASSERT_TRUE(package_map.ok()) << package_map.error();
+  auto flag_map = MapStorageFileAt(container.flag_map);
+  ASSERT_TRUE(flag_map.ok()) << flag_map.error();
+  auto packages = ListPackages(*package_map);
+  ASSERT_TRUE(packages.ok()) << packages.error();
+  auto flags = ListFlags(*flag_map);
+  ASSERT_TRUE(flags.ok()) << flags.error();
+  ASSERT_FALSE(flags->empty());
+
+  auto packages_by_id = std::map<uint32_t, std::string>();
+  for (auto const& package : *packages) {
+    auto context = aconfig_storage::get_package_read_context(
+        *package_map, package.package_name);
+    ASSERT_TRUE(context.ok()) << context.error();
+    ASSERT_TRUE(context->package_exists);
+    auto indexed = FindPackageInBootIndex(package.package_name);
+    ASSERT_TRUE(indexed) << package.package_name;
+    EXPECT_EQ(indexed->container, container.container);
+    EXPECT_EQ(indexed->boolean_start_index, context->boolean_start_index);
+    packages_by_id[context->package_id] = package.package_name;
+  }
+
+  for (auto const& flag : *flags) {
+    auto const& package = packages_by_id[flag.package_id];
+    auto package_context = aconfig_storage::get_package_read_context(
+        *package_map, package);
+    ASSERT_TRUE(package_context.ok()) << package_context.error();
+    auto flag_context = aconfig_storage::get_flag_read_context(
+        *flag_map, flag.package_id, flag.flag_name);
+    ASSERT_TRUE(flag_context.ok()) << flag_context.error();
+    ASSERT_TRUE(flag_context->flag_exists);
+    auto indexed = FindFlagInBootIndex(container.container, package, flag.flag_name);
+    ASSERT_TRUE(indexed) << package << "/" << flag.flag_name;
+    EXPECT_EQ(*indexed, package_context->boolean_start_index + flag_context->flag_index);
+  }
+
+  UnmapStorageFile(*package_map);
+  UnmapStorageFile(*flag_map);
+}
+
+TEST(aconfigd_boot_index, lookups_match_storage_maps) {
+  auto temp_dir = base::TemporaryDir();
+  auto containers = std::vector<BootIndexContainer>();
+  ASSERT_NO_FATAL_FAILURE(write_and_load_boot_index(temp_dir, &containers));
+  for (auto const& container : containers) {
+    ASSERT_NO_FATAL_FAILURE(expect_boot_index_matches_maps(container));
+  }
+
+  auto package = SyntheticPackageName("boot_index_0", 0);
+  EXPECT_FALSE(FindPackageInBootIndex(package + ".unknown"));
+  EXPECT_FALSE(FindFlagInBootIndex("boot_index_0", package, "unknown"));
+  EXPECT_FALSE(FindFlagInBootIndex("boot_index_1", package, SyntheticFlagName(0)));
+}
+
+TEST(aconfigd_boot_index, invalidated_container_misses) {
+  auto temp_dir = base::TemporaryDir();
+  auto containers = std::vector<BootIndexContainer>();
+  ASSERT_NO_FATAL_FAILURE(write_and_load_boot_index(temp_dir, &containers));
+
+  // lookups of the invalidated container miss so callers go to its maps, the other
+  // container is still served from the index
+  InvalidateBootIndexContainer("boot_index_0");
+  for (uint32_t i = 0; i < 3; ++i) {
+    auto package = SyntheticPackageName("boot_index_0", i);
+    EXPECT_FALSE(FindPackageInBootIndex(package));
+    EXPECT_FALSE(FindFlagInBootIndex("boot_index_0", package, SyntheticFlagName(0)));
+  }
+  ASSERT_NO_FATAL_FAILURE(expect_boot_index_matches_maps(containers[1]));
+
+  // a restarted aconfigd must not load the stale index
+  EXPECT_FALSE(FileExists(std::string(temp_dir.path) + "/boot_index.bin"));
+}
+
+// request messages holding count messages of one kind
+StorageRequestMessages make_request(StorageRequestMessage::MsgCase kind, int count = 1) {
+  auto messages = StorageRequestMessages{};
+  for (int i = 0; i < count; ++i) {
+    auto* msg = messages.add_msgs();
+    switch (kind) {
+      case StorageRequestMessage::kNewStorageMessage:
+        msg->mutable_new_storage_message();
+        break;
+      case StorageRequestMessage::kFlagOverrideMessage:
+        msg->mutable_flag_override_message();
+        break;
+      case StorageRequestMessage::kContainerDumpMessage:
+        msg->mutable_container_dump_message();
+        break;
+      case StorageRequestMessage::kStatsMessage:
+        msg->mutable_stats_message();
+        break;
+      case StorageRequestMessage::kPackageDumpMessage:
+        msg->mutable_package_dump_message();
+        break;
+      case StorageRequestMessage::kBulkFlagQueryMessage:
+        msg->mutable_bulk_flag_query_message()->set_container("mockup");
+        break;
+      default:
+        msg->mutable_flag_query_message();
+        break;
+    }
+  }
+  return messages;
+}
+
+TEST(aconfigd_scheduler, classify_request) {
+  using Msg = StorageRequestMessage;
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kFlagQueryMessage)), RequestClass::kQuery);
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kStatsMessage)), RequestClass::kQuery);
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kFlagQueryMessage, kMaxQueryBatchSize)),
+            RequestClass::kQuery);
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kFlagQueryMessage, kMaxQueryBatchSize + 1)),
+            RequestClass::kBulk);
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kFlagOverrideMessage)), RequestClass::kBulk);
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kContainerDumpMessage)),
+            RequestClass::kBulk);
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kNewStorageMessage)), RequestClass::kBoot);
+
+  // whole package reads weigh more than flag reads, whole container reads are bulk
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kPackageDumpMessage,
+                                         kMaxQueryBatchSize / kPackageReadCost)),
+            RequestClass::kQuery);
+  EXPECT_EQ(ClassifyRequest(make_request(Msg::kPackageDumpMessage,
+                                         kMaxQueryBatchSize / kPackageReadCost + 1)),
+            RequestClass::kBulk);
+  auto bulk_query = make_request(Msg::kBulkFlagQueryMessage);
+  EXPECT_EQ(ClassifyRequest(bulk_query), RequestClass::kBulk);
+  bulk_query.mutable_msgs(0)->mutable_bulk_flag_query_message()->set_package_name(
+      "com.android.aconfig.storage.test_1");
+  EXPECT_EQ(ClassifyRequest(bulk_query), RequestClass::kQuery);
+
+  // a new storage message makes the whole batch a boot request, even a large one
+  auto messages = make_request(Msg::kFlagQueryMessage, kMaxQueryBatchSize + 1);
+  messages.add_msgs()->mutable_new_storage_message();
+  EXPECT_EQ(ClassifyRequest(messages), RequestClass::kBoot);
+}
+
+TEST(aconfigd_scheduler, order_by_class) {
+  auto bulk = make_request(StorageRequestMessage::kFlagOverrideMessage);
+  auto query = make_request(StorageRequestMessage::kFlagQueryMessage);
+  auto boot = make_request(StorageRequestMessage::kNewStorageMessage);
+
+  // a class is served before a later one whatever the deadlines
+  bulk.set_deadline_ms(1);
+  auto scheduler = RequestScheduler();
+  scheduler.Add(base::unique_fd(), bulk, 0);
+  scheduler.Add(base::unique_fd(), query, 0);
+  scheduler.Add(base::unique_fd(), boot, 0);
+  EXPECT_EQ(scheduler.Next().messages, &boot);
+  EXPECT_EQ(scheduler.Next().messages, &query);
+  EXPECT_EQ(scheduler.Next().messages, &bulk);
+  EXPECT_TRUE(scheduler.Empty());
+}
+
+TEST(aconfigd_scheduler, order_by_deadline) {
+  auto none = make_request(StorageRequestMessage::kFlagQueryMessage);
+  auto late = make_request(StorageRequestMessage::kFlagQueryMessage);
+  auto early = make_request(StorageRequestMessage::kFlagQueryMessage);
+  late.set_deadline_ms(50);
+  early.set_deadline_ms(100);
+
+  // deadlines count from arrival, early arrives long enough before late to be due first
+  auto scheduler = RequestScheduler();
+  scheduler.Add(base::unique_fd(), none, 0);
+  scheduler.Add(base::unique_fd(), late, 1000000000ULL);
+  scheduler.Add(base::unique_fd(), early, 0);
+  auto first = scheduler.Next();
+  EXPECT_EQ(first.messages, &early);
+  EXPECT_EQ(first.deadline_ns, 100000000ULL);
+  auto second = scheduler.Next();
+  EXPECT_EQ(second.messages, &late);
+  EXPECT_EQ(second.deadline_ns, 1050000000ULL);
+  auto third = scheduler.Next();
+  EXPECT_EQ(third.messages, &none);
+  EXPECT_EQ(third.deadline_ns, 0);
+}
+
+TEST(aconfigd_scheduler, order_ties_by_arrival) {
+  auto requests = std::vector<StorageRequestMessages>(4);
+  for (size_t i = 0; i < requests.size(); ++i) {
+    requests[i] = make_request(StorageRequestMessage::kFlagQueryMessage);
+    // pairs with the same deadline, then pairs without
+    if (i < 2) {
+      requests[i].set_deadline_ms(10);
+    }
+  }
+
+  auto scheduler = RequestScheduler();
+  for (auto const& request : requests) {
+    scheduler.Add(base::unique_fd(), request, 0);
+  }
+  for (size_t i = 0; i < requests.size(); ++i) {
+    auto next = scheduler.Next();
+    EXPECT_EQ(next.messages, &requests[i]);
+    EXPECT_EQ(next.sequence, i);
+  }
+}
+
+TEST(aconfigd_scheduler, reject_late_request) {
+  // a request received long ago with a short deadline is already late when taken
+  auto messages = make_request(StorageRequestMessage::kFlagQueryMessage, 3);
+  messages.set_deadline_ms(10);
+  auto scheduler = RequestScheduler();
+  scheduler.Add(base::unique_fd(), messages, NowNs() - 1000000000ULL);
+  auto request = scheduler.Next();
+  ASSERT_NE(request.deadline_ns, 0);
+  ASSERT_GT(NowNs(), request.deadline_ns);
+
+  auto return_messages = StorageReturnMessages{};
+  RejectLateRequest(*request.messages, return_messages);
+  ASSERT_EQ(return_messages.msgs_size(), messages.msgs_size());
+  for (auto const& return_msg : return_messages.msgs()) {
+    ASSERT_TRUE(return_msg.has_error_message());
+    ASSERT_EQ(return_msg.error_message(), "Request deadline exceeded");
+  }
+}
+
+TEST(aconfigd_value_kernels, find_differing_bytes) {
+  // sizes around the 64 byte block, and arrays starting off alignment so blocks
+  // straddle cache lines
+  auto rng = std::mt19937(43);
+  for (size_t size : {0, 1, 15, 63, 64, 65, 127, 128, 129, 191, 200, 1000}) {
+    for (size_t offset : {0, 1}) {
+      auto lhs = std::vector<uint8_t>(size + offset);
+      for (size_t i = 0; i < size; ++i) {
+        lhs[offset + i] = i % 2;
+      }
+      auto rhs = lhs;
+
+      // differences at block boundaries, in the scalar tail and at random
+      auto positions = std::vector<size_t>{0, 31, 63, 64, 127, 128, 129, size - 1};
+      for (int i = 0; i < 8; ++i) {
+        positions.push_back(size == 0 ? 0 : rng() % size);
+      }
+      for (auto pos : positions) {
+        if (pos < size) {
+          rhs[offset + pos] ^= 1 + rng() % 255;
+        }
+      }
+
+      auto expected = std::vector<uint32_t>();
+      for (size_t i = 0; i < size; ++i) {
+        if (lhs[offset + i] != rhs[offset + i]) {
+          expected.push_back(i);
+        }
+      }
+
+      auto diffs = std::vector<uint32_t>();
+      FindDifferingBytes(lhs.data() + offset, rhs.data() + offset, size, &diffs);
+      EXPECT_EQ(diffs, expected) << "size " << size << " offset " << offset;
+
+      // identical arrays have no differences
+      diffs.clear();
+      FindDifferingBytes(lhs.data() + offset, lhs.data() + offset, size, &diffs);
+      EXPECT_TRUE(diffs.empty()) << "size " << size << " offset " << offset;
+    }
+  }
+}
+
+// byte per value flag values with random non zero values set, and their bit reference
+std::vector<uint8_t> random_values(size_t size, std::mt19937& rng) {
+  auto values = std::vector<uint8_t>(size);
+  for (auto& value : values) {
+    value = rng() % 2 ? 1 + rng() % 255 : 0;
+  }
+  return values;
+}
+
+bool get_bit(const std::vector<uint64_t>& words, size_t index) {
+  return (words[index / 64] >> (index % 64)) & 1;
+}
+
+TEST(aconfigd_value_kernels, pack_count_and_find_bits) {
+  auto rng = std::mt19937(44);
+  for (size_t size : {0, 1, 63, 64, 65, 127, 128, 129, 200, 1000}) {
+    auto values = random_values(size, rng);
+    auto expected = std::vector<uint32_t>();
+    for (size_t i = 0; i < size; ++i) {
+      if (values[i] != 0) {
+        expected.push_back(i);
+      }
+    }
+
+    // words start out with every bit set, bits past size must be cleared
+    auto words = std::vector<uint64_t>(NumBitWords(size), ~uint64_t(0));
+    PackBits(values.data(), size, words.data());
+    for (size_t i = 0; i < words.size() * 64; ++i) {
+      ASSERT_EQ(get_bit(words, i), i < size && values[i] != 0)
+          << "size " << size << " bit " << i;
+    }
+
+    EXPECT_EQ(CountSetBits(words.data(), size), expected.size()) << "size " << size;
+    auto indices = std::vector<uint32_t>();
+    FindSetBits(words.data(), size, &indices);
+    EXPECT_EQ(indices, expected) << "size " << size;
+
+    // bits past num_bits are ignored, even when set
+    if (size % 64 != 0) {
+      words.back() |= ~uint64_t(0) << (size % 64);
+      EXPECT_EQ(CountSetBits(words.data(), size), expected.size()) << "size " << size;
+      indices.clear();
+      FindSetBits(words.data(), size, &indices);
+      EXPECT_EQ(indices, expected) << "size " << size;
+    }
+  }
+}
+
+TEST(aconfigd_value_kernels, extract_bits) {
+  auto rng = std::mt19937(45);
+  auto values = random_values(300, rng);
+  auto words = std::vector<uint64_t>(NumBitWords(values.size()));
+  PackBits(values.data(), values.size(), words.data());
+
+  // ranges of 0, 63, 64, 65 and more than 128 bits, from aligned and unaligned begins
+  for (size_t begin : {0, 1, 7, 63, 64, 65, 100}) {
+    for (size_t length : {0, 1, 63, 64, 65, 129, 190}) {
+      auto end = begin + length;
+      if (end > values.size()) {
+        continue;
+      }
+      auto out = std::vector<uint64_t>(NumBitWords(length), ~uint64_t(0));
+      ExtractBits(words.data(), begin, end, out.data());
+      for (size_t i = 0; i < out.size() * 64; ++i) {
+        ASSERT_EQ(get_bit(out, i), i < length && values[begin + i] != 0)
+            << "begin " << begin << " length " << length << " bit " << i;
+      }
+    }
+  }
+}
+
+// flag value file holding a header with the given fields and num_values values
+std::string make_flag_value_file(uint32_t num_flags, uint32_t boolean_value_offset,
+                                 uint32_t num_values) {
+  auto content = std::string();
+  auto append_u32 = [&](uint32_t value) {
+    content.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  append_u32(1);
+  append_u32(6);
+  content += "mockup";
+  content += static_cast<char>(2);
+  auto file_size_offset = content.size();
+  append_u32(0);
+  append_u32(num_flags);
+  append_u32(boolean_value_offset);
+  content.append(num_values, '\1');
+  auto file_size = static_cast<uint32_t>(content.size());
+  memcpy(content.data() + file_size_offset, &file_size, sizeof(file_size));
+  return content;
+}
+
+TEST(aconfigd_storage_file, flag_value_header_bounds) {
+  auto temp_dir = base::TemporaryDir();
+  auto file = std::string(temp_dir.path) + "/flag.val";
+  auto parse = [&](const std::string& content) {
+    EXPECT_TRUE(base::WriteStringToFile(content, file));
+    auto mapped = MapStorageFileAt(file);
+    EXPECT_TRUE(mapped.ok()) << mapped.error();
+    auto header = ParseFlagValueHeader(*mapped);
+    UnmapStorageFile(*mapped);
+    return header;
+  };
+
+  // values right after the 27 byte header
+  auto header = parse(make_flag_value_file(4, 27, 4));
+  ASSERT_TRUE(header.ok()) << header.error();
+  EXPECT_EQ(header->container, "mockup");
+  EXPECT_EQ(header->num_flags, 4);
+  EXPECT_EQ(header->boolean_value_offset, 27);
+
+  // too few values, and an offset and count that wrap around in 32 bits
+  EXPECT_FALSE(parse(make_flag_value_file(5, 27, 4)).ok());
+  EXPECT_FALSE(parse(make_flag_value_file(0xffffffd0, 0x40, 4)).ok());
+  EXPECT_FALSE(parse(make_flag_value_file(4, 0xfffffffe, 4)).ok());
+}
+
+TEST(aconfigd_storage_gen, matches_aconfig_output) {
+  // the mockup container the checked in storage files were produced by aconfig for
+  using Type = StorageGenFlagType;
+  auto packages = std::vector<StorageGenPackage>{
+    {"com.android.aconfig.storage.test_1", {
+      {"disabled_rw", Type::kReadWriteBoolean, false},
+      {"enabled_ro", Type::kReadOnlyBoolean, true},
+      {"enabled_rw", Type::kReadWriteBoolean, true},
+    }},
+    {"com.android.aconfig.storage.test_2", {
+      {"disabled_ro", Type::kReadOnlyBoolean, false},
+      {"enabled_fixed_ro", Type::kFixedReadOnlyBoolean, true},
+      {"enabled_ro", Type::kReadOnlyBoolean, true},
+    }},
+    {"com.android.aconfig.storage.test_4", {
+      {"enabled_fixed_ro", Type::kFixedReadOnlyBoolean, true},
+      {"enabled_ro", Type::kReadOnlyBoolean, true},
+    }},
+  };
+
+  auto temp_dir = base::TemporaryDir();
+  auto gen_result = GenerateStorageFiles("mockup", packages, temp_dir.path);
+  ASSERT_TRUE(gen_result.ok()) << gen_result.error();
+
+  auto test_dir = base::GetExecutableDirectory() + "/tests";
+  for (auto file : {"package.map", "flag.map", "flag.val"}) {
+    auto expected = std::string();
+    auto generated = std::string();
+    ASSERT_TRUE(base::ReadFileToString(test_dir + "/" + file, &expected));
+    ASSERT_TRUE(base::ReadFileToString(std::string(temp_dir.path) + "/" + file,
+                                       &generated));
+    EXPECT_TRUE(generated == expected) << file << " differs from aconfig's";
+  }
+}
+
+TEST(aconfigd_util, file_digest_known_answers) {
+  auto temp_dir = base::TemporaryDir();
+  auto pattern = [](size_t size) {
+    auto content = std::string(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+      content[i] = static_cast<char>(i * 31 + 7);
+    }
+    return content;
+  };
+
+  // reference XXH64 digests with seed 0, covering the short input tail handling, a
+  // single stripe and many stripes with a tail
+  auto expected = std::vector<std::pair<std::string, uint64_t>>{
+    {"", 0xEF46DB3751D8E999ULL},
+    {"abc", 0x44BC2CF5AD770999ULL},
+    {pattern(31), 0x4A74F3A1A39AD4A1ULL},
+    {pattern(32), 0x8D57D6A4671CC43DULL},
+    {pattern((1 << 20) + 7), 0xD9DFB22D551315E1ULL},
+  };
+
+  for (const auto& [content, digest] : expected) {
+    auto file = std::string(temp_dir.path) + "/" + std::to_string(content.size());
+    ASSERT_TRUE(base::WriteStringToFile(content, file));
+    auto result = GetFileDigest(file);
+    ASSERT_TRUE(result.ok()) << result.error();
+    EXPECT_EQ(*result, digest) << "digest of " << content.size() << " bytes";
+  }
+
+  // a fd digest only covers the given prefix of the file
+  auto file = std::string(temp_dir.path) + "/" + std::to_string((1 << 20) + 7);
+  auto fd = base::unique_fd(open(file.c_str(), O_RDONLY | O_CLOEXEC));
+  ASSERT_NE(fd.get(), -1);
+  auto result = GetFdDigest(fd.get(), 32);
+  ASSERT_TRUE(result.ok()) << result.error();
+  EXPECT_EQ(*result, 0x8D57D6A4671CC43DULL);
+}
+
+TEST(aconfigd_util, copy_file_methods) {
+  auto temp_dir = base::TemporaryDir();
+  auto src = std::string(temp_dir.path) + "/src";
+
+  // far more than the 64 KiB pipe buffer sendfile moves data through, and not a
+  // multiple of the page size
+  auto rng = std::mt19937(27);
+  auto content = std::string((8 << 20) + 13, '\0');
+  for (auto& byte : content) {
+    byte = static_cast<char>(rng());
+  }
+  ASSERT_TRUE(base::WriteStringToFile(content, src));
+
+  for (auto cheapest : {CopyMethod::kReflink, CopyMethod::kCopyFileRange,
+                        CopyMethod::kSendfile}) {
+    auto dst = src + "." + CopyMethodName(cheapest);
+    mode_t mode = cheapest == CopyMethod::kSendfile ? 0444 : 0640;
+    auto publisher = FilePublisher();
+    auto method = publisher.CopyFile(src, dst, mode, cheapest);
+    ASSERT_TRUE(method.ok()) << method.error();
+    EXPECT_GE(*method, cheapest);
+    ASSERT_TRUE(publisher.Commit().ok());
+
+    auto copied = std::string();
+    ASSERT_TRUE(base::ReadFileToString(dst, &copied));
+    EXPECT_TRUE(copied == content) << "content differs after "
+                                   << CopyMethodName(*method);
+    struct stat st;
+    ASSERT_EQ(stat(dst.c_str(), &st), 0);
+    EXPECT_EQ(st.st_mode & 07777, mode);
+  }
+}
+
+TEST(aconfigd_util, publish_replaces_stale_temp_file) {
+  auto temp_dir = base::TemporaryDir();
+  auto file = std::string(temp_dir.path) + "/flag.val";
+  auto other = std::string(temp_dir.path) + "/other";
+  ASSERT_TRUE(base::WriteStringToFile("other", other));
+
+  // a stale temp file from an interrupted write, and one that links elsewhere
+  ASSERT_TRUE(base::WriteStringToFile("stale", file + ".tmp"));
+  ASSERT_TRUE(WriteFileAtomically("first", file, 0644).ok());
+  ASSERT_EQ(symlink(other.c_str(), (file + ".tmp").c_str()), 0);
+  ASSERT_TRUE(WriteFileAtomically("second", file, 0444).ok());
+
+  auto content = std::string();
+  ASSERT_TRUE(base::ReadFileToString(file, &content));
+  EXPECT_EQ(content, "second");
+  ASSERT_TRUE(base::ReadFileToString(other, &content));
+  EXPECT_EQ(content, "other");
+  struct stat st;
+  ASSERT_EQ(stat(file.c_str(), &st), 0);
+  EXPECT_EQ(st.st_mode & 07777, 0444);
+  EXPECT_EQ(lstat((file + ".tmp").c_str(), &st), -1);
+}
+
+TEST(aconfigd_util, failed_publish_keeps_file) {
+  auto temp_dir = base::TemporaryDir();
+  auto file = std::string(temp_dir.path) + "/flag.val";
+  ASSERT_TRUE(WriteFileAtomically("original", file, 0644).ok());
+
+  // a temp file that cannot be replaced fails the write before the file is touched
+  auto tmp = file + ".tmp";
+  ASSERT_EQ(mkdir(tmp.c_str(), 0755), 0);
+  ASSERT_TRUE(base::WriteStringToFile("", tmp + "/entry"));
+  EXPECT_FALSE(WriteFileAtomically("new", file, 0644).ok());
+  ASSERT_EQ(unlink((tmp + "/entry").c_str()), 0);
+  ASSERT_EQ(rmdir(tmp.c_str()), 0);
+
+  // a copy that fails part way drops its temp file
+  EXPECT_FALSE(CopyFile(temp_dir.path, file, 0444).ok());
+
+  auto content = std::string();
+  ASSERT_TRUE(base::ReadFileToString(file, &content));
+  EXPECT_EQ(content, "original");
+  struct stat st;
+  ASSERT_EQ(stat(file.c_str(), &st), 0);
+  EXPECT_EQ(st.st_mode & 07777, 0644);
+  EXPECT_EQ(lstat(tmp.c_str(), &st), -1);
+}
+
+TEST(aconfigd_capture, round_trip) {
+  auto temp_dir = base::TemporaryDir();
+  auto file = std::string(temp_dir.path) + "/requests.capture";
+  auto start_result = StartRequestCapture(file);
+  ASSERT_TRUE(start_result.ok()) << start_result.error();
+  ASSERT_TRUE(IsCapturingRequests());
+
+  // an empty frame, and one whose size takes a multi byte varint
+  auto frames = std::vector<std::string>{"abc", "", std::string(300, 'x')};
+  for (const auto& frame : frames) {
+    CaptureRequest(NowNs(), frame.data(), frame.size());
+  }
+
+  auto records = ReadRequestCapture(file);
+  ASSERT_TRUE(records.ok()) << records.error();
+  ASSERT_EQ(records->size(), frames.size());
+  for (size_t i = 0; i < frames.size(); i++) {
+    EXPECT_EQ((*records)[i].frame, frames[i]);
+    if (i > 0) {
+      EXPECT_GE((*records)[i].offset_ns, (*records)[i - 1].offset_ns);
+    }
+  }
+
+  // a record cut short by a crash, its size claims more bytes than follow
+  auto content = std::string();
+  ASSERT_TRUE(base::ReadFileToString(file, &content));
+  auto complete_size = content.size();
+  content += std::string("\x00\x64", 2) + std::string(10, 'y');
+  ASSERT_TRUE(base::WriteStringToFile(content, file));
+
+  records = ReadRequestCapture(file);
+  ASSERT_TRUE(records.ok()) << records.error();
+  ASSERT_EQ(records->size(), frames.size());
+  EXPECT_EQ(records->back().frame, frames.back());
+
+  // capturing again in the same boot drops the partial record and appends after
+  // the complete ones
+  start_result = StartRequestCapture(file);
+  ASSERT_TRUE(start_result.ok()) << start_result.error();
+  ASSERT_TRUE(base::ReadFileToString(file, &content));
+  EXPECT_EQ(content.size(), complete_size);
+  CaptureRequest(NowNs(), "def", 3);
+
+  records = ReadRequestCapture(file);
+  ASSERT_TRUE(records.ok()) << records.error();
+  ASSERT_EQ(records->size(), frames.size() + 1);
+  EXPECT_EQ(records->front().frame, frames.front());
+  EXPECT_EQ(records->back().frame, "def");
+}
+
+TEST(aconfigd_async_io, backends_agree) {
+  auto temp_dir = base::TemporaryDir();
+  auto dir = std::string(temp_dir.path);
+  auto rng = std::mt19937(50);
+  auto files = std::vector<std::string>();
+
+  // empty and short files, and files spanning many pages
+  for (size_t size : {0, 1, 7, 4096, 65537, 1 << 20}) {
+    auto content = std::string(size, '\0');
+    for (auto& c : content) {
+      c = static_cast<char>(rng());
+    }
+    auto file = dir + "/file_" + std::to_string(size);
+    ASSERT_TRUE(base::WriteStringToFile(content, file));
+    files.push_back(file);
+  }
+  auto num_files = files.size();
+
+  // symlinks are not followed, and missing files fail with ENOENT
+  auto link = dir + "/link";
+  ASSERT_EQ(symlink(files[1].c_str(), link.c_str()), 0);
+  files.push_back(link);
+  files.push_back(dir + "/missing");
+
+  auto ring_batch = DigestFiles(files, true);
+  auto thread_batch = DigestFiles(files, false);
+  EXPECT_EQ(thread_batch.backend, AsyncIoBackend::kThreadPool);
+  if (ring_batch.backend != AsyncIoBackend::kIoUring) {
+    GTEST_SKIP() << "io_uring is unavailable";
+  }
+  ASSERT_EQ(ring_batch.files.size(), files.size());
+  ASSERT_EQ(thread_batch.files.size(), files.size());
+
+  for (size_t i = 0; i < num_files; ++i) {
+    auto const& ring_file = ring_batch.files[i];
+    auto const& thread_file = thread_batch.files[i];
+    ASSERT_TRUE(ring_file.ok()) << ring_file.error();
+    ASSERT_TRUE(thread_file.ok()) << thread_file.error();
+    auto digest = GetFileDigest(files[i]);
+    ASSERT_TRUE(digest.ok()) << digest.error();
+    EXPECT_EQ(ring_file->digest, *digest) << files[i];
+    EXPECT_EQ(thread_file->digest, *digest) << files[i];
+    auto timestamp = GetFileTimeStamp(files[i]);
+    ASSERT_TRUE(timestamp.ok()) << timestamp.error();
+    EXPECT_EQ(ring_file->timestamp, *timestamp) << files[i];
+    EXPECT_EQ(thread_file->timestamp, *timestamp) << files[i];
+  }
+
+  for (auto const* batch : {&ring_batch, &thread_batch}) {
+    auto const& link_file = batch->files[num_files];
+    auto const& missing_file = batch->files[num_files + 1];
+    ASSERT_FALSE(link_file.ok()) << AsyncIoBackendName(batch->backend);
+    EXPECT_EQ(link_file.error().code(), ELOOP) << AsyncIoBackendName(batch->backend);
+    ASSERT_FALSE(missing_file.ok()) << AsyncIoBackendName(batch->backend);
+    EXPECT_EQ(missing_file.error().code(), ENOENT) << AsyncIoBackendName(batch->backend);
+  }
+}
+
 } // namespace aconfigd
 } // namespace android
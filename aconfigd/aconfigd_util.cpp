@@ -14,12 +14,16 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
 #include <android-base/file.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <fts.h>
 
@@ -50,6 +54,7 @@ Result<void> RemoveFilesInDir(const std::string& dir) {
       to_delete.emplace_back(std::string(node->fts_path));
     }
   }
+  fts_close(file_system);
 
   for (const auto& file : to_delete) {
     if (unlink(file.c_str()) == -1) {
@@ -60,37 +65,232 @@ Result<void> RemoveFilesInDir(const std::string& dir) {
   return {};
 }
 
-/// Copy file
-Result<void> CopyFile(const std::string& src, const std::string& dst, mode_t mode) {
+/// Get the name of a file copy method
+const char* CopyMethodName(CopyMethod method) {
+  switch (method) {
+    case CopyMethod::kReflink:
+      return "reflink";
+    case CopyMethod::kCopyFileRange:
+      return "copy_file_range";
+    case CopyMethod::kSendfile:
+      return "sendfile";
+  }
+  return "unknown";
+}
+
+namespace {
+
+/// Check if a failed reflink or copy_file_range call should fall back to a more
+/// generic copy method
+bool IsUnsupportedCopyError(int error) {
+  return error == EOPNOTSUPP || error == ENOTSUP || error == EXDEV
+      || error == EINVAL || error == ENOSYS || error == ENOTTY;
+}
+
+/// Copy len bytes from src_fd into the empty dst_fd, trying methods from cheapest on
+Result<CopyMethod> CopyContent(int src_fd, int dst_fd, off_t len, CopyMethod cheapest) {
+  // share the source extents if the file system supports copy on write
+  if (cheapest <= CopyMethod::kReflink) {
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+      return CopyMethod::kReflink;
+    } else if (!IsUnsupportedCopyError(errno)) {
+      return ErrnoError() << "ioctl(FICLONE) failed";
+    }
+  }
+
+  // in kernel copy, which may still share extents or offload the copy
+  off_t copied = 0;
+  while (cheapest <= CopyMethod::kCopyFileRange && copied < len) {
+    auto src_offset = static_cast<loff_t>(copied);
+    auto dst_offset = static_cast<loff_t>(copied);
+    auto num_bytes = copy_file_range(
+        src_fd, &src_offset, dst_fd, &dst_offset, len - copied, 0);
+    if (num_bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (copied == 0 && IsUnsupportedCopyError(errno)) {
+        break;
+      }
+      return ErrnoError() << "copy_file_range() failed";
+    }
+    if (num_bytes == 0) {
+      return Error() << "copy_file_range() hit unexpected end of file after "
+                     << copied << " of " << len << " bytes";
+    }
+    copied += num_bytes;
+  }
+  if (cheapest <= CopyMethod::kCopyFileRange && copied == len) {
+    return CopyMethod::kCopyFileRange;
+  }
+
+  // sendfile may transfer less than requested, keep going until done
+  off_t offset = 0;
+  while (offset < len) {
+    auto num_bytes = sendfile(dst_fd, src_fd, &offset, len - offset);
+    if (num_bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError() << "sendfile() failed";
+    }
+    if (num_bytes == 0) {
+      return Error() << "sendfile() hit unexpected end of file after "
+                     << offset << " of " << len << " bytes";
+    }
+  }
+  return CopyMethod::kSendfile;
+}
+
+} // namespace
+
+/// Sync a dir
+Result<void> SyncDir(const std::string& dir) {
+  android::base::unique_fd dir_fd(TEMP_FAILURE_RETRY(
+      open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+  if (dir_fd == -1) {
+    return ErrnoError() << "open() failed for " << dir;
+  }
+  if (fsync(dir_fd.get()) == -1) {
+    return ErrnoError() << "fsync() failed for " << dir;
+  }
+  return {};
+}
+
+/// Publish a temp file the caller filled in as file
+Result<void> FilePublisher::PublishTempFile(int fd,
+                                            const std::string& tmp_file,
+                                            const std::string& file) {
+  // the content has to be on disk before the rename is, or a crash can leave the
+  // renamed file empty
+  if (fdatasync(fd) == -1) {
+    unlink(tmp_file.c_str());
+    return ErrnoError() << "fdatasync() failed for " << tmp_file;
+  }
+
+  if (rename(tmp_file.c_str(), file.c_str()) == -1) {
+    unlink(tmp_file.c_str());
+    return ErrnoError() << "rename() failed for " << file;
+  }
+
+  auto pos = file.rfind('/');
+  auto dir = pos == std::string::npos ? std::string(".") : file.substr(0, pos);
+  if (std::find(dirs_.begin(), dirs_.end(), dir) == dirs_.end()) {
+    dirs_.push_back(dir);
+  }
+  return {};
+}
+
+/// Publish content as file
+Result<void> FilePublisher::WriteFile(const std::string& content,
+                                      const std::string& file,
+                                      mode_t mode) {
+  // a stale temp file can only be left behind by an interrupted write
+  auto tmp = file + ".tmp";
+  unlink(tmp.c_str());
+
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+      open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << tmp;
+  }
+
+  if (!android::base::WriteFully(fd.get(), content.data(), content.size())) {
+    unlink(tmp.c_str());
+    return ErrnoError() << "write() failed for " << tmp;
+  }
+
+  if (fchmod(fd.get(), mode) == -1) {
+    unlink(tmp.c_str());
+    return ErrnoError() << "fchmod() failed";
+  }
+
+  return PublishTempFile(fd.get(), tmp, file);
+}
+
+/// Publish a copy of src as dst
+Result<CopyMethod> FilePublisher::CopyFile(const std::string& src,
+                                           const std::string& dst,
+                                           mode_t mode,
+                                           CopyMethod cheapest) {
   android::base::unique_fd src_fd(
       TEMP_FAILURE_RETRY(open(src.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
   if (src_fd == -1) {
     return ErrnoError() << "open() failed for " << src;
   }
 
-  android::base::unique_fd dst_fd(TEMP_FAILURE_RETRY(
-      open(dst.c_str(), O_WRONLY | O_CREAT | O_NOFOLLOW | O_TRUNC | O_CLOEXEC, 0644)));
-  if (dst_fd == -1) {
-    return ErrnoError() << "open() failed for " << dst;
-  }
-
   struct stat st;
   if (fstat(src_fd.get(), &st) == -1) {
     return ErrnoError() << "fstat() failed";
   }
   auto len = st.st_size;
 
-  if (sendfile(dst_fd, src_fd, nullptr, len) == -1) {
-    return ErrnoError() << "sendfile() failed";
+  // a stale temp file can only be left behind by an interrupted copy
+  auto tmp = dst + ".tmp";
+  unlink(tmp.c_str());
+
+  android::base::unique_fd dst_fd(TEMP_FAILURE_RETRY(
+      open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)));
+  if (dst_fd == -1) {
+    return ErrnoError() << "open() failed for " << tmp;
+  }
+
+  auto copy_result = CopyContent(src_fd.get(), dst_fd.get(), len, cheapest);
+  if (!copy_result.ok()) {
+    unlink(tmp.c_str());
+    return Error() << "Failed to copy " << src << ": " << copy_result.error();
+  }
+
+  if (fchmod(dst_fd.get(), mode) == -1) {
+    unlink(tmp.c_str());
+    return ErrnoError() << "fchmod() failed";
   }
 
-  if (chmod(dst.c_str(), mode) == -1) {
-    return ErrnoError() << "chmod() failed";
+  auto publish_result = PublishTempFile(dst_fd.get(), tmp, dst);
+  if (!publish_result.ok()) {
+    return Error() << publish_result.error();
   }
+  return *copy_result;
+}
 
+/// Sync the dirs of the files published so far
+Result<void> FilePublisher::Commit() {
+  for (auto const& dir : dirs_) {
+    auto sync_result = SyncDir(dir);
+    if (!sync_result.ok()) {
+      return Error() << sync_result.error();
+    }
+  }
+  dirs_.clear();
   return {};
 }
 
+/// Publish content as file on its own
+Result<void> WriteFileAtomically(const std::string& content,
+                                 const std::string& file,
+                                 mode_t mode) {
+  auto publisher = FilePublisher();
+  auto write_result = publisher.WriteFile(content, file, mode);
+  if (!write_result.ok()) {
+    return Error() << write_result.error();
+  }
+  return publisher.Commit();
+}
+
+/// Copy file, published on its own
+Result<CopyMethod> CopyFile(const std::string& src, const std::string& dst, mode_t mode) {
+  auto publisher = FilePublisher();
+  auto copy_result = publisher.CopyFile(src, dst, mode);
+  if (!copy_result.ok()) {
+    return Error() << copy_result.error();
+  }
+  auto commit_result = publisher.Commit();
+  if (!commit_result.ok()) {
+    return Error() << commit_result.error();
+  }
+  return *copy_result;
+}
+
 /// Get a file's timestamp
 Result<int> GetFileTimeStamp(const std::string& file) {
   struct stat st;
@@ -101,6 +301,132 @@ Result<int> GetFileTimeStamp(const std::string& file) {
   return static_cast<int>(st.st_mtim.tv_sec);
 }
 
+namespace {
+
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t RotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t Load64(const uint8_t* ptr) {
+  uint64_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline uint32_t Load32(const uint8_t* ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline uint64_t Round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  acc = RotateLeft(acc, 31);
+  return acc * kPrime1;
+}
+
+inline uint64_t MergeRound(uint64_t acc, uint64_t lane) {
+  acc ^= Round(0, lane);
+  return acc * kPrime1 + kPrime4;
+}
+
+/// XXH64 style hash. The bulk of the input is consumed in 32 byte stripes by four
+/// independent lanes, which the compiler can keep in vector registers.
+uint64_t HashBytes(const uint8_t* data, size_t len) {
+  const uint8_t* ptr = data;
+  const uint8_t* end = data + len;
+  uint64_t hash;
+
+  if (len >= 32) {
+    uint64_t lanes[4] = {kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1};
+    const uint8_t* limit = end - 32;
+    do {
+      for (int i = 0; i < 4; i++) {
+        lanes[i] = Round(lanes[i], Load64(ptr + 8 * i));
+      }
+      ptr += 32;
+    } while (ptr <= limit);
+
+    hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) +
+           RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18);
+    for (int i = 0; i < 4; i++) {
+      hash = MergeRound(hash, lanes[i]);
+    }
+  } else {
+    hash = kPrime5;
+  }
+
+  hash += static_cast<uint64_t>(len);
+
+  for (; ptr + 8 <= end; ptr += 8) {
+    hash ^= Round(0, Load64(ptr));
+    hash = RotateLeft(hash, 27) * kPrime1 + kPrime4;
+  }
+
+  if (ptr + 4 <= end) {
+    hash ^= static_cast<uint64_t>(Load32(ptr)) * kPrime1;
+    hash = RotateLeft(hash, 23) * kPrime2 + kPrime3;
+    ptr += 4;
+  }
+
+  for (; ptr < end; ptr++) {
+    hash ^= (*ptr) * kPrime5;
+    hash = RotateLeft(hash, 11) * kPrime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+} // namespace
+
+/// Get a 64 bit digest of the first size bytes of an open file
+Result<uint64_t> GetFdDigest(int fd, size_t size) {
+  if (size == 0) {
+    return HashBytes(nullptr, 0);
+  }
+
+  void* map_ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map_ptr == MAP_FAILED) {
+    return ErrnoError() << "mmap() failed";
+  }
+  madvise(map_ptr, size, MADV_SEQUENTIAL);
+
+  auto digest = HashBytes(static_cast<const uint8_t*>(map_ptr), size);
+  munmap(map_ptr, size);
+  return digest;
+}
+
+/// Get a 64 bit digest of a file's content
+Result<uint64_t> GetFileDigest(const std::string& file) {
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(file.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << file;
+  }
+
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1) {
+    return ErrnoError() << "fstat() failed for " << file;
+  }
+
+  auto digest = GetFdDigest(fd.get(), static_cast<size_t>(st.st_size));
+  if (!digest.ok()) {
+    return Error() << "Failed to digest " << file << ": " << digest.error();
+  }
+  return *digest;
+}
+
 bool FileExists(const std::string& file) {
   struct stat st;
   return stat(file.c_str(), &st) == 0 ? true : false;
@@ -15,6 +15,7 @@
  */
 
 #include <string>
+#include <vector>
 #include <android-base/result.h>
 #include <sys/stat.h>
 
@@ -24,12 +25,68 @@ namespace android {
   /// Remove files in a dir
   base::Result<void> RemoveFilesInDir(const std::string& dir);
 
-  /// Copy file
-  base::Result<void> CopyFile(const std::string& src, const std::string& dst, mode_t mode);
+  /// File copy methods, from the cheapest to the most expensive
+  enum class CopyMethod {
+    kReflink,
+    kCopyFileRange,
+    kSendfile,
+  };
+
+  /// Get the name of a file copy method
+  const char* CopyMethodName(CopyMethod method);
+
+  /// Publishes files so that a crash leaves either the previous or the new content of
+  /// each, never a torn file. Content is written to a temp file, which is synced and
+  /// renamed over the target. The dirs of renamed files are only synced by Commit, so
+  /// a batch of files in one dir costs a single dir sync.
+  class FilePublisher {
+   public:
+    /// Publish content as file
+    base::Result<void> WriteFile(const std::string& content, const std::string& file,
+                                 mode_t mode);
+
+    /// Publish a copy of src as dst. Copy methods are tried from cheapest on, returns
+    /// the method used to copy the content.
+    base::Result<CopyMethod> CopyFile(const std::string& src, const std::string& dst,
+                                      mode_t mode,
+                                      CopyMethod cheapest = CopyMethod::kReflink);
+
+    /// Publish a temp file the caller filled in through fd as file. The temp file is
+    /// removed if it cannot be published.
+    base::Result<void> PublishTempFile(int fd, const std::string& tmp_file,
+                                       const std::string& file);
+
+    /// Sync the dirs of the files published so far, in the order they were first
+    /// published to. Files are durable once this returns.
+    base::Result<void> Commit();
+
+   private:
+    std::vector<std::string> dirs_;
+  };
+
+  /// Publish content as file on its own, see FilePublisher
+  base::Result<void> WriteFileAtomically(const std::string& content,
+                                         const std::string& file,
+                                         mode_t mode);
+
+  /// Copy file, published on its own, see FilePublisher. Returns the method used to
+  /// copy the content.
+  base::Result<CopyMethod> CopyFile(const std::string& src, const std::string& dst,
+                                    mode_t mode);
+
+  /// Sync a dir, so that files created in or renamed into it are durable
+  base::Result<void> SyncDir(const std::string& dir);
 
   /// Get a file's timestamp
   base::Result<int> GetFileTimeStamp(const std::string& file);
 
+  /// Get a 64 bit digest of a file's content
+  base::Result<uint64_t> GetFileDigest(const std::string& file);
+
+  /// Get a 64 bit digest of the first size bytes of an open file, the same as
+  /// GetFileDigest of a file holding them. The file is read through a mapping.
+  base::Result<uint64_t> GetFdDigest(int fd, size_t size);
+
   /// Check if file exists
   bool FileExists(const std::string& file);
 
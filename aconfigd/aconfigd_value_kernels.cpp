@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "aconfigd_value_kernels.h"
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Bytes compared per step
+constexpr size_t kBlockSize = 64;
+
+/// Append differing byte indices of a range, one byte at a time
+void FindDifferingBytesScalar(const uint8_t* lhs,
+                              const uint8_t* rhs,
+                              size_t begin,
+                              size_t end,
+                              std::vector<uint32_t>* diffs) {
+  for (size_t i = begin; i < end; ++i) {
+    if (lhs[i] != rhs[i]) {
+      diffs->push_back(static_cast<uint32_t>(i));
+    }
+  }
+}
+
+#if defined(__SSE2__)
+
+/// Get a bit mask of the bytes that differ in a 16 byte lane
+uint32_t DiffMask16(const uint8_t* lhs, const uint8_t* rhs) {
+  auto eq = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs)),
+                           _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs)));
+  return ~static_cast<uint32_t>(_mm_movemask_epi8(eq)) & 0xFFFF;
+}
+
+/// Get a bit mask of the bytes that differ in a block
+uint64_t DiffMask(const uint8_t* lhs, const uint8_t* rhs) {
+  return static_cast<uint64_t>(DiffMask16(lhs, rhs))
+      | static_cast<uint64_t>(DiffMask16(lhs + 16, rhs + 16)) << 16
+      | static_cast<uint64_t>(DiffMask16(lhs + 32, rhs + 32)) << 32
+      | static_cast<uint64_t>(DiffMask16(lhs + 48, rhs + 48)) << 48;
+}
+
+#elif defined(__aarch64__)
+
+/// Get a bit mask of the bytes that differ in a block. Blocks that match, the common
+/// case, are rejected with a single horizontal reduction.
+uint64_t DiffMask(const uint8_t* lhs, const uint8_t* rhs) {
+  auto ne0 = veorq_u8(vld1q_u8(lhs), vld1q_u8(rhs));
+  auto ne1 = veorq_u8(vld1q_u8(lhs + 16), vld1q_u8(rhs + 16));
+  auto ne2 = veorq_u8(vld1q_u8(lhs + 32), vld1q_u8(rhs + 32));
+  auto ne3 = veorq_u8(vld1q_u8(lhs + 48), vld1q_u8(rhs + 48));
+  if (vmaxvq_u8(vorrq_u8(vorrq_u8(ne0, ne1), vorrq_u8(ne2, ne3))) == 0) {
+    return 0;
+  }
+
+  uint64_t mask = 0;
+  for (size_t i = 0; i < kBlockSize; ++i) {
+    mask |= static_cast<uint64_t>(lhs[i] != rhs[i]) << i;
+  }
+  return mask;
+}
+
+#else
+
+/// Get a bit mask of the bytes that differ in a block, comparing 8 bytes at a time
+uint64_t DiffMask(const uint8_t* lhs, const uint8_t* rhs) {
+  uint64_t mask = 0;
+  for (size_t word = 0; word < kBlockSize; word += sizeof(uint64_t)) {
+    uint64_t lhs_word, rhs_word;
+    memcpy(&lhs_word, lhs + word, sizeof(lhs_word));
+    memcpy(&rhs_word, rhs + word, sizeof(rhs_word));
+    if (lhs_word == rhs_word) {
+      continue;
+    }
+    for (size_t i = word; i < word + sizeof(uint64_t); ++i) {
+      mask |= static_cast<uint64_t>(lhs[i] != rhs[i]) << i;
+    }
+  }
+  return mask;
+}
+
+#endif
+
+} // namespace
+
+/// Append the indices of bytes that differ between two flag value arrays
+void FindDifferingBytes(const uint8_t* lhs,
+                        const uint8_t* rhs,
+                        size_t size,
+                        std::vector<uint32_t>* diffs) {
+  size_t block = 0;
+  for (; block + kBlockSize <= size; block += kBlockSize) {
+    auto mask = DiffMask(lhs + block, rhs + block);
+    while (mask != 0) {
+      diffs->push_back(static_cast<uint32_t>(block + __builtin_ctzll(mask)));
+      mask &= mask - 1;
+    }
+  }
+  FindDifferingBytesScalar(lhs, rhs, block, size, diffs);
+}
+
+/// Pack a byte per value flag value array into bits
+void PackBits(const uint8_t* values, size_t size, uint64_t* words) {
+  size_t block = 0;
+  for (; block + kBlockSize <= size; block += kBlockSize) {
+#if defined(__SSE2__)
+    auto zero = _mm_setzero_si128();
+    uint64_t word = 0;
+    for (size_t lane = 0; lane < kBlockSize; lane += 16) {
+      auto is_zero = _mm_cmpeq_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + block + lane)), zero);
+      word |= static_cast<uint64_t>(~_mm_movemask_epi8(is_zero) & 0xFFFF) << lane;
+    }
+    words[block / 64] = word;
+#else
+    uint64_t word = 0;
+    for (size_t i = 0; i < kBlockSize; ++i) {
+      word |= static_cast<uint64_t>(values[block + i] != 0) << i;
+    }
+    words[block / 64] = word;
+#endif
+  }
+
+  if (block < size) {
+    uint64_t word = 0;
+    for (size_t i = block; i < size; ++i) {
+      word |= static_cast<uint64_t>(values[i] != 0) << (i - block);
+    }
+    words[block / 64] = word;
+  }
+}
+
+/// Copy bits [begin, end) of bit packed values into out
+void ExtractBits(const uint64_t* words, size_t begin, size_t end, uint64_t* out) {
+  auto num_bits = end - begin;
+  auto num_words = NumBitWords(num_bits);
+  auto first = begin / 64;
+  auto shift = begin % 64;
+  for (size_t i = 0; i < num_words; ++i) {
+    uint64_t word = words[first + i] >> shift;
+    // the high bits come from the next word, unless it lies past end
+    if (shift != 0 && (first + i + 1) * 64 < end) {
+      word |= words[first + i + 1] << (64 - shift);
+    }
+    out[i] = word;
+  }
+  if (num_bits % 64 != 0) {
+    out[num_words - 1] &= (uint64_t(1) << (num_bits % 64)) - 1;
+  }
+}
+
+/// Count the set bits of bit packed values
+uint32_t CountSetBits(const uint64_t* words, size_t num_bits) {
+  uint32_t count = 0;
+  for (size_t i = 0; i < num_bits / 64; ++i) {
+    count += __builtin_popcountll(words[i]);
+  }
+  if (num_bits % 64 != 0) {
+    count += __builtin_popcountll(
+        words[num_bits / 64] & ((uint64_t(1) << (num_bits % 64)) - 1));
+  }
+  return count;
+}
+
+/// Append the indices of the set bits of bit packed values
+void FindSetBits(const uint64_t* words, size_t num_bits, std::vector<uint32_t>* indices) {
+  auto num_words = NumBitWords(num_bits);
+  for (size_t i = 0; i < num_words; ++i) {
+    auto word = words[i];
+    if (i == num_words - 1 && num_bits % 64 != 0) {
+      word &= (uint64_t(1) << (num_bits % 64)) - 1;
+    }
+    while (word != 0) {
+      indices->push_back(static_cast<uint32_t>(i * 64 + __builtin_ctzll(word)));
+      word &= word - 1;
+    }
+  }
+}
+
+} // namespace aconfigd
+} // namespace android
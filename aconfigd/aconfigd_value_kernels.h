@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Append the indices of bytes that differ between two flag value arrays to diffs,
+    /// in increasing order. Compares 64 bytes per step with SSE2 or NEON where
+    /// available, so arrays that mostly match are scanned at memory speed.
+    void FindDifferingBytes(const uint8_t* lhs,
+                            const uint8_t* rhs,
+                            size_t size,
+                            std::vector<uint32_t>* diffs);
+
+    /// Number of 64 bit words holding num_bits bit packed values
+    inline size_t NumBitWords(size_t num_bits) {
+      return (num_bits + 63) / 64;
+    }
+
+    /// Pack a byte per value flag value array into bits, bit i % 64 of word i / 64 is
+    /// set if value i is non zero. words must hold NumBitWords(size) words, bits past
+    /// size are cleared.
+    void PackBits(const uint8_t* values, size_t size, uint64_t* words);
+
+    /// Copy bits [begin, end) of bit packed values into out, so bit 0 of out is bit
+    /// begin. out must hold NumBitWords(end - begin) words, bits past end are cleared.
+    void ExtractBits(const uint64_t* words, size_t begin, size_t end, uint64_t* out);
+
+    /// Count the set bits of num_bits bit packed values
+    uint32_t CountSetBits(const uint64_t* words, size_t num_bits);
+
+    /// Append the indices of the set bits of num_bits bit packed values to indices, in
+    /// increasing order
+    void FindSetBits(const uint64_t* words, size_t num_bits, std::vector<uint32_t>* indices);
+
+  } // namespace aconfigd
+} // namespace android
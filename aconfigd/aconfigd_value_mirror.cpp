@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "aconfigd_value_kernels.h"
+#include "aconfigd_value_mirror.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Bit packed value mirrors keyed by container, guarded by mirrors_mutex
+static std::unordered_map<std::string, ValueBits> value_mirrors;
+static std::shared_mutex mirrors_mutex;
+
+} // namespace
+
+/// Replace the bit packed mirror of the boolean flag values of a container
+void SetValueMirror(const std::string& container,
+                    const uint8_t* values,
+                    uint32_t num_flags) {
+  auto mirror = ValueBits();
+  mirror.words.resize(NumBitWords(num_flags));
+  mirror.num_flags = num_flags;
+  PackBits(values, num_flags, mirror.words.data());
+
+  auto lock = std::unique_lock(mirrors_mutex);
+  value_mirrors[container] = std::move(mirror);
+}
+
+/// Set a boolean flag value in the mirror of a container
+void UpdateValueMirror(const std::string& container, uint32_t index, bool value) {
+  auto lock = std::unique_lock(mirrors_mutex);
+  auto it = value_mirrors.find(container);
+  if (it == value_mirrors.end() || index >= it->second.num_flags) {
+    return;
+  }
+  auto& word = it->second.words[index / 64];
+  auto bit = uint64_t(1) << (index % 64);
+  word = value ? word | bit : word & ~bit;
+}
+
+/// Check if a container has a mirror
+bool HasValueMirror(const std::string& container) {
+  auto lock = std::shared_lock(mirrors_mutex);
+  return value_mirrors.count(container) != 0;
+}
+
+/// Copy flag values of a container out of its mirror
+Result<ValueBits> ReadValueMirror(const std::string& container,
+                                  uint32_t begin,
+                                  uint32_t end) {
+  auto lock = std::shared_lock(mirrors_mutex);
+  auto it = value_mirrors.find(container);
+  if (it == value_mirrors.end()) {
+    return Error() << "Missing flag value mirror of " << container;
+  }
+
+  auto const& mirror = it->second;
+  end = std::min(end, mirror.num_flags);
+  if (begin > end) {
+    return Error() << "Flag value index " << begin << " is out of range for "
+                   << container;
+  }
+
+  auto bits = ValueBits();
+  bits.num_flags = end - begin;
+  bits.words.resize(NumBitWords(bits.num_flags));
+  if (bits.num_flags > 0) {
+    ExtractBits(mirror.words.data(), begin, end, bits.words.data());
+  }
+  return bits;
+}
+
+} // namespace aconfigd
+} // namespace android
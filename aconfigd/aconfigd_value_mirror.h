@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Bit packed boolean flag values, bit i % 64 of words[i / 64] is value i
+    struct ValueBits {
+      std::vector<uint64_t> words;
+      uint32_t num_flags = 0;
+
+      bool Get(uint32_t index) const {
+        return (words[index / 64] >> (index % 64)) & 1;
+      }
+    };
+
+    /// Replace the bit packed mirror of the boolean flag values of a container
+    void SetValueMirror(const std::string& container,
+                        const uint8_t* values,
+                        uint32_t num_flags);
+
+    /// Set a boolean flag value in the mirror of a container, if it has one
+    void UpdateValueMirror(const std::string& container, uint32_t index, bool value);
+
+    /// Check if a container has a mirror
+    bool HasValueMirror(const std::string& container);
+
+    /// Copy flag values [begin, end) of a container out of its mirror, bit 0 of the
+    /// result is value begin. end is clamped to the number of flags.
+    base::Result<ValueBits> ReadValueMirror(const std::string& container,
+                                            uint32_t begin,
+                                            uint32_t end);
+
+  } // namespace aconfigd
+} // namespace android
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <new>
+#include <unordered_map>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+#include "aconfigd/value_snapshot.h"
+#include "aconfigd_config.h"
+#include "aconfigd_storage_file.h"
+#include "aconfigd_util.h"
+#include "aconfigd_value_mirror.h"
+#include "aconfigd_value_snapshot.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// A value snapshot mapped for writing
+struct WritableValueSnapshot {
+  void* map_ptr = nullptr;
+  size_t map_size = 0;
+
+  ValueSnapshotHeader* header() const {
+    return static_cast<ValueSnapshotHeader*>(map_ptr);
+  }
+
+  uint8_t* values() const {
+    return static_cast<uint8_t*>(map_ptr) + header()->values_offset;
+  }
+};
+
+/// Value snapshots mapped by aconfigd, keyed by container. aconfigd is the only writer.
+static std::unordered_map<std::string, WritableValueSnapshot> value_snapshots;
+
+/// Map an existing value snapshot file for writing
+Result<WritableValueSnapshot> MapWritableValueSnapshot(const std::string& file) {
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(file.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << file;
+  }
+
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1) {
+    return ErrnoError() << "fstat() failed for " << file;
+  }
+
+  auto size = static_cast<size_t>(st.st_size);
+  if (size < kValueSnapshotValuesOffset) {
+    return Error() << file << " is too small to be a value snapshot";
+  }
+
+  void* map_ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+  if (map_ptr == MAP_FAILED) {
+    return ErrnoError() << "mmap() failed for " << file;
+  }
+
+  auto snapshot = WritableValueSnapshot();
+  snapshot.map_ptr = map_ptr;
+  snapshot.map_size = size;
+  auto* header = snapshot.header();
+  if (header->magic != kValueSnapshotMagic || header->version != kValueSnapshotVersion
+      || header->values_offset != kValueSnapshotValuesOffset
+      || static_cast<size_t>(header->values_offset) + header->num_flags > size
+      || header->sequence.load(std::memory_order_relaxed) == kValueSnapshotRetired) {
+    munmap(map_ptr, size);
+    return Error() << file << " is not a valid value snapshot";
+  }
+
+  // a crash in the middle of an update leaves the sequence odd
+  auto sequence = header->sequence.load(std::memory_order_relaxed);
+  if (sequence & 1) {
+    header->sequence.store(sequence + 1, std::memory_order_release);
+  }
+
+  return snapshot;
+}
+
+/// Get the value snapshot of a container mapped for writing
+Result<WritableValueSnapshot*> GetWritableValueSnapshot(const std::string& container) {
+  auto it = value_snapshots.find(container);
+  if (it != value_snapshots.end()) {
+    return &it->second;
+  }
+
+  auto snapshot = MapWritableValueSnapshot(
+      GetValueSnapshotFile(container, GetConfig().storage_root));
+  if (!snapshot.ok()) {
+    return Error() << snapshot.error();
+  }
+  return &(value_snapshots[container] = *snapshot);
+}
+
+/// Seqlock write section, readers retry while it is active
+class ScopedValueSnapshotWrite {
+ public:
+  explicit ScopedValueSnapshotWrite(ValueSnapshotHeader* header) : header_(header) {
+    sequence_ = header_->sequence.load(std::memory_order_relaxed);
+    header_->sequence.store(sequence_ + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  ~ScopedValueSnapshotWrite() {
+    header_->sequence.store(sequence_ + 2, std::memory_order_release);
+  }
+
+ private:
+  ValueSnapshotHeader* header_;
+  uint64_t sequence_;
+};
+
+/// Create a new value snapshot file from flag values and map it for writing. The
+/// sequence continues from the snapshot being replaced, so generations never go back.
+Result<WritableValueSnapshot> CreateValueSnapshot(const std::string& file,
+                                                  const uint8_t* values,
+                                                  uint32_t num_flags,
+                                                  uint64_t package_map_digest,
+                                                  uint64_t flag_map_digest,
+                                                  uint64_t sequence) {
+  auto tmp_file = file + ".tmp";
+  unlink(tmp_file.c_str());
+
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(
+      tmp_file.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << tmp_file;
+  }
+
+  auto size = static_cast<size_t>(kValueSnapshotValuesOffset) + num_flags;
+  if (ftruncate(fd.get(), size) == -1) {
+    unlink(tmp_file.c_str());
+    return ErrnoError() << "ftruncate() failed for " << tmp_file;
+  }
+
+  if (fchmod(fd.get(), 0644) == -1) {
+    unlink(tmp_file.c_str());
+    return ErrnoError() << "fchmod() failed for " << tmp_file;
+  }
+
+  void* map_ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+  if (map_ptr == MAP_FAILED) {
+    unlink(tmp_file.c_str());
+    return ErrnoError() << "mmap() failed for " << tmp_file;
+  }
+
+  auto snapshot = WritableValueSnapshot();
+  snapshot.map_ptr = map_ptr;
+  snapshot.map_size = size;
+  auto* header = new (map_ptr) ValueSnapshotHeader();
+  header->magic = kValueSnapshotMagic;
+  header->version = kValueSnapshotVersion;
+  header->sequence.store(sequence, std::memory_order_relaxed);
+  header->num_flags = num_flags;
+  header->values_offset = kValueSnapshotValuesOffset;
+  header->package_map_digest = package_map_digest;
+  header->flag_map_digest = flag_map_digest;
+  memcpy(snapshot.values(), values, num_flags);
+
+  // the values are synced before the snapshot replaces the previous one, so a crash
+  // never leaves a zeroed snapshot behind
+  auto publisher = FilePublisher();
+  auto publish_result = publisher.PublishTempFile(fd.get(), tmp_file, file);
+  if (!publish_result.ok()) {
+    munmap(map_ptr, size);
+    return Error() << publish_result.error();
+  }
+
+  // the snapshot is in place and complete either way, it just may not survive a crash
+  auto commit_result = publisher.Commit();
+  if (!commit_result.ok()) {
+    LOG(WARNING) << "Failed to sync value snapshot dir: " << commit_result.error();
+  }
+
+  return snapshot;
+}
+
+} // namespace
+
+/// Publish the boolean values of a flag value file as the value snapshot of a container
+Result<void> PublishValueSnapshot(const std::string& container,
+                                  const std::string& flag_val_file,
+                                  uint64_t package_map_digest,
+                                  uint64_t flag_map_digest) {
+  auto mapped_file = MapStorageFileAt(flag_val_file);
+  if (!mapped_file.ok()) {
+    return Error() << mapped_file.error();
+  }
+  auto& flag_val = *mapped_file;
+
+  auto header = ParseFlagValueHeader(flag_val);
+  if (!header.ok()) {
+    UnmapStorageFile(flag_val);
+    return Error() << header.error();
+  }
+  auto* values = static_cast<const uint8_t*>(flag_val.file_ptr)
+      + header->boolean_value_offset;
+  SetValueMirror(container, values, header->num_flags);
+
+  // update the existing snapshot in place if the layout is unchanged, so readers keep
+  // their mapping. Flags may move within a value array of the same size, readers
+  // only resolve indices again once the snapshot is retired.
+  auto existing = GetWritableValueSnapshot(container);
+  if (existing.ok() && package_map_digest != 0 && flag_map_digest != 0) {
+    auto* existing_header = (*existing)->header();
+    if (existing_header->num_flags == header->num_flags
+        && existing_header->package_map_digest == package_map_digest
+        && existing_header->flag_map_digest == flag_map_digest) {
+      // unchanged values keep the generation
+      if (memcmp((*existing)->values(), values, header->num_flags) != 0) {
+        auto write = ScopedValueSnapshotWrite(existing_header);
+        memcpy((*existing)->values(), values, header->num_flags);
+      }
+      UnmapStorageFile(flag_val);
+      return {};
+    }
+  }
+
+  uint64_t sequence = existing.ok()
+      ? (*existing)->header()->sequence.load(std::memory_order_relaxed) + 2 : 0;
+  auto snapshot = CreateValueSnapshot(
+      GetValueSnapshotFile(container, GetConfig().storage_root), values,
+      header->num_flags, package_map_digest, flag_map_digest, sequence);
+  UnmapStorageFile(flag_val);
+  if (!snapshot.ok()) {
+    return Error() << "Failed to create value snapshot for " << container << ": "
+                   << snapshot.error();
+  }
+
+  // tell readers of the replaced snapshot to map the new file
+  if (existing.ok()) {
+    (*existing)->header()->sequence.store(kValueSnapshotRetired, std::memory_order_release);
+    munmap((*existing)->map_ptr, (*existing)->map_size);
+  }
+  value_snapshots[container] = *snapshot;
+
+  return {};
+}
+
+/// Set a boolean flag value in the published value snapshot of a container
+Result<void> UpdateValueSnapshot(const std::string& container,
+                                 uint32_t index,
+                                 bool value) {
+  auto snapshot = GetWritableValueSnapshot(container);
+  if (!snapshot.ok()) {
+    return Error() << snapshot.error();
+  }
+
+  auto* header = (*snapshot)->header();
+  if (index >= header->num_flags) {
+    return Error() << "Flag value index " << index << " is out of range for "
+                   << container;
+  }
+
+  auto write = ScopedValueSnapshotWrite(header);
+  __atomic_store_n(&(*snapshot)->values()[index], value ? 1 : 0, __ATOMIC_RELAXED);
+  return {};
+}
+
+/// Get the current flag value generation of a container
+Result<uint64_t> GetValueSnapshotGeneration(const std::string& container) {
+  auto snapshot = GetWritableValueSnapshot(container);
+  if (!snapshot.ok()) {
+    return Error() << snapshot.error();
+  }
+  return (*snapshot)->header()->sequence.load(std::memory_order_relaxed) / 2;
+}
+
+} // namespace aconfigd
+} // namespace android
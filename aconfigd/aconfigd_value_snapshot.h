@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <android-base/result.h>
+
+namespace android {
+  namespace aconfigd {
+
+    /// Publish the boolean values of a flag value file as the value snapshot of a
+    /// container, laid out by the package and flag maps with the given digests. An
+    /// existing snapshot with the same layout is updated in place, otherwise a new
+    /// snapshot file replaces it and the old one is marked as retired. A zero digest
+    /// means the layout is unknown and always replaces the snapshot.
+    base::Result<void> PublishValueSnapshot(const std::string& container,
+                                            const std::string& flag_val_file,
+                                            uint64_t package_map_digest,
+                                            uint64_t flag_map_digest);
+
+    /// Set a boolean flag value in the published value snapshot of a container
+    base::Result<void> UpdateValueSnapshot(const std::string& container,
+                                           uint32_t index,
+                                           bool value);
+
+    /// Get the current flag value generation of a container, it moves forward with
+    /// every change to the container's value snapshot
+    base::Result<uint64_t> GetValueSnapshotGeneration(const std::string& container);
+
+  } // namespace aconfigd
+} // namespace android
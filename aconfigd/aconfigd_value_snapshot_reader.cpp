@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <android-base/unique_fd.h>
+#include <aconfig_storage/aconfig_storage_read_api.hpp>
+
+#include "aconfigd/value_snapshot.h"
+
+using ::android::base::Result;
+using ::android::base::Error;
+using ::android::base::ErrnoError;
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Number of attempts to read a consistent snapshot before giving up
+constexpr int kMaxReadAttempts = 1 << 16;
+
+/// Number of times a retired snapshot is mapped again before giving up
+constexpr int kMaxRemapAttempts = 4;
+
+/// Unmap a package or flag map mapped by the storage read api
+void UnmapStorageMap(std::unique_ptr<aconfig_storage::MappedStorageFile>& map) {
+  if (map) {
+    munmap(map->file_ptr, map->file_size);
+    map.reset();
+  }
+}
+
+} // namespace
+
+ValueSnapshotReader::ValueSnapshotReader(const std::string& container,
+                                         const std::string& storage_root)
+    : container_(container)
+    , storage_root_(storage_root)
+{}
+
+ValueSnapshotReader::~ValueSnapshotReader() {
+  Unmap();
+}
+
+/// Map the value snapshot of a container
+Result<std::unique_ptr<ValueSnapshotReader>> ValueSnapshotReader::Open(
+    const std::string& container, const std::string& storage_root) {
+  auto reader = std::unique_ptr<ValueSnapshotReader>(
+      new ValueSnapshotReader(container, storage_root));
+  auto map_result = reader->Map();
+  if (!map_result.ok()) {
+    return Error() << map_result.error();
+  }
+  return reader;
+}
+
+Result<void> ValueSnapshotReader::Map() {
+  auto file = GetValueSnapshotFile(container_, storage_root_);
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(file.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+  if (fd == -1) {
+    return ErrnoError() << "open() failed for " << file;
+  }
+
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1) {
+    return ErrnoError() << "fstat() failed for " << file;
+  }
+
+  auto size = static_cast<size_t>(st.st_size);
+  if (size < kValueSnapshotValuesOffset) {
+    return Error() << file << " is too small to be a value snapshot";
+  }
+
+  void* map_ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+  if (map_ptr == MAP_FAILED) {
+    return ErrnoError() << "mmap() failed for " << file;
+  }
+
+  auto* header = static_cast<const ValueSnapshotHeader*>(map_ptr);
+  if (header->magic != kValueSnapshotMagic || header->version != kValueSnapshotVersion
+      || header->values_offset < sizeof(ValueSnapshotHeader)
+      || static_cast<size_t>(header->values_offset) + header->num_flags > size) {
+    munmap(map_ptr, size);
+    return Error() << file << " is not a valid value snapshot";
+  }
+
+  // a replacement snapshot may lay the container out differently, flag indices
+  // resolved against the previous one no longer apply
+  Unmap();
+  map_ptr_ = map_ptr;
+  map_size_ = size;
+  map_count_++;
+  index_cache_.clear();
+  return {};
+}
+
+void ValueSnapshotReader::Unmap() {
+  if (map_ptr_) {
+    munmap(map_ptr_, map_size_);
+    map_ptr_ = nullptr;
+    map_size_ = 0;
+  }
+  UnmapStorageMap(package_map_);
+  UnmapStorageMap(flag_map_);
+}
+
+/// Map the package and flag maps the current snapshot is laid out by
+Result<void> ValueSnapshotReader::MapStorageMaps() {
+  if (package_map_ && flag_map_) {
+    return {};
+  }
+
+  // the persistent records hold the maps the current snapshot was published from, boot
+  // records keep the maps of the boot snapshot until the next reboot
+  auto records_file = storage_root_ + "/persistent_storage_file_records.pb";
+  auto package_map = aconfig_storage::private_internal_api::get_mapped_file_impl(
+      records_file, container_, aconfig_storage::StorageFileType::package_map);
+  if (!package_map.ok()) {
+    return Error() << "Failed to map package map file for " << container_
+                   << ": " << package_map.error();
+  }
+  package_map_ = std::make_unique<aconfig_storage::MappedStorageFile>(*package_map);
+
+  auto flag_map = aconfig_storage::private_internal_api::get_mapped_file_impl(
+      records_file, container_, aconfig_storage::StorageFileType::flag_map);
+  if (!flag_map.ok()) {
+    UnmapStorageMap(package_map_);
+    return Error() << "Failed to map flag map file for " << container_
+                   << ": " << flag_map.error();
+  }
+  flag_map_ = std::make_unique<aconfig_storage::MappedStorageFile>(*flag_map);
+  return {};
+}
+
+/// Find the boolean flag value index of a flag, the index is cached
+Result<uint32_t> ValueSnapshotReader::GetBooleanFlagIndex(const std::string& package,
+                                                          const std::string& flag) {
+  auto key = package + "/" + flag;
+  auto it = index_cache_.find(key);
+  if (it != index_cache_.end()) {
+    return it->second;
+  }
+
+  auto map_result = MapStorageMaps();
+  if (!map_result.ok()) {
+    return Error() << map_result.error();
+  }
+
+  auto package_context = aconfig_storage::get_package_read_context(*package_map_, package);
+  if (!package_context.ok()) {
+    return Error() << "Failed to get package offset of " << package
+                   << " in " << container_ << " :" << package_context.error();
+  }
+
+  if (!package_context->package_exists) {
+    return Error() << package << " is not found in " << container_;
+  }
+
+  auto flag_context = aconfig_storage::get_flag_read_context(
+      *flag_map_, package_context->package_id, flag);
+  if (!flag_context.ok()) {
+    return Error() << "Failed to get flag offset of " << flag
+                   << " in " << container_ << " :" << flag_context.error();
+  }
+
+  if (!flag_context->flag_exists) {
+    return Error() << flag << " is not found in " << container_;
+  }
+
+  uint32_t index = package_context->boolean_start_index + flag_context->flag_index;
+  index_cache_[key] = index;
+  return index;
+}
+
+/// Read a boolean flag value by its index
+Result<bool> ValueSnapshotReader::GetBooleanFlagValue(uint32_t index) {
+  bool value = false;
+  auto result = ReadConsistent(&index, 1, [&](size_t, bool flag_value) {
+    value = flag_value;
+  });
+  if (!result.ok()) {
+    return Error() << result.error();
+  }
+  return value;
+}
+
+/// Read a boolean flag value by its package and flag name
+Result<bool> ValueSnapshotReader::GetBooleanFlagValue(const std::string& package,
+                                                      const std::string& flag) {
+  for (int remap = 0; remap < kMaxRemapAttempts; remap++) {
+    auto index = GetBooleanFlagIndex(package, flag);
+    if (!index.ok()) {
+      return Error() << index.error();
+    }
+
+    // if the snapshot was replaced during the read, the index may be from the
+    // previous layout, look the flag up again
+    auto map_count = map_count_;
+    auto value = GetBooleanFlagValue(*index);
+    if (map_count == map_count_) {
+      return value;
+    }
+  }
+
+  return Error() << "Value snapshot of " << container_ << " keeps being replaced";
+}
+
+/// Read several boolean flag values from the same snapshot generation
+Result<uint64_t> ValueSnapshotReader::GetBooleanFlagValues(
+    const std::vector<uint32_t>& indices, std::vector<bool>* values) {
+  values->resize(indices.size());
+  return ReadConsistent(indices.data(), indices.size(), [&](size_t i, bool value) {
+    (*values)[i] = value;
+  });
+}
+
+/// Read flag values from one snapshot generation, retrying while an update is in
+/// progress and mapping the snapshot again if it was replaced
+template <typename Store>
+Result<uint64_t> ValueSnapshotReader::ReadConsistent(const uint32_t* indices,
+                                                     size_t count,
+                                                     Store store) {
+  for (int remap = 0; remap < kMaxRemapAttempts; remap++) {
+    auto* header = static_cast<const ValueSnapshotHeader*>(map_ptr_);
+    auto* snapshot_values = static_cast<const uint8_t*>(map_ptr_) + header->values_offset;
+    for (size_t i = 0; i < count; i++) {
+      if (indices[i] >= header->num_flags) {
+        return Error() << "Flag value index " << indices[i] << " is out of range for "
+                       << container_;
+      }
+    }
+
+    for (int attempt = 0; attempt < kMaxReadAttempts; attempt++) {
+      uint64_t begin = header->sequence.load(std::memory_order_acquire);
+      if (begin == kValueSnapshotRetired) {
+        break;
+      }
+      if (begin & 1) {
+        sched_yield();
+        continue;
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        store(i, __atomic_load_n(&snapshot_values[indices[i]], __ATOMIC_RELAXED) != 0);
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header->sequence.load(std::memory_order_relaxed) == begin) {
+        return begin / 2;
+      }
+    }
+
+    if (header->sequence.load(std::memory_order_acquire) != kValueSnapshotRetired) {
+      return Error() << "Timed out reading a consistent value snapshot of " << container_;
+    }
+
+    // aconfigd replaced the snapshot file, map the new one
+    auto map_result = Map();
+    if (!map_result.ok()) {
+      return Error() << map_result.error();
+    }
+  }
+
+  return Error() << "Value snapshot of " << container_ << " keeps being replaced";
+}
+
+} // namespace aconfigd
+} // namespace android
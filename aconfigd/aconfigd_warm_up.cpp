@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+
+#include "aconfigd_mapping_cache.h"
+#include "aconfigd_stats.h"
+#include "aconfigd_warm_up.h"
+
+namespace android {
+namespace aconfigd {
+
+namespace {
+
+/// Read a byte of every page of a mapping, so it is resident and mapped by the time
+/// this returns
+uint8_t TouchPages(const aconfig_storage::MappedStorageFile& file) {
+  static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  auto const* bytes = static_cast<const volatile uint8_t*>(file.file_ptr);
+  uint8_t sum = 0;
+  for (size_t offset = 0; offset < file.file_size; offset += page_size) {
+    sum += bytes[offset];
+  }
+  return sum;
+}
+
+} // namespace
+
+/// Warm up the storage files of every registered container
+WarmUpResult WarmUpStorageFiles() {
+  auto result = WarmUpResult();
+  auto start_ns = NowNs();
+
+  // readahead of all files is in flight at once before waiting on any of them
+  auto mappings = std::vector<ReadOnlyMapping>();
+  for (auto const& container : GetReadOnlyStorageContainers()) {
+    result.num_containers++;
+    for (auto file_type : {aconfig_storage::StorageFileType::package_map,
+                           aconfig_storage::StorageFileType::flag_map,
+                           aconfig_storage::StorageFileType::flag_val}) {
+      auto mapping = GetReadOnlyMapping(container, file_type);
+      if (!mapping.ok()) {
+        LOG(WARNING) << "Failed to map storage file of " << container
+                     << " for warm up: " << mapping.error();
+        continue;
+      }
+      auto const& file = **mapping;
+      if (madvise(file.file_ptr, file.file_size, MADV_WILLNEED) == -1) {
+        PLOG(WARNING) << "madvise() failed for a storage file of " << container;
+      }
+      result.num_files++;
+      result.num_bytes += file.file_size;
+      mappings.push_back(*mapping);
+    }
+  }
+
+  for (auto const& mapping : mappings) {
+    TouchPages(*mapping);
+  }
+
+  result.duration_ns = NowNs() - start_ns;
+  return result;
+}
+
+/// Run the warm up on a background thread
+void StartStorageWarmUp() {
+  std::thread([]() {
+    auto result = WarmUpStorageFiles();
+    RecordWarmUp(result.duration_ns);
+    LOG(INFO) << "warmed up " << result.num_files << " storage files of "
+              << result.num_containers << " containers, " << result.num_bytes
+              << " bytes, in " << result.duration_ns / 1000000 << "ms";
+  }).detach();
+}
+
+} // namespace aconfigd
+} // namespace android
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace android {
+  namespace aconfigd {
+
+    /// What a storage file warm up covered and how long it took
+    struct WarmUpResult {
+      uint32_t num_containers = 0;
+      uint32_t num_files = 0;
+      size_t num_bytes = 0;
+      uint64_t duration_ns = 0;
+    };
+
+    /// Map the package map, flag map and flag value files of every registered
+    /// container through the read only mapping cache, ask the kernel to read them all
+    /// ahead at once, then wait for their pages to be resident. Queries that follow
+    /// find the mappings cached and take no page faults on them.
+    WarmUpResult WarmUpStorageFiles();
+
+    /// Run WarmUpStorageFiles on a background thread, the result is logged and
+    /// reported in stats
+    void StartStorageWarmUp();
+
+  } // namespace aconfigd
+} // namespace android
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace aconfig_storage {
+  struct MappedStorageFile;
+} // namespace aconfig_storage
+
+namespace android {
+  namespace aconfigd {
+
+    /// Default aconfig storage root, value snapshots are published in its flags dir
+    static constexpr char kAconfigStorageRoot[] = "/metadata/aconfig";
+
+    /// Value snapshot file magic, "ACVS"
+    static constexpr uint32_t kValueSnapshotMagic = 0x53564341;
+
+    /// Value snapshot file format version
+    static constexpr uint32_t kValueSnapshotVersion = 2;
+
+    /// Sequence number of a snapshot file that has been replaced by a new file, readers
+    /// should map the file again
+    static constexpr uint64_t kValueSnapshotRetired = ~static_cast<uint64_t>(0);
+
+    /// Header of a flag value snapshot file. The file holds the persistent boolean flag
+    /// values of a container, one byte per flag, starting at values_offset. aconfigd
+    /// updates the values in place under a seqlock: the sequence is odd while an update
+    /// is in progress, and is incremented to the next even number once it is done.
+    /// The map digests identify the layout the values are indexed by, a snapshot is
+    /// only updated in place while they stay the same.
+    struct ValueSnapshotHeader {
+      uint32_t magic;
+      uint32_t version;
+      std::atomic<uint64_t> sequence;
+      uint32_t num_flags;
+      uint32_t values_offset;
+      uint64_t package_map_digest;
+      uint64_t flag_map_digest;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                  "value snapshot sequence must be lock free to be shared");
+
+    /// Offset of the flag values in a value snapshot file, keeps them cache line aligned
+    static constexpr uint32_t kValueSnapshotValuesOffset = 64;
+
+    static_assert(sizeof(ValueSnapshotHeader) <= kValueSnapshotValuesOffset,
+                  "value snapshot header must fit before the values");
+
+    /// Get the value snapshot file path of a container
+    inline std::string GetValueSnapshotFile(const std::string& container,
+                                            const std::string& storage_root =
+                                                kAconfigStorageRoot) {
+      return storage_root + "/flags/" + container + ".snapshot";
+    }
+
+    /// Client side reader of a container's flag value snapshot. Flag values are read
+    /// straight out of the shared mapping without a round trip to aconfigd.
+    class ValueSnapshotReader {
+     public:
+      /// Map the value snapshot of a container, storage_root is only relocated off
+      /// device
+      static base::Result<std::unique_ptr<ValueSnapshotReader>> Open(
+          const std::string& container,
+          const std::string& storage_root = kAconfigStorageRoot);
+
+      ~ValueSnapshotReader();
+
+      ValueSnapshotReader(const ValueSnapshotReader&) = delete;
+      ValueSnapshotReader& operator=(const ValueSnapshotReader&) = delete;
+
+      /// Find the boolean flag value index of a flag, the index is cached until the
+      /// snapshot is replaced
+      base::Result<uint32_t> GetBooleanFlagIndex(const std::string& package,
+                                                 const std::string& flag);
+
+      /// Read a boolean flag value by its index
+      base::Result<bool> GetBooleanFlagValue(uint32_t index);
+
+      /// Read a boolean flag value by its package and flag name
+      base::Result<bool> GetBooleanFlagValue(const std::string& package,
+                                             const std::string& flag);
+
+      /// Read several boolean flag values from the same snapshot generation. The
+      /// generation the values were read from is returned.
+      base::Result<uint64_t> GetBooleanFlagValues(const std::vector<uint32_t>& indices,
+                                                  std::vector<bool>* values);
+
+     private:
+      ValueSnapshotReader(const std::string& container, const std::string& storage_root);
+
+      base::Result<void> Map();
+      void Unmap();
+
+      /// Map the package and flag maps the current snapshot is laid out by, if they
+      /// are not mapped yet
+      base::Result<void> MapStorageMaps();
+
+      /// Read the values at indices from one consistent snapshot generation, passing
+      /// each to store(i, value). The snapshot is mapped again if it was replaced.
+      template <typename Store>
+      base::Result<uint64_t> ReadConsistent(const uint32_t* indices,
+                                            size_t count,
+                                            Store store);
+
+      std::string container_;
+      std::string storage_root_;
+      void* map_ptr_ = nullptr;
+      size_t map_size_ = 0;
+      /// Number of times a snapshot was mapped, index_cache_ is emptied on each
+      uint64_t map_count_ = 0;
+      std::unordered_map<std::string, uint32_t> index_cache_;
+      /// Package and flag maps, mapped on the first index lookup and unmapped with the
+      /// snapshot
+      std::unique_ptr<aconfig_storage::MappedStorageFile> package_map_;
+      std::unique_ptr<aconfig_storage::MappedStorageFile> flag_map_;
+    };
+
+  } // namespace aconfigd
+} // namespace android